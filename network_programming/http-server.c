@@ -1,6 +1,8 @@
 #define _POSIX_C_SOURCE 200809L
 #define _DARWIN_C_SOURCE
+#define _DEFAULT_SOURCE
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +11,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -20,6 +26,25 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <strings.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/event.h>
+#endif
+
+/* Holds back a partial segment when a file body follows the head. */
+#ifdef MSG_MORE
+#define SEND_MORE_FLAG MSG_MORE
+#else
+#define SEND_MORE_FLAG 0
+#endif
 
 #define MAX_URI_LEN 2048
 #define MAX_PATH_LEN 4096
@@ -33,6 +58,41 @@
 #define MAX_SEARCH_KEY_LEN 1000
 #define BACKEND_TIMEOUT_SEC 5
 #define CLIENT_TIMEOUT_SEC 30
+#define LINGER_TIMEOUT_SEC 2
+#define KEEPALIVE_TIMEOUT_SEC 5
+#define KEEPALIVE_MAX_REQUESTS 100
+#define INPUT_BUFFER_INITIAL 4096
+#define INPUT_BUFFER_LIMIT 16384
+#define FILE_CHUNK_LEN 65536
+#define SENDFILE_CHUNK_LEN (1024 * 1024)
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define LISTEN_BACKLOG 128
+#define MAX_BACKEND_QUEUE 1024
+#define QUEUE_BUDGET_MS 2500
+#define RETRY_AFTER_HEADER "Retry-After: 1\r\n"
+#define MAX_BYTE_RANGES 16
+#define STATIC_CACHE_BUCKETS 1024
+#define STATIC_CACHE_MAX_FILE (256 * 1024)
+#define STATIC_CACHE_MAX_BYTES (32 * 1024 * 1024)
+#define STATIC_CACHE_MAX_WATCHES 256
+#define BACKEND_POOL_SIZE 4
+#define MAX_BACKEND_CONNECTIONS 64
+#define MAX_BACKEND_ADDRESSES 8
+#define GZIP_MIN_LENGTH 256
+#define STREAM_START_LEN (16 * 1024)
+#define SEARCH_CACHE_BUCKETS 1024
+#define SEARCH_CACHE_MAX_ENTRIES 1024
+#define SEARCH_CACHE_MAX_BYTES (8 * 1024 * 1024)
+#define LIST_PAGE_DEFAULT_LIMIT 50
+#define LIST_PAGE_MAX_LIMIT 1000
+#define METRICS_LATENCY_BUCKETS 16
+#define METRICS_MIN_STATUS 100
+#define METRICS_STATUS_CODES 500
+#define ACCESS_LOG_SLOTS 2048
+#define ACCESS_LOG_LINE_MAX 512
+#define ACCESS_LOG_BATCH_BYTES (64 * 1024)
+#define ACCESS_LOG_DRAIN_MS 5
 
 static void die(const char *msg) {
     perror(msg);
@@ -312,55 +372,52 @@ static int parse_port(const char *text, unsigned short *result) {
 
 enum HttpLineResult {
     HTTP_LINE_OK = 0,
-    HTTP_LINE_EOF,
+    HTTP_LINE_INCOMPLETE,
     HTTP_LINE_TOO_LONG,
     HTTP_LINE_NUL
 };
 
-enum PostReadResult {
-    POST_READ_OK = 0,
-    POST_READ_BAD_REQUEST,
-    POST_READ_LENGTH_REQUIRED,
-    POST_READ_PAYLOAD_TOO_LARGE,
-    POST_READ_UNSUPPORTED_MEDIA_TYPE,
-    POST_READ_UNSUPPORTED_TRANSFER_ENCODING,
-    POST_READ_HEADERS_TOO_LARGE
+enum RequestReadResult {
+    REQUEST_READ_OK = 0,
+    REQUEST_READ_BAD_REQUEST,
+    REQUEST_READ_LENGTH_REQUIRED,
+    REQUEST_READ_PAYLOAD_TOO_LARGE,
+    REQUEST_READ_UNSUPPORTED_MEDIA_TYPE,
+    REQUEST_READ_UNSUPPORTED_TRANSFER_ENCODING,
+    REQUEST_READ_HEADERS_TOO_LARGE
 };
 
 /*
- * Reads one HTTP line without relying on strlen() to detect its end. This is
- * important for rejecting raw NUL bytes instead of treating the bytes after
- * them as a separate, invisible part of the request.
+ * Scans one HTTP line in buffered input without relying on strlen() to detect
+ * its end. This is important for rejecting raw NUL bytes instead of treating
+ * the bytes after them as a separate, invisible part of the request. A line
+ * that has not yet arrived in full reports HTTP_LINE_INCOMPLETE, and *scanned
+ * remembers how far it was checked so the next call resumes there instead of
+ * rescanning bytes that arrived earlier. Both searches use memchr, which libc
+ * implements with vector instructions.
  */
-static enum HttpLineResult read_http_line(
-    FILE *fp,
-    char *line,
-    size_t line_size,
+static enum HttpLineResult scan_http_line(
+    const char *data,
+    size_t available,
     size_t max_wire_length,
+    size_t *scanned,
     size_t *wire_length
 ) {
-    size_t used = 0;
-    size_t total = 0;
-    int c;
-
-    if (!fp || !line || line_size == 0) return HTTP_LINE_EOF;
-
-    while ((c = fgetc(fp)) != EOF) {
-        total++;
-        if (c == '\0') return HTTP_LINE_NUL;
-        if (total > max_wire_length || used + 1 >= line_size) {
-            return HTTP_LINE_TOO_LONG;
-        }
-        if (c == '\n') {
-            line[used] = '\0';
-            if (wire_length) *wire_length = total;
-            return HTTP_LINE_OK;
-        }
-        line[used++] = (char)c;
+    size_t limit = available < max_wire_length ? available : max_wire_length;
+    const char *newline = memchr(data + *scanned, '\n', limit - *scanned);
+    size_t end = newline ? (size_t)(newline - data) + 1 : limit;
+
+    if (memchr(data + *scanned, '\0', end - *scanned) != NULL) return HTTP_LINE_NUL;
+    if (newline) {
+        *scanned = 0;
+        *wire_length = end;
+        return HTTP_LINE_OK;
     }
+    if (available > max_wire_length) return HTTP_LINE_TOO_LONG;
 
-    if (wire_length) *wire_length = total;
-    return HTTP_LINE_EOF;
+    *scanned = limit;
+    *wire_length = available;
+    return HTTP_LINE_INCOMPLETE;
 }
 
 static int is_header_name_char(unsigned char c) {
@@ -412,175 +469,518 @@ static int is_form_content_type(const char *value) {
            strncasecmp(start, expected, sizeof(expected) - 1) == 0;
 }
 
-static enum PostReadResult read_post_body(
-    FILE *fp,
-    char *body,
-    size_t body_size,
-    size_t *body_length
-) {
-    char line[MAX_HEADER_LINE_LEN + 1];
-    size_t total_header_bytes = 0;
-    size_t content_length = 0;
-    int saw_content_length = 0;
-    int saw_content_type = 0;
-    int valid_content_type = 0;
-    int saw_transfer_encoding = 0;
-    int reached_end_of_headers = 0;
+struct HttpRequest {
+    char *line;
+    char *method;
+    char *target;
+    char *version;
+    char *path;
+    const char *query;
+    int is_get;
+    int is_post;
+    const char *allowed_methods;
+    size_t header_bytes;
+    size_t content_length;
+    int saw_content_length;
+    int saw_content_type;
+    int valid_content_type;
+    int saw_transfer_encoding;
+    int connection_close;
+    int connection_keep_alive;
+    char *if_none_match;
+    char *if_modified_since;
+    char *range;
+    char *if_range;
+    int range_repeated;
+    char *accept_encoding;
+    char *body;
+    size_t body_length;
+};
+
+static void http_request_reset(struct HttpRequest *request) {
+    free(request->line);
+    free(request->if_none_match);
+    free(request->if_modified_since);
+    free(request->range);
+    free(request->if_range);
+    free(request->accept_encoding);
+    free(request->body);
+    memset(request, 0, sizeof(*request));
+    request->query = "";
+}
+
+/*
+ * Records the persistence options of a comma-separated Connection header.
+ * Tokens are case-insensitive and may repeat across several header lines.
+ */
+static void parse_connection_tokens(const char *value, struct HttpRequest *request) {
+    while (*value) {
+        const char *end = strchr(value, ',');
+        const char *token_end;
+
+        if (!end) end = value + strlen(value);
+        while (value < end && (*value == ' ' || *value == '\t')) value++;
+        token_end = end;
+        while (token_end > value && (token_end[-1] == ' ' || token_end[-1] == '\t')) {
+            token_end--;
+        }
 
-    if (!fp || !body || body_size < MAX_FORM_BODY_LEN + 1) {
-        return POST_READ_BAD_REQUEST;
+        if ((size_t)(token_end - value) == 5 &&
+            strncasecmp(value, "close", 5) == 0) {
+            request->connection_close = 1;
+        } else if ((size_t)(token_end - value) == 10 &&
+                   strncasecmp(value, "keep-alive", 10) == 0) {
+            request->connection_keep_alive = 1;
+        }
+        value = *end ? end + 1 : end;
     }
+}
 
-    while (!reached_end_of_headers) {
-        size_t wire_length = 0;
-        enum HttpLineResult line_result = read_http_line(
-            fp,
-            line,
-            sizeof(line),
-            MAX_HEADER_LINE_LEN,
-            &wire_length);
+/*
+ * Keeps a list-valued header that may be split across several lines, joined
+ * with commas as if it had been sent on one line.
+ */
+static int append_list_header(char **list, const char *value) {
+    size_t old_length = *list ? strlen(*list) : 0;
+    size_t value_length = strlen(value);
+    char *joined;
 
-        if (line_result == HTTP_LINE_TOO_LONG) {
-            return POST_READ_HEADERS_TOO_LARGE;
+    if (old_length == 0) {
+        joined = strdup(value);
+    } else {
+        joined = (char *)realloc(*list, old_length + 2 + value_length + 1);
+        if (joined) {
+            memcpy(joined + old_length, ", ", 2);
+            memcpy(joined + old_length + 2, value, value_length + 1);
         }
-        if (line_result != HTTP_LINE_OK) {
-            return POST_READ_BAD_REQUEST;
+    }
+    if (!joined) return -1;
+    if (old_length == 0) free(*list);
+    *list = joined;
+    return 0;
+}
+
+enum ContentEncoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BR
+};
+
+#define ACCEPT_GZIP (1 << ENCODING_GZIP)
+#define ACCEPT_BR (1 << ENCODING_BR)
+
+/* True for "q=0", "q=0.0", and so on; any other weight accepts the coding. */
+static int quality_is_zero(const char *parameters, const char *end) {
+    while (parameters < end) {
+        const char *next = memchr(parameters, ';', (size_t)(end - parameters));
+
+        if (!next) next = end;
+        while (parameters < next && (*parameters == ' ' || *parameters == '\t')) {
+            parameters++;
         }
-        if (wire_length > MAX_HEADER_BYTES - total_header_bytes) {
-            return POST_READ_HEADERS_TOO_LARGE;
+        if (next - parameters >= 3 &&
+            (parameters[0] == 'q' || parameters[0] == 'Q') &&
+            parameters[1] == '=') {
+            const char *weight = parameters + 2;
+
+            if (*weight != '0') return 0;
+            weight++;
+            if (weight < next && *weight == '.') {
+                weight++;
+                while (weight < next && *weight == '0') weight++;
+            }
+            while (weight < next && (*weight == ' ' || *weight == '\t')) weight++;
+            return weight == next;
         }
-        total_header_bytes += wire_length;
+        parameters = next < end ? next + 1 : end;
+    }
+    return 0;
+}
 
-        size_t line_length = strlen(line);
-        if (line_length > 0 && line[line_length - 1] == '\r') {
-            line[--line_length] = '\0';
-        }
-        if (memchr(line, '\r', line_length) != NULL) {
-            return POST_READ_BAD_REQUEST;
+/*
+ * Returns the ACCEPT_* bits for the codings an Accept-Encoding list allows.
+ * A coding named with q=0 is refused even when "*" would accept it, and
+ * x-gzip is the legacy name for gzip. Without the header only identity is
+ * sent.
+ */
+static int accepted_encodings(const char *list) {
+    int named = 0;
+    int accepted = 0;
+    int wildcard = 0;
+
+    if (!list) return 0;
+    while (*list) {
+        const char *end = strchr(list, ',');
+        const char *token_end;
+        const char *parameters;
+        size_t token_length;
+        int bit = 0;
+        int refused;
+
+        if (!end) end = list + strlen(list);
+        while (list < end && (*list == ' ' || *list == '\t')) list++;
+        parameters = memchr(list, ';', (size_t)(end - list));
+        if (!parameters) parameters = end;
+        token_end = parameters;
+        while (token_end > list && (token_end[-1] == ' ' || token_end[-1] == '\t')) {
+            token_end--;
         }
-        if (line_length == 0) {
-            reached_end_of_headers = 1;
-            break;
+        token_length = (size_t)(token_end - list);
+        refused = parameters < end && quality_is_zero(parameters + 1, end);
+
+        if ((token_length == 4 && strncasecmp(list, "gzip", 4) == 0) ||
+            (token_length == 6 && strncasecmp(list, "x-gzip", 6) == 0)) {
+            bit = ACCEPT_GZIP;
+        } else if (token_length == 2 && strncasecmp(list, "br", 2) == 0) {
+            bit = ACCEPT_BR;
+        } else if (token_length == 1 && *list == '*') {
+            wildcard = refused ? -1 : 1;
         }
-        if (line[0] == ' ' || line[0] == '\t') {
-            return POST_READ_BAD_REQUEST;
+        if (bit) {
+            named |= bit;
+            if (refused) {
+                accepted &= ~bit;
+            } else {
+                accepted |= bit;
+            }
         }
+        list = *end ? end + 1 : end;
+    }
+    if (wildcard > 0) accepted |= (ACCEPT_GZIP | ACCEPT_BR) & ~named;
+    return accepted;
+}
 
-        char *colon = strchr(line, ':');
-        if (!colon || colon == line) return POST_READ_BAD_REQUEST;
-        for (char *p = line; p < colon; p++) {
-            if (!is_header_name_char((unsigned char)*p)) {
-                return POST_READ_BAD_REQUEST;
-            }
+enum KnownHeader {
+    HEADER_OTHER,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_CONNECTION,
+    HEADER_IF_NONE_MATCH,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE
+};
+
+/* Headers the server acts on; every other field is validated and skipped. */
+static const struct {
+    const char *name;
+    size_t length;
+    enum KnownHeader header;
+} known_headers[] = {
+    { "Content-Length", 14, HEADER_CONTENT_LENGTH },
+    { "Content-Type", 12, HEADER_CONTENT_TYPE },
+    { "Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING },
+    { "Connection", 10, HEADER_CONNECTION },
+    { "If-None-Match", 13, HEADER_IF_NONE_MATCH },
+    { "Accept-Encoding", 15, HEADER_ACCEPT_ENCODING },
+    { "If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE },
+    { "Range", 5, HEADER_RANGE },
+    { "If-Range", 8, HEADER_IF_RANGE }
+};
+
+static enum KnownHeader known_header(const char *name, size_t length) {
+    for (size_t i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]); i++) {
+        if (known_headers[i].length == length &&
+            strncasecmp(name, known_headers[i].name, length) == 0) {
+            return known_headers[i].header;
         }
+    }
+    return HEADER_OTHER;
+}
+
+/*
+ * Validates one header line (without its LF) in place in the input buffer
+ * and records the framing headers that decide how the body is read. Only
+ * the few values kept past this call are copied. Obsolete line folding,
+ * bare CR bytes, and control characters in values are rejected.
+ */
+static enum RequestReadResult parse_header_line(
+    char *line,
+    size_t line_length,
+    struct HttpRequest *request
+) {
+    if (line_length > 0 && line[line_length - 1] == '\r') {
+        line[--line_length] = '\0';
+    }
+    if (line_length == 0 || line[0] == ' ' || line[0] == '\t') {
+        return REQUEST_READ_BAD_REQUEST;
+    }
 
-        *colon = '\0';
-        char *value = colon + 1;
-        while (*value == ' ' || *value == '\t') value++;
-        char *value_end = value + strlen(value);
-        while (value_end > value &&
-               (value_end[-1] == ' ' || value_end[-1] == '\t')) {
-            *--value_end = '\0';
+    char *colon = memchr(line, ':', line_length);
+    if (!colon || colon == line) return REQUEST_READ_BAD_REQUEST;
+    for (const char *p = line; p < colon; p++) {
+        if (!is_header_name_char((unsigned char)*p)) {
+            return REQUEST_READ_BAD_REQUEST;
         }
-        for (char *p = value; *p; p++) {
-            unsigned char c = (unsigned char)*p;
-            if ((c < 32 && c != '\t') || c == 127) {
-                return POST_READ_BAD_REQUEST;
-            }
+    }
+
+    /* The control-character check also catches a CR inside the value. */
+    char *value = colon + 1;
+    char *value_end = line + line_length;
+    for (const char *p = value; p < value_end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c < 32 && c != '\t') || c == 127) {
+            return REQUEST_READ_BAD_REQUEST;
         }
+    }
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+    }
+    *value_end = '\0';
 
-        if (strcasecmp(line, "Content-Length") == 0) {
-            if (saw_content_length ||
-                parse_content_length_value(value, &content_length) < 0) {
-                return POST_READ_BAD_REQUEST;
+    switch (known_header(line, (size_t)(colon - line))) {
+        case HEADER_CONTENT_LENGTH:
+            if (request->saw_content_length ||
+                parse_content_length_value(value, &request->content_length) < 0) {
+                return REQUEST_READ_BAD_REQUEST;
             }
-            saw_content_length = 1;
-        } else if (strcasecmp(line, "Content-Type") == 0) {
-            if (saw_content_type) return POST_READ_BAD_REQUEST;
-            saw_content_type = 1;
-            valid_content_type = is_form_content_type(value);
-        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
-            saw_transfer_encoding = 1;
+            request->saw_content_length = 1;
+            break;
+        case HEADER_CONTENT_TYPE:
+            if (request->saw_content_type) return REQUEST_READ_BAD_REQUEST;
+            request->saw_content_type = 1;
+            request->valid_content_type = is_form_content_type(value);
+            break;
+        case HEADER_TRANSFER_ENCODING:
+            request->saw_transfer_encoding = 1;
+            break;
+        case HEADER_CONNECTION:
+            parse_connection_tokens(value, request);
+            break;
+        case HEADER_IF_NONE_MATCH:
+            if (append_list_header(&request->if_none_match, value) < 0) {
+                return REQUEST_READ_BAD_REQUEST;
+            }
+            break;
+        case HEADER_ACCEPT_ENCODING:
+            if (append_list_header(&request->accept_encoding, value) < 0) {
+                return REQUEST_READ_BAD_REQUEST;
+            }
+            break;
+        case HEADER_IF_MODIFIED_SINCE:
+            /* A repeated date is ambiguous, so only the first one counts. */
+            if (!request->if_modified_since) {
+                request->if_modified_since = strdup(value);
+                if (!request->if_modified_since) return REQUEST_READ_BAD_REQUEST;
+            }
+            break;
+        case HEADER_RANGE:
+        case HEADER_IF_RANGE: {
+            char **slot = colon - line == 5 ? &request->range : &request->if_range;
+            /* Repeated range headers are ignored rather than guessed at. */
+            if (*slot) {
+                request->range_repeated = 1;
+            } else {
+                *slot = strdup(value);
+                if (!*slot) return REQUEST_READ_BAD_REQUEST;
+            }
+            break;
         }
+        case HEADER_OTHER:
+            break;
     }
+    return REQUEST_READ_OK;
+}
 
-    if (saw_transfer_encoding && saw_content_length) {
-        return POST_READ_BAD_REQUEST;
+/*
+ * Called once the blank line ending the header block has arrived. Form posts
+ * must declare their length; a GET body is tolerated only when it is framed
+ * and small enough to discard.
+ */
+static enum RequestReadResult finish_request_headers(
+    const struct HttpRequest *request
+) {
+    if (request->saw_transfer_encoding && request->saw_content_length) {
+        return REQUEST_READ_BAD_REQUEST;
     }
-    if (saw_transfer_encoding) {
-        return POST_READ_UNSUPPORTED_TRANSFER_ENCODING;
+    if (request->saw_transfer_encoding) {
+        return REQUEST_READ_UNSUPPORTED_TRANSFER_ENCODING;
     }
-    if (!saw_content_length) return POST_READ_LENGTH_REQUIRED;
-    if (content_length > MAX_FORM_BODY_LEN) {
-        return POST_READ_PAYLOAD_TOO_LARGE;
+    if (request->is_post && !request->saw_content_length) {
+        return REQUEST_READ_LENGTH_REQUIRED;
     }
-
-    size_t received = 0;
-    while (received < content_length) {
-        size_t n = fread(body + received, 1, content_length - received, fp);
-        if (n == 0) return POST_READ_BAD_REQUEST;
-        received += n;
+    if (request->content_length > MAX_FORM_BODY_LEN) {
+        return REQUEST_READ_PAYLOAD_TOO_LARGE;
     }
-    if (!saw_content_type || !valid_content_type) {
-        return POST_READ_UNSUPPORTED_MEDIA_TYPE;
+    return REQUEST_READ_OK;
+}
+
+static enum RequestReadResult finish_request_body(
+    struct HttpRequest *request,
+    const char *body,
+    size_t body_length
+) {
+    if (!request->is_post) return REQUEST_READ_OK;
+    if (!request->saw_content_type || !request->valid_content_type) {
+        return REQUEST_READ_UNSUPPORTED_MEDIA_TYPE;
     }
-    if (memchr(body, '\0', received) != NULL) {
-        return POST_READ_BAD_REQUEST;
+    if (memchr(body, '\0', body_length) != NULL) {
+        return REQUEST_READ_BAD_REQUEST;
     }
-    body[received] = '\0';
-    if (body_length) *body_length = received;
-    return POST_READ_OK;
+
+    request->body = (char *)malloc(body_length + 1);
+    if (!request->body) return REQUEST_READ_BAD_REQUEST;
+    memcpy(request->body, body, body_length);
+    request->body[body_length] = '\0';
+    request->body_length = body_length;
+    return REQUEST_READ_OK;
+}
+
+/*
+ * Responses are assembled in memory and written by the event loop as the
+ * socket accepts data. Allocation failures are sticky so handlers can append
+ * freely and the caller checks once before sending.
+ */
+struct ResponseBuffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+};
+
+static void buffer_reset(struct ResponseBuffer *buffer) {
+    buffer->length = 0;
+    buffer->failed = 0;
 }
 
-static ssize_t send_all(int sock, const void *buffer, size_t length, int flags) {
-    const unsigned char *cursor = (const unsigned char *)buffer;
-    size_t sent = 0;
+static void buffer_free(struct ResponseBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->failed = 0;
+}
 
-    while (sent < length) {
-        ssize_t n = send(sock, cursor + sent, length - sent, flags);
-        if (n > 0) {
-            sent += (size_t)n;
-            continue;
+static int buffer_reserve(struct ResponseBuffer *buffer, size_t additional) {
+    size_t needed;
+    size_t capacity;
+    char *data;
+
+    if (buffer->failed) return -1;
+    if (additional > SIZE_MAX - buffer->length) {
+        buffer->failed = 1;
+        return -1;
+    }
+    needed = buffer->length + additional;
+    if (needed <= buffer->capacity) return 0;
+
+    capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < needed) {
+        if (capacity > SIZE_MAX / 2) {
+            capacity = needed;
+            break;
         }
-        if (n < 0 && errno == EINTR) continue;
+        capacity *= 2;
+    }
+
+    data = (char *)realloc(buffer->data, capacity);
+    if (!data) {
+        buffer->failed = 1;
         return -1;
     }
-    return (ssize_t)sent;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int buffer_append(
+    struct ResponseBuffer *buffer,
+    const void *data,
+    size_t length
+) {
+    if (buffer_reserve(buffer, length) < 0) return -1;
+    if (length > 0) memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+static int buffer_append_text(struct ResponseBuffer *buffer, const char *text) {
+    return buffer_append(buffer, text, strlen(text));
 }
 
 /*
- * All response writes in this file use the complete-write semantics above.
- * Keeping the call signature identical prevents accidental raw send() calls.
+ * Compresses data into a new gzip stream in compressed, which must be empty.
+ * deflateBound sizes the output so a single Z_FINISH always completes.
  */
-#define send(sock, buffer, length, flags) send_all((sock), (buffer), (length), (flags))
-
-static int send_error_page(
-    int sock,
-    const char *status,
-    const char *extra_headers
+static int buffer_gzip(
+    struct ResponseBuffer *compressed,
+    const char *data,
+    size_t length,
+    int level
 ) {
-    char response[1024];
-    int length = snprintf(
-        response,
-        sizeof(response),
-        "HTTP/1.0 %s\r\n"
-        "Content-Type: text/html\r\n"
-        "%s"
-        "Connection: close\r\n"
-        "\r\n"
-        "<!DOCTYPE html><html><body><h1>%s</h1></body></html>\n",
-        status,
-        extra_headers ? extra_headers : "",
-        status);
+    z_stream stream;
+    int result;
+
+    if (length > UINT_MAX) return -1;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    /* Older zlib releases leave the gzip header and trailer out of the bound. */
+    if (buffer_reserve(compressed, deflateBound(&stream, (uLong)length) + 18) < 0) {
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)length;
+    stream.next_out = (Bytef *)compressed->data;
+    stream.avail_out = (uInt)compressed->capacity;
+    result = deflate(&stream, Z_FINISH);
+    compressed->length = compressed->capacity - stream.avail_out;
+    deflateEnd(&stream);
+    return result == Z_STREAM_END ? 0 : -1;
+}
+
+static int buffer_printf(struct ResponseBuffer *buffer, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int buffer_printf(struct ResponseBuffer *buffer, const char *format, ...) {
+    va_list arguments;
+    int length;
+
+    if (buffer_reserve(buffer, 256) < 0) return -1;
+    va_start(arguments, format);
+    length = vsnprintf(
+        buffer->data + buffer->length,
+        buffer->capacity - buffer->length,
+        format,
+        arguments);
+    va_end(arguments);
+    if (length < 0) {
+        buffer->failed = 1;
+        return -1;
+    }
+
+    if ((size_t)length >= buffer->capacity - buffer->length) {
+        if (buffer_reserve(buffer, (size_t)length + 1) < 0) return -1;
+        va_start(arguments, format);
+        vsnprintf(
+            buffer->data + buffer->length,
+            buffer->capacity - buffer->length,
+            format,
+            arguments);
+        va_end(arguments);
+    }
+    buffer->length += (size_t)length;
+    return 0;
+}
 
-    if (length < 0 || (size_t)length >= sizeof(response)) return -1;
-    return send(sock, response, (size_t)length, 0) < 0 ? -1 : 0;
+static int is_api_path(const char *path) {
+    return strcmp(path, "/api/records") == 0 ||
+        strncmp(path, "/api/records/", 13) == 0 ||
+        strcmp(path, "/api/search") == 0;
 }
 
 static const char *allowed_db_methods(const char *path) {
     if (strcmp(path, "/mdb-lookup") == 0 ||
         strcmp(path, "/mdb-list") == 0 ||
-        strcmp(path, "/mdb-edit") == 0) {
+        strcmp(path, "/mdb-edit") == 0 ||
+        strcmp(path, "/metrics") == 0 ||
+        is_api_path(path)) {
         return "GET";
     }
     if (strcmp(path, "/mdb-add") == 0) return "GET, POST";
@@ -604,21 +1004,21 @@ static int db_method_is_allowed(const char *allowed, const char *method) {
     return 0;
 }
 
-static const char *post_read_status(enum PostReadResult result) {
+static const char *request_read_status(enum RequestReadResult result) {
     switch (result) {
-        case POST_READ_BAD_REQUEST:
+        case REQUEST_READ_BAD_REQUEST:
             return "400 Bad Request";
-        case POST_READ_LENGTH_REQUIRED:
+        case REQUEST_READ_LENGTH_REQUIRED:
             return "411 Length Required";
-        case POST_READ_PAYLOAD_TOO_LARGE:
+        case REQUEST_READ_PAYLOAD_TOO_LARGE:
             return "413 Payload Too Large";
-        case POST_READ_UNSUPPORTED_MEDIA_TYPE:
+        case REQUEST_READ_UNSUPPORTED_MEDIA_TYPE:
             return "415 Unsupported Media Type";
-        case POST_READ_UNSUPPORTED_TRANSFER_ENCODING:
+        case REQUEST_READ_UNSUPPORTED_TRANSFER_ENCODING:
             return "501 Not Implemented";
-        case POST_READ_HEADERS_TOO_LARGE:
+        case REQUEST_READ_HEADERS_TOO_LARGE:
             return "431 Request Header Fields Too Large";
-        case POST_READ_OK:
+        case REQUEST_READ_OK:
             break;
     }
     return "500 Internal Server Error";
@@ -853,1023 +1253,4878 @@ static enum StaticFileResult open_static_file(
     return STATIC_FILE_OK;
 }
 
-static const char *static_content_type(const char *uri, int serves_index) {
+/*
+ * Media type and Cache-Control policy by file extension. The last row is the
+ * fallback. HTML is revalidated on every use so edits show up immediately;
+ * the Cache-Control values can be replaced with --cache-control.
+ */
+struct StaticType {
     const char *extension;
+    const char *content_type;
+    const char *cache_control;
+};
 
-    if (serves_index) return "text/html";
-    extension = strrchr(uri, '.');
-    if (!extension || strchr(extension, '/')) return "application/octet-stream";
-    if (strcasecmp(extension, ".html") == 0 ||
-        strcasecmp(extension, ".htm") == 0) {
-        return "text/html";
-    }
-    if (strcasecmp(extension, ".jpg") == 0 ||
-        strcasecmp(extension, ".jpeg") == 0) {
-        return "image/jpeg";
-    }
-    if (strcasecmp(extension, ".png") == 0) return "image/png";
-    if (strcasecmp(extension, ".gif") == 0) return "image/gif";
-    return "application/octet-stream";
-}
-
-struct BackendConnection {
-    int sock;
-    FILE *fp;
-    char *serverName;
-    unsigned short serverPort;
+static struct StaticType static_types[] = {
+    { ".html", "text/html", "no-cache" },
+    { ".htm", "text/html", "no-cache" },
+    { ".jpg", "image/jpeg", "public, max-age=86400" },
+    { ".jpeg", "image/jpeg", "public, max-age=86400" },
+    { ".png", "image/png", "public, max-age=86400" },
+    { ".gif", "image/gif", "public, max-age=86400" },
+    { NULL, "application/octet-stream", "public, max-age=3600" }
 };
 
-static void close_backend(struct BackendConnection *backend) {
-    if (backend->fp) {
-        fclose(backend->fp);
-        backend->fp = NULL;
-        backend->sock = -1;
-    } else if (backend->sock >= 0) {
-        close(backend->sock);
-        backend->sock = -1;
+static struct StaticType *static_type_for_extension(const char *extension) {
+    struct StaticType *type = static_types;
+
+    while (type->extension &&
+           (!extension || strcasecmp(extension, type->extension) != 0)) {
+        type++;
     }
+    return type;
 }
 
-static int reconnect_backend(struct BackendConnection *backend) {
-    struct addrinfo hints;
-    struct addrinfo *addresses = NULL;
-    struct addrinfo *address;
-    char service[6];
-    int connected = 0;
-
-    close_backend(backend);
+static const char *static_content_type(
+    const char *uri,
+    int serves_index,
+    const char **cache_control
+) {
+    const char *extension = strrchr(uri, '.');
+    const struct StaticType *type;
 
-    if (snprintf(
-            service,
-            sizeof(service),
-            "%u",
-            (unsigned int)backend->serverPort) < 0) {
-        return -1;
+    if (serves_index) {
+        extension = ".html";
+    } else if (extension && strchr(extension, '/')) {
+        extension = NULL;
     }
+    type = static_type_for_extension(extension);
+    if (cache_control) *cache_control = type->cache_control;
+    return type->content_type;
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    if (getaddrinfo(
-            backend->serverName,
-            service,
-            &hints,
-            &addresses) != 0) {
-        errno = EHOSTUNREACH;
-        return -1;
+/*
+ * Applies one --cache-control EXT=VALUE option. EXT names a known extension
+ * with or without its dot, or "default" for every other file.
+ */
+static int set_static_cache_control(char *setting) {
+    char *value = strchr(setting, '=');
+    char extension[16];
+    struct StaticType *type;
+
+    if (!value || value == setting || value[1] == '\0') return -1;
+    *value++ = '\0';
+    for (const char *p = value; *p; p++) {
+        if ((unsigned char)*p < 32 || *p == 127) return -1;
     }
+    if (strlen(value) > 128) return -1;
 
-    for (address = addresses; address; address = address->ai_next) {
-        backend->sock = socket(
-            address->ai_family,
-            address->ai_socktype,
-            address->ai_protocol);
-        if (backend->sock < 0) {
-            continue;
+    if (strcmp(setting, "default") == 0) {
+        type = static_type_for_extension(NULL);
+    } else {
+        if (snprintf(extension, sizeof(extension), "%s%s",
+                setting[0] == '.' ? "" : ".", setting) >= (int)sizeof(extension)) {
+            return -1;
         }
+        type = static_type_for_extension(extension);
+        if (!type->extension) return -1;
+    }
+    type->cache_control = value;
+    return 0;
+}
 
-        if (set_socket_timeout(
-                backend->sock,
-                BACKEND_TIMEOUT_SEC) == 0 &&
-            connect(
-                backend->sock,
-                address->ai_addr,
-                address->ai_addrlen) == 0) {
-            connected = 1;
-            break;
-        }
+/*
+ * Strong validators for a static file. The ETag changes whenever the inode,
+ * size, or modification time does, which covers both in-place edits and
+ * files replaced by rename.
+ */
+struct StaticValidators {
+    char etag[80];
+    time_t modified;
+    char headers[384];
+    size_t headers_length;
+};
 
-        close(backend->sock);
-        backend->sock = -1;
-    }
-    freeaddrinfo(addresses);
+static const char *content_encoding_names[] = { NULL, "gzip", "br" };
 
-    if (!connected) {
-        errno = ECONNREFUSED;
-        return -1;
-    }
-    
-    backend->fp = fdopen(backend->sock, "r+");
-    if(!backend->fp) {
-        close(backend->sock);
-        backend->sock = -1;
+/*
+ * Every static response varies with Accept-Encoding, since a compressed
+ * sibling may appear at any time. An encoded representation gets its own
+ * ETag so caches never confuse it with the identity bytes.
+ */
+static int static_validators_init(
+    struct StaticValidators *validators,
+    const struct stat *file_stat,
+    const char *cache_control,
+    enum ContentEncoding encoding
+) {
+    const char *encoding_name = content_encoding_names[encoding];
+    struct tm modified_tm;
+    char modified_text[64];
+    long modified_nsec;
+    int length;
+
+#if defined(__APPLE__)
+    modified_nsec = file_stat->st_mtimespec.tv_nsec;
+#else
+    modified_nsec = file_stat->st_mtim.tv_nsec;
+#endif
+    length = snprintf(validators->etag, sizeof(validators->etag),
+        "\"%jx-%jx-%jx.%lx%s%s\"",
+        (uintmax_t)file_stat->st_ino,
+        (uintmax_t)file_stat->st_size,
+        (uintmax_t)file_stat->st_mtime,
+        modified_nsec,
+        encoding_name ? "-" : "",
+        encoding_name ? encoding_name : "");
+    if (length < 0 || (size_t)length >= sizeof(validators->etag)) return -1;
+
+    validators->modified = file_stat->st_mtime;
+    if (!gmtime_r(&validators->modified, &modified_tm) ||
+        strftime(modified_text, sizeof(modified_text),
+            "%a, %d %b %Y %H:%M:%S GMT", &modified_tm) == 0) {
         return -1;
     }
-    
-    setvbuf(backend->fp, NULL, _IONBF, 0);
-    
+
+    length = snprintf(validators->headers, sizeof(validators->headers),
+        "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: %s\r\n"
+        "Accept-Ranges: bytes\r\nVary: Accept-Encoding\r\n%s%s%s",
+        validators->etag, modified_text, cache_control,
+        encoding_name ? "Content-Encoding: " : "",
+        encoding_name ? encoding_name : "",
+        encoding_name ? "\r\n" : "");
+    if (length < 0 || (size_t)length >= sizeof(validators->headers)) return -1;
+    validators->headers_length = (size_t)length;
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if(argc != 5) {
-        fprintf(stderr, "usage: %s <server_port> <web_root> <mdb-lookup-host> <mdb-lookup-port>\n", argv[0]);
-        exit(1);
-    }
-    
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        die("signal failed");
+/* Weak comparison, as If-None-Match requires for GET. */
+static int etag_list_matches(const char *list, const char *etag) {
+    size_t etag_length = strlen(etag);
+    const char *p = list;
+
+    while (1) {
+        const char *end;
+
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') return 0;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (*p != '"' || !(end = strchr(p + 1, '"'))) return 0;
+        end++;
+        if ((size_t)(end - p) == etag_length &&
+            memcmp(p, etag, etag_length) == 0) {
+            return 1;
+        }
+        p = end;
     }
+}
 
-    unsigned short server_port;
-    if (parse_port(argv[1], &server_port) < 0) {
-        fprintf(stderr, "Error: Invalid server port\n");
-        exit(1);
-    }
-    
-    char *web_root = argv[2];
-    if (strlen(web_root) == 0 || strlen(web_root) > MAX_PATH_LEN) {
-        fprintf(stderr, "Error: Invalid web root path\n");
-        exit(1);
-    }
-    int web_root_fd = open(
-        web_root,
-        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-    if (web_root_fd < 0) {
-        die("open web root failed");
+/* Accepts the IMF-fixdate form, e.g. "Sun, 06 Nov 1994 08:49:37 GMT". */
+static int parse_http_date(const char *text, time_t *result) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char weekday[4];
+    char month[4];
+    char zone[4];
+    const char *found;
+    struct tm parsed;
+    int consumed = 0;
+
+    memset(&parsed, 0, sizeof(parsed));
+    if (sscanf(text, "%3[A-Za-z], %2d %3[A-Za-z] %4d %2d:%2d:%2d %3[A-Z]%n",
+            weekday, &parsed.tm_mday, month, &parsed.tm_year,
+            &parsed.tm_hour, &parsed.tm_min, &parsed.tm_sec, zone,
+            &consumed) != 8 ||
+        text[consumed] != '\0' ||
+        strcmp(zone, "GMT") != 0 ||
+        strlen(month) != 3) {
+        return -1;
     }
+    found = strstr(months, month);
+    if (!found || (found - months) % 3 != 0) return -1;
+    parsed.tm_mon = (int)(found - months) / 3;
+    parsed.tm_year -= 1900;
+    *result = timegm(&parsed);
+    return *result == (time_t)-1 ? -1 : 0;
+}
 
-    struct BackendConnection backend_conn;
-    backend_conn.serverName = argv[3];
-    backend_conn.sock = -1;
-    backend_conn.fp = NULL;
+/*
+ * If-None-Match takes precedence; If-Modified-Since is consulted only when
+ * no entity tags were sent, and an unparseable date is ignored.
+ */
+static int static_not_modified(
+    const struct HttpRequest *request,
+    const struct StaticValidators *validators
+) {
+    time_t since;
 
-    if (parse_port(argv[4], &backend_conn.serverPort) < 0) {
-        fprintf(stderr, "Error: Invalid backend port\n");
-        exit(1);
+    if (request->if_none_match) {
+        return etag_list_matches(request->if_none_match, validators->etag);
     }
-    
-    if (reconnect_backend(&backend_conn) < 0) {
-        die("connect to backend failed");
+    if (request->if_modified_since &&
+        parse_http_date(request->if_modified_since, &since) == 0) {
+        return validators->modified <= since;
     }
+    return 0;
+}
 
-    int servsock;
-    if((servsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        die("socket failed");
-    }
-    
-    int opt = 1;
-    if (setsockopt(servsock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        die("setsockopt failed");
-    }
-    
-    struct sockaddr_in servAddr;
-    memset(&servAddr, 0, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servAddr.sin_port = htons(server_port);
-    if(bind(servsock, (struct sockaddr *) &servAddr, sizeof(servAddr)) < 0) {
-        die("bind failed");
-    }
-    if(listen(servsock, 5) < 0) {
-        die("listen failed, too many requests");
+struct ByteRange {
+    off_t first;
+    off_t last;
+};
+
+static int parse_range_offset(const char **text, uintmax_t *result) {
+    const char *p = *text;
+    uintmax_t value = 0;
+
+    if (!isdigit((unsigned char)*p)) return -1;
+    while (isdigit((unsigned char)*p)) {
+        unsigned int digit = (unsigned int)(*p - '0');
+        if (value > (UINTMAX_MAX - digit) / 10) return -1;
+        value = value * 10 + digit;
+        p++;
     }
+    *result = value;
+    *text = p;
+    return 0;
+}
 
-    int clntsock;
-    socklen_t clntlen;
-    struct sockaddr_in clntaddr;
-    while(1) {
-        clntlen = sizeof(clntaddr);
-        if ((clntsock = accept(servsock, (struct sockaddr *) &clntaddr, &clntlen)) < 0) {
-            fprintf(stderr, "accept failed, continuing\n");
-            continue;
-        }
-        
-        set_socket_timeout(clntsock, CLIENT_TIMEOUT_SEC);
-        
-        FILE *fp = fdopen(clntsock, "rb");
-        if(fp == NULL) {
-            close(clntsock);
-            continue;
-        }
-        
-        char buf[MAX_REQUEST_LEN + 1];
-        size_t request_line_wire_length = 0;
-        enum HttpLineResult request_line_result = read_http_line(
-            fp,
-            buf,
-            sizeof(buf),
-            MAX_REQUEST_LEN,
-            &request_line_wire_length);
-
-        if (request_line_result != HTTP_LINE_OK) {
-            if (request_line_result == HTTP_LINE_TOO_LONG) {
-                send_error_page(clntsock, "414 URI Too Long", NULL);
-            } else if (request_line_result == HTTP_LINE_NUL ||
-                       request_line_wire_length > 0) {
-                send_error_page(clntsock, "400 Bad Request", NULL);
+/*
+ * Parses a "bytes=" Range value against a file of the given size. Returns
+ * the number of satisfiable ranges (0 means 416), or -1 when the header is
+ * malformed or asks for more than the file itself, in which case it is
+ * ignored and the whole file is sent.
+ */
+static int parse_byte_ranges(
+    const char *value,
+    off_t size,
+    struct ByteRange *ranges,
+    int capacity
+) {
+    const uintmax_t length = (uintmax_t)size;
+    const char *p = value;
+    uintmax_t requested = 0;
+    int specs = 0;
+    int count = 0;
+
+    if (strncasecmp(p, "bytes=", 6) != 0) return -1;
+    p += 6;
+
+    while (1) {
+        uintmax_t first;
+        uintmax_t last = length - 1;
+        int satisfiable;
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '-') {
+            uintmax_t suffix;
+
+            p++;
+            if (parse_range_offset(&p, &suffix) < 0) return -1;
+            satisfiable = suffix > 0 && length > 0;
+            first = suffix < length ? length - suffix : 0;
+        } else {
+            if (parse_range_offset(&p, &first) < 0 || *p++ != '-') return -1;
+            if (isdigit((unsigned char)*p)) {
+                if (parse_range_offset(&p, &last) < 0 || last < first) return -1;
+                if (last >= length) last = length - 1;
             }
-            fclose(fp);
-            continue;
+            satisfiable = first < length;
         }
 
-        char *requestLine = buf;
-        char *token_separators = "\t \r\n";
-        char *method = strtok(requestLine, token_separators);
-        char *requestURI_full = strtok(NULL, token_separators);
-        char *httpVersion = strtok(NULL, token_separators);
-        char *extra_token = strtok(NULL, token_separators);
-        char resp[64] = {0};
-        
-        char requestURI[MAX_URI_LEN] = {0};
-        char queryString[MAX_URI_LEN] = {0};
-
-        if (!method || !requestURI_full || !httpVersion || extra_token) {
-            char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                            "<!DOCTYPE html><html><body><h1>400 Bad Request</h1></body></html>\n";
-            snprintf(resp, sizeof(resp), "400 Bad Request");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method ? method : "-", requestURI_full ? requestURI_full : "-",
-                httpVersion ? httpVersion : "-", resp);
-            fclose(fp);
-            continue;
+        if (++specs > capacity) return -1;
+        if (satisfiable) {
+            requested += last - first + 1;
+            /* Overlapping or repeated ranges would amplify the response. */
+            if (requested > length) return -1;
+            ranges[count].first = (off_t)first;
+            ranges[count].last = (off_t)last;
+            count++;
         }
 
-        if (strlen(requestURI_full) >= MAX_URI_LEN) {
-            char header[] = "HTTP/1.0 414 URI Too Long\r\nContent-Type: text/html\r\n\r\n"
-                            "<!DOCTYPE html><html><body><h1>414 URI Too Long</h1></body></html>\n";
-            snprintf(resp, sizeof(resp), "414 URI Too Long");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI_full, httpVersion, resp);
-            fclose(fp);
-            continue;
-        }
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+        if (*p++ != ',') return -1;
+    }
+    return count;
+}
 
-        {
-            char *query_start = strchr(requestURI_full, '?');
-            if (query_start) {
-                size_t path_len = query_start - requestURI_full;
-                memcpy(requestURI, requestURI_full, path_len);
-                requestURI[path_len] = '\0';
-                strncpy(queryString, query_start + 1, sizeof(queryString) - 1);
-            } else {
-                strncpy(requestURI, requestURI_full, sizeof(requestURI) - 1);
-            }
-        }
+/* If-Range needs an exact, strong match; otherwise the whole file is sent. */
+static int if_range_matches(const char *value, const struct StaticValidators *validators) {
+    time_t date;
 
-        int is_get = (strcmp(method, "GET") == 0);
-        int is_post = (strcmp(method, "POST") == 0);
-        if (strcmp(httpVersion, "HTTP/1.0") != 0 &&
-            strcmp(httpVersion, "HTTP/1.1") != 0) {
-            char header[] = "HTTP/1.0 505 HTTP Version Not Supported\r\nContent-Type: text/html\r\n\r\n"
-                            "<!DOCTYPE html><html><body><h1>505 HTTP Version Not Supported</h1></body></html>\n";
-            snprintf(resp, sizeof(resp), "505 HTTP Version Not Supported");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
-        }
+    if (value[0] == '"') return strcmp(value, validators->etag) == 0;
+    if (strncmp(value, "W/", 2) == 0) return 0;
+    return parse_http_date(value, &date) == 0 && date == validators->modified;
+}
 
-        if (requestURI[0] != '/' || forbidden_dotdot(requestURI)) {
-            char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                            "<!DOCTYPE html><html><body><h1>400 Bad Request</h1></body></html>\n";
-            snprintf(resp, sizeof(resp), "400 Bad Request");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
+/*
+ * Small, hot static files are kept in memory together with the start of
+ * their response head, so a hit costs no filesystem calls. Entries are keyed
+ * by the request path with repeated slashes collapsed. On Linux, inotify
+ * watches every directory on a cached path and any change there drops the
+ * affected entries; without inotify the cache stays disabled, since nothing
+ * would notice a stale entry.
+ */
+struct StaticCacheEntry {
+    char *key;
+    const char *content_type;
+    struct StaticValidators validators;
+    char *head;
+    size_t head_length;
+    char *body;
+    size_t body_length;
+    unsigned int references;
+    int detached;
+    struct StaticCacheEntry *bucket_next;
+    struct StaticCacheEntry *lru_previous;
+    struct StaticCacheEntry *lru_next;
+};
+
+struct StaticCacheWatch {
+    int wd;
+    char *prefix;
+};
+
+struct StaticCache {
+    int enabled;
+    int notify_fd;
+    const char *web_root;
+    size_t bytes;
+    struct StaticCacheEntry *buckets[STATIC_CACHE_BUCKETS];
+    struct StaticCacheEntry *lru_head;
+    struct StaticCacheEntry *lru_tail;
+    struct StaticCacheWatch watches[STATIC_CACHE_MAX_WATCHES];
+    int watch_count;
+};
+
+static void static_cache_init(struct StaticCache *cache, const char *web_root) {
+    memset(cache, 0, sizeof(*cache));
+    cache->web_root = web_root;
+#if defined(__linux__)
+    cache->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cache->enabled = cache->notify_fd >= 0;
+#else
+    cache->notify_fd = -1;
+#endif
+}
+
+static int static_cache_normalize(const char *path, char *key, size_t key_size) {
+    size_t length = 0;
+
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' && length > 0 && key[length - 1] == '/') continue;
+        if (length + 1 >= key_size) return -1;
+        key[length++] = *p;
+    }
+    key[length] = '\0';
+    return 0;
+}
+
+/* FNV-1a, shared by the in-memory caches. */
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t static_cache_bucket(const char *key) {
+    return hash_key(key) % STATIC_CACHE_BUCKETS;
+}
+
+static void static_cache_entry_free(struct StaticCacheEntry *entry) {
+    free(entry->key);
+    free(entry->head);
+    free(entry->body);
+    free(entry);
+}
+
+static void static_cache_release(struct StaticCacheEntry *entry) {
+    if (!entry) return;
+    entry->references--;
+    if (entry->references == 0 && entry->detached) static_cache_entry_free(entry);
+}
+
+/* Entries still being sent are freed by their last static_cache_release. */
+static void static_cache_remove(struct StaticCache *cache, struct StaticCacheEntry *entry) {
+    struct StaticCacheEntry **link = &cache->buckets[static_cache_bucket(entry->key)];
+
+    while (*link != entry) link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+
+    if (entry->lru_previous) {
+        entry->lru_previous->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    } else {
+        cache->lru_tail = entry->lru_previous;
+    }
+
+    cache->bytes -= entry->head_length + entry->body_length;
+    entry->detached = 1;
+    if (entry->references == 0) static_cache_entry_free(entry);
+}
+
+static int static_cache_name_matches(const char *key, const char *name, size_t name_length) {
+    return strncmp(key, name, name_length) == 0 &&
+           (key[name_length] == '\0' || key[name_length] == '/' ||
+            key[name_length] == '\t');
+}
+
+/*
+ * True when a change to name inside the directory prefix (or to the whole
+ * directory, when name is NULL) can alter what key serves. A directory key
+ * such as "/docs/" serves its index.html. Keys for compressed variants end
+ * in a tab and the accepted codings, and they also depend on the .gz and
+ * .br siblings of their file.
+ */
+static int static_cache_key_affected(const char *key, const char *prefix, const char *name) {
+    size_t prefix_length = strlen(prefix);
+    size_t name_length;
+    size_t base_length;
+
+    if (strncmp(key, prefix, prefix_length) != 0) return 0;
+    if (!name) return 1;
+    key += prefix_length;
+    name_length = strlen(name);
+    base_length = name_length;
+    if (name_length > 3 &&
+        (strcmp(name + name_length - 3, ".gz") == 0 ||
+         strcmp(name + name_length - 3, ".br") == 0)) {
+        base_length -= 3;
+    }
+    if (key[0] == '\0' || key[0] == '\t') {
+        return base_length == 10 && strncmp(name, "index.html", 10) == 0;
+    }
+    return static_cache_name_matches(key, name, name_length) ||
+           static_cache_name_matches(key, name, base_length);
+}
+
+static void static_cache_invalidate(
+    struct StaticCache *cache,
+    const char *prefix,
+    const char *name
+) {
+    struct StaticCacheEntry *entry = cache->lru_head;
+
+    while (entry) {
+        struct StaticCacheEntry *next = entry->lru_next;
+        if (static_cache_key_affected(entry->key, prefix, name)) {
+            static_cache_remove(cache, entry);
+        }
+        entry = next;
+    }
+}
+
+static void static_cache_drain_events(struct StaticCache *cache) {
+#if defined(__linux__)
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(cache->notify_fd, events, sizeof(events));
+        size_t offset = 0;
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        while (offset < (size_t)n) {
+            const struct inotify_event *event =
+                (const struct inotify_event *)(events + offset);
+            offset += sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                static_cache_invalidate(cache, "/", NULL);
+                continue;
+            }
+            for (int i = 0; i < cache->watch_count; i++) {
+                struct StaticCacheWatch *watch = &cache->watches[i];
+
+                if (watch->wd != event->wd) continue;
+                static_cache_invalidate(
+                    cache,
+                    watch->prefix,
+                    event->len > 0 ? event->name : NULL);
+                if (event->mask & IN_IGNORED) {
+                    free(watch->prefix);
+                    *watch = cache->watches[--cache->watch_count];
+                }
+                break;
+            }
+        }
+    }
+#else
+    (void)cache;
+#endif
+}
+
+static struct StaticCacheEntry *static_cache_lookup(
+    struct StaticCache *cache,
+    const char *key
+) {
+    struct StaticCacheEntry *entry;
+
+    if (!cache->enabled) return NULL;
+    /*
+     * The event loop may not have seen a change made just before this
+     * request arrived, so pending events are applied first. With nothing
+     * pending this is one read() that fails with EAGAIN.
+     */
+    static_cache_drain_events(cache);
+    entry = cache->buckets[static_cache_bucket(key)];
+    while (entry && strcmp(entry->key, key) != 0) entry = entry->bucket_next;
+    if (!entry || entry == cache->lru_head) return entry;
+
+    entry->lru_previous->lru_next = entry->lru_next;
+    if (entry->lru_next) {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    } else {
+        cache->lru_tail = entry->lru_previous;
+    }
+    entry->lru_previous = NULL;
+    entry->lru_next = cache->lru_head;
+    cache->lru_head->lru_previous = entry;
+    cache->lru_head = entry;
+    return entry;
+}
+
+/*
+ * Watches every directory from the web root down to the one holding key.
+ * Called before the file is read, so a change that races with filling the
+ * entry still produces an event afterwards.
+ */
+static int static_cache_watch_path(struct StaticCache *cache, const char *key) {
+#if defined(__linux__)
+    char path[MAX_PATH_LEN + MAX_URI_LEN];
+    size_t root_length = strlen(cache->web_root);
+
+    for (const char *slash = key; slash; slash = strchr(slash + 1, '/')) {
+        size_t prefix_length = (size_t)(slash - key) + 1;
+        int known = 0;
+        int wd;
+
+        if (root_length + prefix_length >= sizeof(path)) return -1;
+        memcpy(path, cache->web_root, root_length);
+        memcpy(path + root_length, key, prefix_length);
+        path[root_length + prefix_length] = '\0';
+
+        wd = inotify_add_watch(
+            cache->notify_fd,
+            path,
+            IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                IN_ONLYDIR);
+        if (wd < 0) return -1;
+        for (int i = 0; i < cache->watch_count; i++) {
+            if (cache->watches[i].wd == wd) known = 1;
+        }
+        if (known) continue;
+        if (cache->watch_count == STATIC_CACHE_MAX_WATCHES) return -1;
+        cache->watches[cache->watch_count].prefix = strndup(key, prefix_length);
+        if (!cache->watches[cache->watch_count].prefix) return -1;
+        cache->watches[cache->watch_count].wd = wd;
+        cache->watch_count++;
+    }
+    return 0;
+#else
+    (void)cache;
+    (void)key;
+    return -1;
+#endif
+}
+
+/*
+ * Reads a small regular file into a new cache entry, gzipping it first when
+ * gzip_level is set. Returns NULL when the file should be streamed from disk
+ * instead; the descriptor stays open.
+ */
+static struct StaticCacheEntry *static_cache_fill(
+    struct StaticCache *cache,
+    const char *key,
+    int file_fd,
+    const struct stat *file_stat,
+    const char *content_type,
+    const struct StaticValidators *validators,
+    int gzip_level
+) {
+    struct StaticCacheEntry *entry;
+    size_t length = (size_t)file_stat->st_size;
+    size_t filled = 0;
+    char head[512];
+    int head_length;
+
+    if (!cache->enabled || file_stat->st_size > STATIC_CACHE_MAX_FILE) return NULL;
+    if (static_cache_watch_path(cache, key) < 0) return NULL;
+
+    head_length = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s",
+        content_type, validators->headers);
+    if (head_length < 0 || (size_t)head_length >= sizeof(head)) return NULL;
+
+    entry = (struct StaticCacheEntry *)calloc(1, sizeof(*entry));
+    if (!entry) return NULL;
+    entry->key = strdup(key);
+    entry->head = strdup(head);
+    entry->body = (char *)malloc(length ? length : 1);
+    if (!entry->key || !entry->head || !entry->body) {
+        static_cache_entry_free(entry);
+        return NULL;
+    }
+    while (filled < length) {
+        ssize_t n = pread(file_fd, entry->body + filled, length - filled, (off_t)filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            static_cache_entry_free(entry);
+            return NULL;
+        }
+        filled += (size_t)n;
+    }
+    if (gzip_level > 0) {
+        struct ResponseBuffer compressed;
+
+        memset(&compressed, 0, sizeof(compressed));
+        if (buffer_gzip(&compressed, entry->body, length, gzip_level) < 0) {
+            buffer_free(&compressed);
+            static_cache_entry_free(entry);
+            return NULL;
+        }
+        free(entry->body);
+        entry->body = compressed.data;
+        length = compressed.length;
+    }
+    entry->content_type = content_type;
+    entry->validators = *validators;
+    entry->head_length = (size_t)head_length;
+    entry->body_length = length;
+
+    size_t bucket = static_cache_bucket(key);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_previous = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail) cache->lru_tail = entry;
+    cache->bytes += entry->head_length + entry->body_length;
+
+    while (cache->bytes > STATIC_CACHE_MAX_BYTES && cache->lru_tail != entry) {
+        static_cache_remove(cache, cache->lru_tail);
+    }
+    return entry;
+}
+
+/*
+ * A thin edge-triggered readiness layer: epoll on Linux and kqueue with
+ * EV_CLEAR elsewhere. Callers always drain a socket until EAGAIN before
+ * waiting again, because an edge is reported only once.
+ */
+static int event_queue_create(void) {
+#if defined(__linux__)
+    return epoll_create1(EPOLL_CLOEXEC);
+#else
+    int queue = kqueue();
+    if (queue >= 0) fcntl(queue, F_SETFD, FD_CLOEXEC);
+    return queue;
+#endif
+}
+
+static int event_queue_add(int queue, int fd, void *data, int want_write) {
+#if defined(__linux__)
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (want_write) event.events |= EPOLLOUT;
+    event.data.ptr = data;
+    return epoll_ctl(queue, EPOLL_CTL_ADD, fd, &event);
+#else
+    struct kevent changes[2];
+    int count = 0;
+
+    EV_SET(&changes[count++], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, data);
+    if (want_write) {
+        EV_SET(&changes[count++], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, data);
+    }
+    return kevent(queue, changes, count, NULL, 0, NULL);
+#endif
+}
+
+/*
+ * Stores the registration pointer of every ready descriptor. kqueue reports
+ * each direction separately, so the same pointer may appear twice.
+ */
+static int event_queue_wait(int queue, void **ready, int capacity, int timeout_ms) {
+    int count;
+
+    if (capacity > MAX_EVENTS) capacity = MAX_EVENTS;
+#if defined(__linux__)
+    struct epoll_event events[MAX_EVENTS];
+
+    count = epoll_wait(queue, events, capacity, timeout_ms);
+    for (int i = 0; i < count; i++) ready[i] = events[i].data.ptr;
+#else
+    struct kevent events[MAX_EVENTS];
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    count = kevent(queue, NULL, 0, events, capacity, &timeout);
+    for (int i = 0; i < count; i++) ready[i] = events[i].udata;
+#endif
+    return count;
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/*
+ * Counters for /metrics. Each worker owns one slot of a shared mapping set
+ * up before the workers fork, so counting is a plain increment with no
+ * locking, and whichever worker answers a scrape adds up every slot. A
+ * replacement worker takes over its predecessor's slot, so the counters
+ * never go backwards.
+ */
+enum MetricsRoute {
+    METRICS_ROUTE_LOOKUP,
+    METRICS_ROUTE_LIST,
+    METRICS_ROUTE_ADD,
+    METRICS_ROUTE_EDIT,
+    METRICS_ROUTE_UPDATE,
+    METRICS_ROUTE_DELETE,
+    METRICS_ROUTE_API,
+    METRICS_ROUTE_METRICS,
+    METRICS_ROUTE_STATIC,
+    METRICS_ROUTE_OTHER,
+    METRICS_ROUTE_COUNT
+};
+
+static const char *const metrics_route_names[METRICS_ROUTE_COUNT] = {
+    "lookup", "list", "add", "edit", "update", "delete", "api", "metrics", "static", "other"
+};
+
+/* Request latency is split where it is spent: reading, handling, writing. */
+enum MetricsPhase {
+    METRICS_PHASE_PARSE,
+    METRICS_PHASE_BACKEND,
+    METRICS_PHASE_SEND,
+    METRICS_PHASE_COUNT
+};
+
+static const char *const metrics_phase_names[METRICS_PHASE_COUNT] = {
+    "parse", "backend", "send"
+};
+
+/* Upper bounds in microseconds, 1-2.5-5 per decade from 100us to 10s. */
+static const uint64_t metrics_bucket_bounds[METRICS_LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+struct LatencyHistogram {
+    uint64_t buckets[METRICS_LATENCY_BUCKETS + 1];
+    uint64_t count;
+    uint64_t sum_us;
+};
+
+struct WorkerMetrics {
+    uint64_t responses[METRICS_ROUTE_COUNT][METRICS_STATUS_CODES];
+    uint64_t bytes_sent[METRICS_ROUTE_COUNT];
+    struct LatencyHistogram latency[METRICS_ROUTE_COUNT][METRICS_PHASE_COUNT];
+    uint64_t backend_connects;
+    uint64_t backend_retries;
+    uint64_t static_cache_hits;
+    uint64_t static_cache_misses;
+    uint64_t shed_connections;
+    uint64_t shed_requests;
+};
+
+static struct WorkerMetrics *metrics_slots;
+static int metrics_slot_count;
+static struct WorkerMetrics *worker_metrics;
+
+static void metrics_init(int slots) {
+    void *mapping = mmap(NULL, (size_t)slots * sizeof(struct WorkerMetrics),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (mapping == MAP_FAILED) die("mmap failed");
+    metrics_slots = (struct WorkerMetrics *)mapping;
+    metrics_slot_count = slots;
+    worker_metrics = &metrics_slots[0];
+}
+
+static void metrics_observe(enum MetricsRoute route, enum MetricsPhase phase, uint64_t elapsed_us) {
+    struct LatencyHistogram *histogram = &worker_metrics->latency[route][phase];
+    int bucket = 0;
+
+    while (bucket < METRICS_LATENCY_BUCKETS && elapsed_us > metrics_bucket_bounds[bucket]) bucket++;
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum_us += elapsed_us;
+}
+
+/*
+ * The access log. The event loop formats each line into the next slot of a
+ * single-producer, single-consumer ring and moves on; a logger thread
+ * drains the ring in batches with one write each, so a slow stdout holds
+ * up the logger rather than requests. When the ring is full a line is
+ * dropped and counted, or with --log-overflow block the event loop waits
+ * for a free slot. The event loop's own diagnostics are queued the same way.
+ */
+struct AccessLog {
+    char lines[ACCESS_LOG_SLOTS][ACCESS_LOG_LINE_MAX];
+    size_t lengths[ACCESS_LOG_SLOTS];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint_fast64_t dropped;
+    int block;
+    unsigned int sample;
+    unsigned int sampled;
+    pthread_t thread;
+};
+
+static struct AccessLog *access_log;
+
+static void sleep_ms(long ms) {
+    struct timespec delay;
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+    }
+}
+
+static void write_fully(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        length -= (size_t)n;
+    }
+}
+
+static void *access_log_run(void *argument) {
+    struct AccessLog *log = (struct AccessLog *)argument;
+    char *batch = (char *)malloc(ACCESS_LOG_BATCH_BYTES);
+
+    if (!batch) return NULL;
+    for (;;) {
+        size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+        uint_fast64_t dropped = atomic_exchange_explicit(&log->dropped, 0, memory_order_relaxed);
+        size_t used = 0;
+
+        if (dropped > 0) {
+            used = (size_t)snprintf(batch, ACCESS_LOG_LINE_MAX,
+                "access log: %" PRIuFAST64 " line(s) dropped\n", dropped);
+        }
+        while (tail != head && used + ACCESS_LOG_LINE_MAX <= ACCESS_LOG_BATCH_BYTES) {
+            size_t slot = tail % ACCESS_LOG_SLOTS;
+
+            memcpy(batch + used, log->lines[slot], log->lengths[slot]);
+            used += log->lengths[slot];
+            tail++;
+        }
+        atomic_store_explicit(&log->tail, tail, memory_order_release);
+        if (used > 0) {
+            write_fully(STDOUT_FILENO, batch, used);
+        } else {
+            sleep_ms(ACCESS_LOG_DRAIN_MS);
+        }
+    }
+    return NULL;
+}
+
+static void access_log_start(int block, unsigned int sample) {
+    access_log = (struct AccessLog *)calloc(1, sizeof(*access_log));
+    if (!access_log) die("calloc failed");
+    atomic_init(&access_log->head, 0);
+    atomic_init(&access_log->tail, 0);
+    atomic_init(&access_log->dropped, 0);
+    access_log->block = block;
+    access_log->sample = sample;
+    if (pthread_create(&access_log->thread, NULL, access_log_run, access_log) != 0) {
+        die("pthread_create failed");
+    }
+    pthread_detach(access_log->thread);
+}
+
+static void access_log_printf(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/* Queues one line; a line longer than a slot is cut short. */
+static void access_log_printf(const char *format, ...) {
+    struct AccessLog *log = access_log;
+    size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    size_t slot = head % ACCESS_LOG_SLOTS;
+    va_list arguments;
+    int length;
+
+    while (head - atomic_load_explicit(&log->tail, memory_order_acquire) == ACCESS_LOG_SLOTS) {
+        if (!log->block) {
+            atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        sleep_ms(1);
+    }
+
+    va_start(arguments, format);
+    length = vsnprintf(log->lines[slot], ACCESS_LOG_LINE_MAX, format, arguments);
+    va_end(arguments);
+    if (length < 0) return;
+    if (length >= ACCESS_LOG_LINE_MAX) {
+        length = ACCESS_LOG_LINE_MAX - 1;
+        log->lines[slot][length - 1] = '\n';
+    }
+    log->lengths[slot] = (size_t)length;
+    atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+    return 0;
+}
+
+/*
+ * Backend traffic goes through a small pool of persistent connections to
+ * mdb-lookup-server. The protocol carries one command at a time per socket,
+ * so a request checks a connection out for its exchange and hands it back
+ * once the reply is complete; requests beyond the pool size wait in arrival
+ * order. The sockets are non-blocking and driven by the same event loop as
+ * clients, so a slow SEARCH2 delays only the request that sent it.
+ */
+enum BackendState {
+    BACKEND_CLOSED,
+    BACKEND_CONNECTING,
+    BACKEND_IDLE,
+    BACKEND_BUSY
+};
+
+enum BackendResult {
+    BACKEND_REPLY_OK,
+    BACKEND_REPLY_UNAVAILABLE,
+    BACKEND_REPLY_CLOSED,
+    BACKEND_REPLY_TIMEOUT
+};
+
+/* The reply ends at a blank line rather than after its first line. */
+#define BACKEND_MULTILINE 1
+/* The command may be sent again if a reused socket turns out to be dead. */
+#define BACKEND_IDEMPOTENT 2
+
+struct BackendReply {
+    enum BackendResult result;
+    char *data;
+    size_t length;
+    size_t cursor;
+};
+
+struct BackendConnection {
+    int sock;
+    enum BackendState state;
+    int flags;
+    int reused;
+    int pending;
+    int address_index;
+    struct Connection *owner;
+    size_t command_sent;
+    struct ResponseBuffer reply;
+    size_t reply_scanned;
+    size_t reply_consumed;
+    uint64_t deadline_ms;
+};
+
+struct BackendPool {
+    const char *host;
+    unsigned short port;
+    struct sockaddr_storage addresses[MAX_BACKEND_ADDRESSES];
+    socklen_t address_lengths[MAX_BACKEND_ADDRESSES];
+    int address_count;
+    int size;
+    int pending;
+    struct BackendConnection connections[MAX_BACKEND_CONNECTIONS];
+    struct Connection *waiting_head;
+    struct Connection *waiting_tail;
+    int waiting_count;
+};
+
+/* Resolves the backend once; every connection reuses the cached addresses. */
+static int backend_pool_resolve(struct BackendPool *pool) {
+    struct addrinfo hints;
+    struct addrinfo *addresses = NULL;
+    struct addrinfo *address;
+    char service[6];
+
+    snprintf(service, sizeof(service), "%u", (unsigned int)pool->port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(pool->host, service, &hints, &addresses) != 0) return -1;
+
+    pool->address_count = 0;
+    for (address = addresses;
+         address && pool->address_count < MAX_BACKEND_ADDRESSES;
+         address = address->ai_next) {
+        if (address->ai_addrlen > sizeof(pool->addresses[0])) continue;
+        memcpy(&pool->addresses[pool->address_count], address->ai_addr, address->ai_addrlen);
+        pool->address_lengths[pool->address_count++] = address->ai_addrlen;
+    }
+    freeaddrinfo(addresses);
+    return pool->address_count > 0 ? 0 : -1;
+}
+
+/*
+ * Opens the first pooled connection with a blocking connect, so a worker
+ * whose backend is unreachable fails at startup as it always has.
+ */
+static int backend_pool_connect_first(struct BackendPool *pool, int event_fd) {
+    struct BackendConnection *backend = &pool->connections[0];
+
+    for (int i = 0; i < pool->address_count; i++) {
+        const struct sockaddr *address = (const struct sockaddr *)&pool->addresses[i];
+        int sock = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+        if (sock < 0) continue;
+        if (set_socket_timeout(sock, BACKEND_TIMEOUT_SEC) == 0 &&
+            connect(sock, address, pool->address_lengths[i]) == 0 &&
+            set_nonblocking(sock) == 0 &&
+            event_queue_add(event_fd, sock, backend, 1) == 0) {
+            backend->sock = sock;
+            backend->state = BACKEND_IDLE;
+            backend->reused = 1;
+            worker_metrics->backend_connects++;
+            return 0;
+        }
+        close(sock);
+    }
+    return -1;
+}
+
+/*
+ * Returns the next line of a backend reply without its line ending, or NULL
+ * at the end of the reply. Lines are cut in place in the reply buffer.
+ */
+static char *backend_reply_line(struct BackendReply *reply) {
+    char *line = reply->data + reply->cursor;
+    char *newline;
+    size_t length;
+
+    if (reply->cursor >= reply->length) return NULL;
+    newline = memchr(line, '\n', reply->length - reply->cursor);
+    length = newline ? (size_t)(newline - line) : reply->length - reply->cursor;
+    reply->cursor += length + (newline ? 1 : 0);
+    line[length] = '\0';
+    if (length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+    return length > 0 ? line : NULL;
+}
+
+/*
+ * Rendered /mdb-lookup result rows, including the ENTRY NOT FOUND row,
+ * keyed by the search key folded to lower case because SEARCH2 matches
+ * without regard to case. Each entry carries the database generation it was
+ * rendered from. The backend bumps the generation on every change, and
+ * other workers change the database too, so a hit is served only after a
+ * GENERATION exchange confirms it is still current; that round trip is far
+ * cheaper than a SEARCH2 scan.
+ */
+struct SearchCacheEntry {
+    char *key;
+    uint64_t generation;
+    char *rows;
+    size_t rows_length;
+    struct SearchCacheEntry *bucket_next;
+    struct SearchCacheEntry *lru_previous;
+    struct SearchCacheEntry *lru_next;
+};
+
+struct SearchCache {
+    size_t count;
+    size_t bytes;
+    struct SearchCacheEntry *buckets[SEARCH_CACHE_BUCKETS];
+    struct SearchCacheEntry *lru_head;
+    struct SearchCacheEntry *lru_tail;
+};
+
+static void search_cache_remove(struct SearchCache *cache, struct SearchCacheEntry *entry) {
+    struct SearchCacheEntry **link = &cache->buckets[hash_key(entry->key) % SEARCH_CACHE_BUCKETS];
+
+    while (*link != entry) link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+
+    if (entry->lru_previous) {
+        entry->lru_previous->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    } else {
+        cache->lru_tail = entry->lru_previous;
+    }
+
+    cache->count--;
+    cache->bytes -= entry->rows_length;
+    free(entry->key);
+    free(entry->rows);
+    free(entry);
+}
+
+static void search_cache_clear(struct SearchCache *cache) {
+    while (cache->lru_tail) search_cache_remove(cache, cache->lru_tail);
+}
+
+static struct SearchCacheEntry *search_cache_lookup(
+    struct SearchCache *cache,
+    const char *key
+) {
+    struct SearchCacheEntry *entry = cache->buckets[hash_key(key) % SEARCH_CACHE_BUCKETS];
+
+    while (entry && strcmp(entry->key, key) != 0) entry = entry->bucket_next;
+    if (!entry || entry == cache->lru_head) return entry;
+
+    entry->lru_previous->lru_next = entry->lru_next;
+    if (entry->lru_next) {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    } else {
+        cache->lru_tail = entry->lru_previous;
+    }
+    entry->lru_previous = NULL;
+    entry->lru_next = cache->lru_head;
+    cache->lru_head->lru_previous = entry;
+    cache->lru_head = entry;
+    return entry;
+}
+
+/*
+ * Replaces any entry for key, then evicts from the cold end until the
+ * cache is back within its entry and byte limits. Failing to allocate only
+ * means the next lookup goes to the backend.
+ */
+static void search_cache_store(
+    struct SearchCache *cache,
+    const char *key,
+    uint64_t generation,
+    const char *rows,
+    size_t rows_length
+) {
+    struct SearchCacheEntry *entry = search_cache_lookup(cache, key);
+    size_t bucket;
+
+    if (entry) search_cache_remove(cache, entry);
+    if (rows_length > SEARCH_CACHE_MAX_BYTES / 16) return;
+
+    entry = (struct SearchCacheEntry *)calloc(1, sizeof(*entry));
+    if (!entry) return;
+    entry->key = strdup(key);
+    entry->rows = (char *)malloc(rows_length ? rows_length : 1);
+    if (!entry->key || !entry->rows) {
+        free(entry->key);
+        free(entry->rows);
+        free(entry);
+        return;
+    }
+    memcpy(entry->rows, rows, rows_length);
+    entry->rows_length = rows_length;
+    entry->generation = generation;
+
+    bucket = hash_key(key) % SEARCH_CACHE_BUCKETS;
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_previous = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail) cache->lru_tail = entry;
+    cache->count++;
+    cache->bytes += rows_length;
+
+    while ((cache->count > SEARCH_CACHE_MAX_ENTRIES ||
+            cache->bytes > SEARCH_CACHE_MAX_BYTES) &&
+           cache->lru_tail != entry) {
+        search_cache_remove(cache, cache->lru_tail);
+    }
+}
+
+/*
+ * An immutable response body that connections send straight from memory.
+ * Each sender holds a reference, so the owner can replace the body while
+ * responses carrying the old one are still draining.
+ */
+struct SharedBody {
+    unsigned int references;
+    size_t length;
+    char data[];
+};
+
+static struct SharedBody *shared_body_create(const struct ResponseBuffer *buffer) {
+    struct SharedBody *body =
+        (struct SharedBody *)malloc(sizeof(*body) + (buffer->length ? buffer->length : 1));
+
+    if (!body) return NULL;
+    body->references = 1;
+    body->length = buffer->length;
+    memcpy(body->data, buffer->data, buffer->length);
+    return body;
+}
+
+static void shared_body_release(struct SharedBody *body) {
+    if (body && --body->references == 0) free(body);
+}
+
+/*
+ * The rendered /mdb-list page and, with --gzip, its compressed form, valid
+ * for one database generation. Rows remember the LIST2 line they came from
+ * and where they sit in the page, so a rebuild copies the HTML of every row
+ * whose line is unchanged and renders only the records that changed.
+ */
+struct ListCacheRow {
+    uint64_t id;
+    size_t line_offset;
+    size_t line_length;
+    size_t html_offset;
+    size_t html_length;
+};
+
+struct ListCache {
+    int valid;
+    uint64_t generation;
+    struct ResponseBuffer lines;
+    struct SharedBody *page;
+    struct SharedBody *gzipped;
+    struct ListCacheRow *rows;
+    size_t row_count;
+};
+
+static void render_list_row(struct ResponseBuffer *out, const struct BackendRecord *record) {
+    char escaped_name[MAX_NAME_LEN * 6 + 1];
+    char escaped_msg[MAX_MSG_LEN * 6 + 1];
+
+    html_escape(record->name, escaped_name, sizeof(escaped_name));
+    html_escape(record->message, escaped_msg, sizeof(escaped_msg));
+    buffer_printf(out,
+        "<tr><td>%" PRIu64 "</td><td>%s</td><td>%s</td>"
+        "<td><a href=\"/mdb-edit?id=%" PRIu64 "\">Edit</a> | "
+        "<form method=POST action=/mdb-delete style=display:inline>"
+        "<input type=hidden name=id value=%" PRIu64 ">"
+        "<input type=submit value=Delete onclick=\"return confirm('Delete this record?')\">"
+        "</form></td></tr>\n",
+        record->id,
+        escaped_name,
+        escaped_msg,
+        record->id,
+        record->id);
+}
+
+/*
+ * Finds the cached row for id at or after *cursor. LIST2 returns records in
+ * ascending id order, so one forward pass pairs the old rows with the new,
+ * however many records were added, changed, or removed in between.
+ */
+static const struct ListCacheRow *list_cache_row(
+    const struct ListCache *cache,
+    size_t *cursor,
+    uint64_t id
+) {
+    while (*cursor < cache->row_count && cache->rows[*cursor].id < id) (*cursor)++;
+    if (*cursor < cache->row_count && cache->rows[*cursor].id == id) return &cache->rows[*cursor];
+    return NULL;
+}
+
+/*
+ * A list page under construction. LIST2 rows are fed in as they arrive, so
+ * a large page can be streamed to the client while it is being built.
+ */
+struct ListBuild {
+    struct ResponseBuffer lines;
+    struct ResponseBuffer page;
+    struct ListCacheRow *rows;
+    size_t row_count;
+    size_t row_capacity;
+    size_t cursor;
+    size_t streamed;
+};
+
+static struct ListBuild *list_build_create(void) {
+    struct ListBuild *build = (struct ListBuild *)calloc(1, sizeof(*build));
+
+    if (!build) return NULL;
+    buffer_append_text(&build->page,
+        "<!DOCTYPE html>\n"
+        "<html><head><title>Database Records</title></head><body>\n"
+        "<h1>All Database Records</h1>\n"
+        "<p><a href=\"/mdb-lookup\">Search</a> | <a href=\"/mdb-add\">Add New</a></p>\n"
+        "<table border=\"1\">\n"
+        "<tr><th>ID</th><th>Name</th><th>Message</th><th>Actions</th></tr>\n");
+    return build;
+}
+
+static void list_build_free(struct ListBuild *build) {
+    if (!build) return;
+    buffer_free(&build->lines);
+    buffer_free(&build->page);
+    free(build->rows);
+    free(build);
+}
+
+/* Renders the complete rows of reply, reusing cached HTML where it can. */
+static void list_build_feed(
+    const struct ListCache *cache,
+    struct ListBuild *build,
+    struct BackendReply *reply
+) {
+    char *line;
+
+    while ((line = backend_reply_line(reply)) != NULL) {
+        struct BackendRecord record;
+        struct ListCacheRow row;
+        const struct ListCacheRow *old;
+
+        row.line_offset = build->lines.length;
+        row.line_length = strlen(line);
+        if (buffer_append(&build->lines, line, row.line_length) < 0) return;
+        if (parse_backend_record(line, &record) < 0) continue;
+
+        row.id = record.id;
+        row.html_offset = build->page.length;
+        old = list_cache_row(cache, &build->cursor, record.id);
+        if (old && old->line_length == row.line_length &&
+            memcmp(cache->lines.data + old->line_offset,
+                build->lines.data + row.line_offset, row.line_length) == 0) {
+            buffer_append(&build->page, cache->page->data + old->html_offset, old->html_length);
+        } else {
+            render_list_row(&build->page, &record);
+        }
+        row.html_length = build->page.length - row.html_offset;
+
+        if (build->row_count == build->row_capacity) {
+            size_t capacity = build->row_capacity ? build->row_capacity * 2 : 64;
+            struct ListCacheRow *grown =
+                (struct ListCacheRow *)realloc(build->rows, capacity * sizeof(*build->rows));
+
+            if (!grown) {
+                build->lines.failed = 1;
+                return;
+            }
+            build->rows = grown;
+            build->row_capacity = capacity;
+        }
+        build->rows[build->row_count++] = row;
+    }
+}
+
+/*
+ * Finishes the page and makes it the cached one, taking over the build's
+ * buffers. Returns -1, leaving the cache as it was, if memory runs out.
+ */
+static int list_cache_install(
+    struct ListCache *cache,
+    struct ListBuild *build,
+    int gzip_level
+) {
+    struct ResponseBuffer gzipped;
+    struct SharedBody *page = NULL;
+    struct SharedBody *compressed = NULL;
+
+    memset(&gzipped, 0, sizeof(gzipped));
+    if (!build->lines.failed && !build->page.failed) page = shared_body_create(&build->page);
+    if (page && gzip_level > 0 &&
+        buffer_gzip(&gzipped, build->page.data, build->page.length, gzip_level) == 0) {
+        compressed = shared_body_create(&gzipped);
+    }
+    buffer_free(&gzipped);
+    if (!page || (gzip_level > 0 && !compressed)) {
+        shared_body_release(page);
+        return -1;
+    }
+
+    buffer_free(&cache->lines);
+    shared_body_release(cache->page);
+    shared_body_release(cache->gzipped);
+    free(cache->rows);
+    cache->lines = build->lines;
+    cache->page = page;
+    cache->gzipped = compressed;
+    cache->rows = build->rows;
+    cache->row_count = build->row_count;
+    memset(&build->lines, 0, sizeof(build->lines));
+    build->rows = NULL;
+    build->row_count = 0;
+    return 0;
+}
+
+enum ConnectionState {
+    CONNECTION_READING_REQUEST_LINE,
+    CONNECTION_READING_HEADERS,
+    CONNECTION_READING_BODY,
+    CONNECTION_WAITING_BACKEND,
+    CONNECTION_WRITING_RESPONSE,
+    CONNECTION_LINGERING
+};
+
+enum IoStatus {
+    IO_PROGRESS,
+    IO_WOULD_BLOCK,
+    IO_EOF,
+    IO_FULL,
+    IO_DONE,
+    IO_ERROR
+};
+
+struct ServerConfig {
+    unsigned short port;
+    const char *web_root;
+    const char *backend_host;
+    unsigned short backend_port;
+    int backend_connections;
+    int workers;
+    int keepalive_timeout;
+    unsigned int keepalive_requests;
+    int gzip_level;
+    int log_block;
+    unsigned int log_sample;
+    int listen_backlog;
+    int max_connections;
+    int max_backend_queue;
+    int queue_budget_ms;
+};
+
+struct Server;
+
+/*
+ * Per-client state. Input is buffered until a complete request has arrived,
+ * and the response is written as the socket drains, so a slow client only
+ * ever delays itself. A database request parks the connection until its
+ * backend reply arrives. A persistent connection returns to reading once the
+ * response is out, and pipelined requests already buffered are answered in
+ * arrival order.
+ */
+struct Connection {
+    int fd;
+    int closed;
+    int peer_closed;
+    enum ConnectionState state;
+    struct sockaddr_in address;
+    char *input;
+    size_t input_start;
+    size_t input_length;
+    size_t input_capacity;
+    size_t line_scanned;
+    struct HttpRequest request;
+    struct ResponseBuffer head;
+    struct ResponseBuffer output;
+    size_t output_sent;
+    int keep_alive;
+    int bodiless;
+    unsigned int requests_left;
+    struct StaticCacheEntry *cached;
+    struct SharedBody *shared_body;
+    int file_fd;
+    off_t file_offset;
+    off_t file_remaining;
+    int file_copy;
+    struct ByteRange ranges[MAX_BYTE_RANGES];
+    int range_count;
+    int range_next;
+    off_t range_tail_length;
+    off_t range_file_size;
+    const char *range_type;
+    char range_boundary[24];
+    struct ResponseBuffer backend_command;
+    struct BackendConnection *backend;
+    const char *(*backend_completion)(
+        struct Server *server,
+        struct Connection *connection,
+        struct BackendReply *reply);
+    void (*backend_progress)(
+        struct Server *server,
+        struct Connection *connection,
+        struct BackendReply *reply);
+    int backend_flags;
+    int backend_waiting;
+    uint64_t queued_ms;
+    struct Connection *backend_next;
+    int result_cacheable;
+    uint64_t result_generation;
+    int lookup_row;
+    size_t lookup_rows_start;
+    struct ListBuild *list_build;
+    int streaming;
+    size_t stream_framed;
+    uint64_t deadline_ms;
+    enum MetricsRoute route;
+    uint64_t request_start_us;
+    uint64_t dispatch_us;
+    uint64_t finish_us;
+    uint64_t bytes_sent;
+    const char *status;
+    int metrics_pending;
+    struct Connection *previous;
+    struct Connection *next;
+};
+
+struct Server {
+    const struct ServerConfig *config;
+    int listen_fd;
+    int web_root_fd;
+    int event_fd;
+    int accept_pending;
+    struct BackendPool backend_pool;
+    struct StaticCache static_cache;
+    struct SearchCache search_cache;
+    struct ListCache list_cache;
+    int generation_known;
+    uint64_t generation;
+    struct Connection *connections;
+    int connection_count;
+    struct Connection *closed;
+};
+
+static void connection_touch(struct Connection *connection, int seconds) {
+    connection->deadline_ms = monotonic_ms() + (uint64_t)seconds * 1000;
+}
+
+/* Drops the file or cached body that supplied the last response. */
+static void connection_release_body(struct Connection *connection) {
+    if (connection->file_fd >= 0) {
+        close(connection->file_fd);
+        connection->file_fd = -1;
+    }
+    connection->file_offset = 0;
+    connection->file_remaining = 0;
+    connection->range_count = 0;
+    connection->range_next = 0;
+    connection->range_tail_length = 0;
+    static_cache_release(connection->cached);
+    connection->cached = NULL;
+    shared_body_release(connection->shared_body);
+    connection->shared_body = NULL;
+}
+
+static void backend_reset(struct BackendConnection *backend) {
+    if (backend->sock >= 0) close(backend->sock);
+    backend->sock = -1;
+    backend->state = BACKEND_CLOSED;
+    backend->reused = 0;
+    backend->owner = NULL;
+    backend->command_sent = 0;
+    backend->reply_scanned = 0;
+    backend->reply_consumed = 0;
+    buffer_reset(&backend->reply);
+}
+
+/*
+ * Separates a closing client from its backend exchange. Once the command
+ * is out, the reply is still read and dropped so the socket stays in step
+ * with the backend; before that the socket is simply closed.
+ */
+static void backend_detach(struct Server *server, struct Connection *connection) {
+    struct BackendPool *pool = &server->backend_pool;
+    struct BackendConnection *backend = connection->backend;
+
+    if (backend) {
+        backend->owner = NULL;
+        connection->backend = NULL;
+        if (backend->state != BACKEND_BUSY ||
+            backend->command_sent < connection->backend_command.length) {
+            backend_reset(backend);
+            pool->pending = 1;
+        }
+    }
+    if (connection->backend_waiting) {
+        struct Connection **link = &pool->waiting_head;
+
+        while (*link != connection) link = &(*link)->backend_next;
+        *link = connection->backend_next;
+        if (pool->waiting_tail == connection) {
+            pool->waiting_tail = NULL;
+            for (struct Connection *waiting = pool->waiting_head; waiting;
+                 waiting = waiting->backend_next) {
+                pool->waiting_tail = waiting;
+            }
+        }
+        connection->backend_waiting = 0;
+        pool->waiting_count--;
+    }
+}
+
+/*
+ * Logs one request with its status, the bytes sent, and the time from its
+ * request line. Server errors are always logged; other requests are
+ * sampled one in --log-sample.
+ */
+static void log_request(const struct Connection *connection, uint64_t now) {
+    const struct HttpRequest *request = &connection->request;
+    const char *target = request->path ? request->path : request->target;
+    uint64_t started = connection->request_start_us ?
+        connection->request_start_us : connection->finish_us;
+
+    if (access_log->sample > 1 && atoi(connection->status) < 500 &&
+        ++access_log->sampled % access_log->sample != 0) {
+        return;
+    }
+    access_log_printf("%s \"%s %s %s\" %s bytes=%" PRIu64 " us=%" PRIu64 "\n",
+        inet_ntoa(connection->address.sin_addr),
+        request->method ? request->method : "-",
+        target ? target : "-",
+        request->version ? request->version : "-",
+        connection->status,
+        connection->bytes_sent,
+        now - started);
+}
+
+/*
+ * Counts the bytes and send time of the response and logs the request once
+ * the response is out or cut off.
+ */
+static void request_sent(struct Connection *connection) {
+    uint64_t now;
+
+    if (!connection->metrics_pending) return;
+    now = monotonic_us();
+    connection->metrics_pending = 0;
+    worker_metrics->bytes_sent[connection->route] += connection->bytes_sent;
+    metrics_observe(connection->route, METRICS_PHASE_SEND, now - connection->finish_us);
+    log_request(connection, now);
+}
+
+static void connection_close(struct Server *server, struct Connection *connection) {
+    if (connection->closed) return;
+
+    request_sent(connection);
+    close(connection->fd);
+    connection->fd = -1;
+    connection_release_body(connection);
+    backend_detach(server, connection);
+
+    if (connection->previous) {
+        connection->previous->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if (connection->next) connection->next->previous = connection->previous;
+    server->connection_count--;
+
+    /*
+     * The event batch being processed may still reference this connection,
+     * so it is released only after the batch completes.
+     */
+    connection->closed = 1;
+    connection->previous = NULL;
+    connection->next = server->closed;
+    server->closed = connection;
+}
+
+static void free_closed_connections(struct Server *server) {
+    while (server->closed) {
+        struct Connection *connection = server->closed;
+        server->closed = connection->next;
+        http_request_reset(&connection->request);
+        buffer_free(&connection->head);
+        buffer_free(&connection->output);
+        buffer_free(&connection->backend_command);
+        list_build_free(connection->list_build);
+        free(connection->input);
+        free(connection);
+    }
+}
+
+static enum MetricsRoute metrics_route(const char *path) {
+    if (!path) return METRICS_ROUTE_OTHER;
+    if (strcmp(path, "/mdb-lookup") == 0) return METRICS_ROUTE_LOOKUP;
+    if (strcmp(path, "/mdb-list") == 0) return METRICS_ROUTE_LIST;
+    if (strcmp(path, "/mdb-add") == 0) return METRICS_ROUTE_ADD;
+    if (strcmp(path, "/mdb-edit") == 0) return METRICS_ROUTE_EDIT;
+    if (strcmp(path, "/mdb-update") == 0) return METRICS_ROUTE_UPDATE;
+    if (strcmp(path, "/mdb-delete") == 0) return METRICS_ROUTE_DELETE;
+    if (is_api_path(path)) return METRICS_ROUTE_API;
+    if (strcmp(path, "/metrics") == 0) return METRICS_ROUTE_METRICS;
+    return METRICS_ROUTE_STATIC;
+}
+
+/*
+ * Counts a request whose response is ready. The parse phase runs from the
+ * request line to dispatch, the backend phase from dispatch to here; the
+ * send phase is counted, and the request logged, by request_sent.
+ */
+static void account_request(struct Connection *connection, const char *status) {
+    uint64_t now = monotonic_us();
+    int code = atoi(status);
+    enum MetricsRoute route = metrics_route(connection->request.path);
+
+    if (code >= METRICS_MIN_STATUS && code < METRICS_MIN_STATUS + METRICS_STATUS_CODES) {
+        worker_metrics->responses[route][code - METRICS_MIN_STATUS]++;
+    }
+    if (connection->request_start_us) {
+        uint64_t parsed = connection->dispatch_us ? connection->dispatch_us : now;
+        metrics_observe(route, METRICS_PHASE_PARSE, parsed - connection->request_start_us);
+    }
+    if (connection->dispatch_us) {
+        metrics_observe(route, METRICS_PHASE_BACKEND, now - connection->dispatch_us);
+    }
+    connection->route = route;
+    connection->status = status;
+    connection->finish_us = now;
+    connection->metrics_pending = 1;
+}
+
+/*
+ * Starts the response head; handlers then add any extra header lines and
+ * write the body into connection->output. The framing headers are appended
+ * by begin_response once the body length is known.
+ */
+static void response_start(
+    struct Connection *connection,
+    const char *status,
+    const char *content_type
+) {
+    buffer_reset(&connection->head);
+    buffer_printf(&connection->head, "HTTP/1.1 %s\r\n", status);
+    connection->bodiless = strncmp(status, "304 ", 4) == 0;
+    if (content_type) {
+        buffer_printf(&connection->head, "Content-Type: %s\r\n", content_type);
+    }
+}
+
+static void response_header(struct Connection *connection, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void response_header(struct Connection *connection, const char *format, ...) {
+    char line[512];
+    va_list arguments;
+    int length;
+
+    va_start(arguments, format);
+    length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if (length < 0 || (size_t)length >= sizeof(line)) {
+        connection->head.failed = 1;
+        return;
+    }
+    buffer_append(&connection->head, line, (size_t)length);
+}
+
+static void send_page(struct Connection *connection, const char *status, const char *html) {
+    response_start(connection, status, "text/html");
+    buffer_append_text(&connection->output, html);
+}
+
+static void send_redirect(struct Connection *connection, const char *location) {
+    response_start(connection, "302 Found", NULL);
+    response_header(connection, "Location: %s\r\n", location);
+}
+
+static void send_error_page(
+    struct Connection *connection,
+    const char *status,
+    const char *extra_headers
+) {
+    response_start(connection, status, "text/html");
+    if (extra_headers) buffer_append_text(&connection->head, extra_headers);
+    buffer_printf(&connection->output,
+        "<!DOCTYPE html><html><body><h1>%s</h1></body></html>\n",
+        status);
+}
+
+/*
+ * HTTP/1.1 connections persist unless either side says close; HTTP/1.0
+ * clients must ask for keep-alive explicitly.
+ */
+static int request_wants_keep_alive(const struct HttpRequest *request) {
+    if (!request->version || request->connection_close) return 0;
+    if (strcmp(request->version, "HTTP/1.1") == 0) return 1;
+    return request->connection_keep_alive;
+}
+
+/* Decides whether the connection persists and says so in the head. */
+static void response_connection_header(struct Connection *connection, int may_persist) {
+    const struct HttpRequest *request = &connection->request;
+
+    if (connection->requests_left > 0) connection->requests_left--;
+    connection->keep_alive = may_persist &&
+        connection->requests_left > 0 &&
+        request_wants_keep_alive(request);
+
+    if (!connection->keep_alive) {
+        buffer_append_text(&connection->head, "Connection: close\r\n");
+    } else if (strcmp(request->version, "HTTP/1.0") == 0) {
+        buffer_append_text(&connection->head, "Connection: keep-alive\r\n");
+    }
+    buffer_append_text(&connection->head, "\r\n");
+}
+
+/*
+ * Wraps the output appended since the last call in one chunk. The chunk
+ * size has to precede the data, so the new bytes move up to make room for
+ * it; a chunk is at most what one backend read produced.
+ */
+static void stream_frame(struct Connection *connection) {
+    struct ResponseBuffer *out = &connection->output;
+    size_t length = out->length - connection->stream_framed;
+    char size_line[24];
+    int size_length;
+
+    if (length == 0 || out->failed) return;
+    size_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+    if (buffer_reserve(out, (size_t)size_length + 2) < 0) return;
+    memmove(out->data + connection->stream_framed + size_length,
+        out->data + connection->stream_framed, length);
+    memcpy(out->data + connection->stream_framed, size_line, (size_t)size_length);
+    out->length += (size_t)size_length;
+    buffer_append(out, "\r\n", 2);
+    connection->stream_framed = out->length;
+}
+
+/*
+ * True when a response may start before its body is complete: the client
+ * speaks HTTP/1.1 and the body will not be gzipped as a whole.
+ */
+static int stream_allowed(const struct Server *server, const struct Connection *connection) {
+    return strcmp(connection->request.version, "HTTP/1.1") == 0 &&
+        !(server->config->gzip_level > 0 &&
+          (accepted_encodings(connection->request.accept_encoding) & ACCEPT_GZIP));
+}
+
+/*
+ * Frames what a backend progress callback rendered, first completing the
+ * head with chunked framing if the response is not streaming yet. The
+ * connection then sends it while the rest of the reply arrives.
+ */
+static void stream_output(struct Server *server, struct Connection *connection) {
+    if (!connection->streaming) {
+        if (server->config->gzip_level > 0) {
+            response_header(connection, "Vary: Accept-Encoding\r\n");
+        }
+        buffer_append_text(&connection->head, "Transfer-Encoding: chunked\r\n");
+        response_connection_header(connection, 1);
+        connection->streaming = 1;
+        connection->stream_framed = 0;
+        connection->output_sent = 0;
+    }
+    stream_frame(connection);
+}
+
+static void begin_response(struct Connection *connection, int may_persist) {
+    uintmax_t content_length = connection->output.length;
+
+    /* A streamed body ends with its last chunk and the zero-length one. */
+    if (connection->streaming) {
+        stream_frame(connection);
+        buffer_append_text(&connection->output, "0\r\n\r\n");
+        connection->state = CONNECTION_WRITING_RESPONSE;
+        connection_touch(connection, CLIENT_TIMEOUT_SEC);
+        return;
+    }
+
+    if (connection->file_fd >= 0) {
+        content_length += (uintmax_t)connection->file_remaining +
+                          (uintmax_t)connection->range_tail_length;
+    }
+    if (connection->cached) content_length += connection->cached->body_length;
+    if (connection->shared_body) content_length += connection->shared_body->length;
+
+    /* A 304 has no body, and a Content-Length would describe the file. */
+    if (!connection->bodiless) {
+        buffer_printf(&connection->head, "Content-Length: %ju\r\n", content_length);
+    }
+    response_connection_header(connection, may_persist);
+
+    connection->output_sent = 0;
+    connection->state = CONNECTION_WRITING_RESPONSE;
+    connection_touch(connection, CLIENT_TIMEOUT_SEC);
+}
+
+/*
+ * Answers a request that could not be parsed completely. The rest of the
+ * input cannot be trusted to start a new request, so the connection closes
+ * after the error page.
+ */
+static void respond_error(
+    struct Connection *connection,
+    const char *status,
+    const char *extra_headers
+) {
+    buffer_reset(&connection->output);
+    send_error_page(connection, status, extra_headers);
+    account_request(connection, status);
+    begin_response(connection, 0);
+}
+
+/*
+ * Gzips a compressible response body in place when the client accepts it.
+ * Generated pages are built per request, so they are compressed per request.
+ */
+static void compress_response(struct Server *server, struct Connection *connection) {
+    int level = server->config->gzip_level;
+    struct ResponseBuffer compressed;
+
+    if (level == 0 || connection->streaming) return;
+    response_header(connection, "Vary: Accept-Encoding\r\n");
+    if (!(accepted_encodings(connection->request.accept_encoding) & ACCEPT_GZIP) ||
+        connection->output.failed ||
+        connection->output.length < GZIP_MIN_LENGTH) {
+        return;
+    }
+    memset(&compressed, 0, sizeof(compressed));
+    if (buffer_gzip(&compressed, connection->output.data,
+            connection->output.length, level) < 0) {
+        buffer_free(&compressed);
+        return;
+    }
+    buffer_free(&connection->output);
+    connection->output = compressed;
+    response_header(connection, "Content-Encoding: gzip\r\n");
+}
+
+/*
+ * Starts a non-blocking connect to the first cached address, from
+ * first_address on, that takes one. The event loop reports the outcome as
+ * writability.
+ */
+static int backend_open(
+    struct Server *server,
+    struct BackendConnection *backend,
+    int first_address
+) {
+    const struct BackendPool *pool = &server->backend_pool;
+
+    for (int i = first_address; i < pool->address_count; i++) {
+        const struct sockaddr *address = (const struct sockaddr *)&pool->addresses[i];
+        int sock = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+        if (sock < 0) continue;
+        if (set_nonblocking(sock) < 0 ||
+            (connect(sock, address, pool->address_lengths[i]) < 0 &&
+             errno != EINPROGRESS) ||
+            event_queue_add(server->event_fd, sock, backend, 1) < 0) {
+            close(sock);
+            continue;
+        }
+        backend->sock = sock;
+        backend->state = BACKEND_CONNECTING;
+        worker_metrics->backend_connects++;
+        backend->address_index = i;
+        backend->deadline_ms = monotonic_ms() + (uint64_t)BACKEND_TIMEOUT_SEC * 1000;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Hands out an idle connection that still looks healthy, or opens a new one
+ * while the pool is below its size. Anything readable on an idle socket
+ * means the backend closed it or it is out of step, so it is replaced.
+ * Returns NULL with *failed clear when every connection is busy.
+ */
+static struct BackendConnection *backend_checkout(struct Server *server, int *failed) {
+    struct BackendPool *pool = &server->backend_pool;
+    struct BackendConnection *closed = NULL;
+
+    *failed = 0;
+    for (int i = 0; i < pool->size; i++) {
+        struct BackendConnection *backend = &pool->connections[i];
+
+        if (backend->state == BACKEND_IDLE) {
+            char byte;
+            ssize_t n = recv(backend->sock, &byte, 1, MSG_PEEK);
+
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return backend;
+            backend_reset(backend);
+        }
+        if (backend->state == BACKEND_CLOSED && !closed) closed = backend;
+    }
+    if (!closed) return NULL;
+    if (backend_open(server, closed, 0) < 0) {
+        *failed = 1;
+        return NULL;
+    }
+    return closed;
+}
+
+/* Gives backend to connection; the exchange starts when the pool next runs. */
+static void backend_start(
+    struct Server *server,
+    struct BackendConnection *backend,
+    struct Connection *connection
+) {
+    backend->owner = connection;
+    backend->flags = connection->backend_flags;
+    backend->command_sent = 0;
+    backend->reply_scanned = 0;
+    backend->reply_consumed = 0;
+    buffer_reset(&backend->reply);
+    if (backend->state == BACKEND_IDLE) {
+        backend->state = BACKEND_BUSY;
+        backend->deadline_ms = monotonic_ms() + (uint64_t)BACKEND_TIMEOUT_SEC * 1000;
+    }
+    backend->pending = 1;
+    server->backend_pool.pending = 1;
+    connection->backend = backend;
+    connection->state = CONNECTION_WAITING_BACKEND;
+}
+
+/*
+ * Sends connection->backend_command on a pooled connection and returns NULL;
+ * completion builds the response once the reply is in. Only when no
+ * connection can be opened at all does completion run at once, and its
+ * status is returned.
+ */
+static const char *backend_submit(
+    struct Server *server,
+    struct Connection *connection,
+    const char *(*completion)(
+        struct Server *server,
+        struct Connection *connection,
+        struct BackendReply *reply),
+    int flags
+) {
+    struct BackendPool *pool = &server->backend_pool;
+    struct BackendConnection *backend = NULL;
+    int failed = connection->backend_command.failed;
+
+    connection->backend_completion = completion;
+    connection->backend_flags = flags;
+    /* Requests already queued keep their place. */
+    if (!failed && !pool->waiting_head) backend = backend_checkout(server, &failed);
+    if (failed) {
+        struct BackendReply reply;
+
+        memset(&reply, 0, sizeof(reply));
+        reply.result = BACKEND_REPLY_UNAVAILABLE;
+        return completion(server, connection, &reply);
+    }
+    if (backend) {
+        backend_start(server, backend, connection);
+        return NULL;
+    }
+
+    connection->backend_next = NULL;
+    connection->backend_waiting = 1;
+    if (pool->waiting_tail) {
+        pool->waiting_tail->backend_next = connection;
+    } else {
+        pool->waiting_head = connection;
+    }
+    pool->waiting_tail = connection;
+    pool->waiting_count++;
+    connection->queued_ms = monotonic_ms();
+    connection->state = CONNECTION_WAITING_BACKEND;
+    connection_touch(connection, BACKEND_TIMEOUT_SEC);
+    return NULL;
+}
+
+static const char *handle_lookup_form(struct Connection *connection) {
+    const char *form =
+        "<!DOCTYPE html>\n"
+        "<h1>mdb-lookup</h1>\n"
+        "<p>\n"
+        "<form method=GET action=/mdb-lookup>\n"
+        "lookup: <input type=text name=key>\n"
+        "<input type=submit>\n"
+        "</form>\n"
+        "<p>\n";
+
+    response_start(connection, "200 OK", "text/html");
+
+    buffer_append_text(&connection->output, form);
+    return "200 OK";
+}
+
+/*
+ * Recovers the search cache key for a /mdb-lookup request: the decoded,
+ * trimmed key in lower case. handle_lookup has already validated it.
+ */
+static void lookup_cache_key(const struct Connection *connection, char *key, size_t key_size) {
+    size_t key_len = 0;
+
+    if (parse_parameter(connection->request.query, "key", key, key_size, &key_len) != 0) {
+        key_len = 0;
+    }
+    trim_whitespace(key, &key_len);
+    key[key_len] = '\0';
+    for (char *p = key; *p; p++) *p = (char)tolower((unsigned char)*p);
+}
+
+/* Appends a table row for each complete SEARCH2 line in reply. */
+static void render_lookup_rows(struct Connection *connection, struct BackendReply *reply) {
+    struct ResponseBuffer *out = &connection->output;
+    char *line;
+
+    while ((line = backend_reply_line(reply)) != NULL) {
+        struct BackendRecord record;
+        if (parse_backend_record(line, &record) < 0) {
+            access_log_printf("Ignoring malformed SEARCH2 response row\n");
+            continue;
+        }
+
+        char escaped_name[MAX_NAME_LEN * 6 + 1];
+        char escaped_message[MAX_MSG_LEN * 6 + 1];
+        html_escape(
+            record.name,
+            escaped_name,
+            sizeof(escaped_name));
+        html_escape(
+            record.message,
+            escaped_message,
+            sizeof(escaped_message));
+
+        buffer_printf(
+            out,
+            "<tr><td>%d</td><td>%" PRIu64 "</td><td>%s</td><td>%s</td></tr>\n",
+            connection->lookup_row++,
+            record.id,
+            escaped_name,
+            escaped_message);
+    }
+}
+
+/*
+ * Renders the rows that have arrived so far, and starts streaming once they
+ * fill a first chunk, so a large result does not hold back the page.
+ */
+static void progress_lookup(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    render_lookup_rows(connection, reply);
+    if (connection->streaming ||
+        (stream_allowed(server, connection) &&
+         connection->output.length >= STREAM_START_LEN)) {
+        stream_output(server, connection);
+    }
+}
+
+/*
+ * Appends the SEARCH2 rows below the table that handle_lookup already
+ * rendered, and caches them when the generation they belong to is known and
+ * they were not streamed.
+ */
+static const char *complete_lookup(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    struct ResponseBuffer *out = &connection->output;
+
+    if (reply->result == BACKEND_REPLY_UNAVAILABLE) {
+        response_start(connection, "503 Service Unavailable", "text/html");
+        buffer_append_text(out,
+            "<tr><td colspan=4>Error: Backend server unavailable</td></tr>\n");
+        buffer_append_text(out, "</table>\n</body></html>\n");
+        return "503 Service Unavailable";
+    }
+
+    render_lookup_rows(connection, reply);
+    if (connection->lookup_row == 1) {
+        if (reply->result == BACKEND_REPLY_OK) {
+            buffer_append_text(out,
+                "<tr><td colspan=\"4\"><strong>ENTRY NOT FOUND</strong></td></tr>\n");
+        } else if (reply->result == BACKEND_REPLY_CLOSED) {
+            buffer_append_text(out,
+                "<tr><td colspan=\"4\">Error: Database connection closed</td></tr>\n");
+            access_log_printf("Backend connection closed during search\n");
+        } else {
+            buffer_append_text(out,
+                "<tr><td colspan=\"4\">Error: No response from database</td></tr>\n");
+            access_log_printf("No response received for search\n");
+        }
+    }
+
+    if (reply->result == BACKEND_REPLY_OK && connection->result_cacheable &&
+        !connection->streaming && !out->failed) {
+        char key[MAX_FORM_VALUE_LEN];
+
+        lookup_cache_key(connection, key, sizeof(key));
+        search_cache_store(&server->search_cache, key, connection->result_generation,
+            out->data + connection->lookup_rows_start,
+            out->length - connection->lookup_rows_start);
+    }
+    buffer_append_text(out, "</table>\n</body></html>\n");
+    compress_response(server, connection);
+    return "200 OK";
+}
+
+/*
+ * Sends SEARCH2 for the request's key. The rows are cached under the last
+ * generation seen from the backend: it was reported before this search was
+ * sent, so at worst the entry is older than the data and gets refetched.
+ */
+static const char *submit_search(
+    struct Server *server,
+    struct Connection *connection
+) {
+    char decoded_key[MAX_FORM_VALUE_LEN];
+    size_t key_len = 0;
+
+    parse_parameter(connection->request.query, "key",
+        decoded_key, sizeof(decoded_key), &key_len);
+    trim_whitespace(decoded_key, &key_len);
+    connection->result_cacheable = server->generation_known;
+    connection->result_generation = server->generation;
+    buffer_reset(&connection->backend_command);
+    buffer_printf(&connection->backend_command, "SEARCH2 %s\n", decoded_key);
+    connection->backend_progress = progress_lookup;
+    return backend_submit(server, connection, complete_lookup,
+        BACKEND_MULTILINE | BACKEND_IDEMPOTENT);
+}
+
+/*
+ * Records the generation from a GENERATION reply. Returns -1 if the reply
+ * does not carry one.
+ */
+static int note_generation(struct Server *server, struct BackendReply *reply) {
+    char *line = backend_reply_line(reply);
+    uint64_t generation;
+
+    if (reply->result != BACKEND_REPLY_OK || !line ||
+        strncmp(line, "GENERATION ", 11) != 0 ||
+        parse_positive_u64(line + 11, &generation) < 0) {
+        return -1;
+    }
+    server->generation = generation;
+    server->generation_known = 1;
+    return 0;
+}
+
+/*
+ * Serves the cached rows if the backend still reports the generation they
+ * were rendered from; otherwise falls through to a real search.
+ */
+static const char *complete_lookup_generation(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    struct ResponseBuffer *out = &connection->output;
+
+    if (reply->result != BACKEND_REPLY_OK) return complete_lookup(server, connection, reply);
+    if (note_generation(server, reply) == 0) {
+        char key[MAX_FORM_VALUE_LEN];
+        struct SearchCacheEntry *entry;
+
+        lookup_cache_key(connection, key, sizeof(key));
+        entry = search_cache_lookup(&server->search_cache, key);
+        if (entry && entry->generation == server->generation) {
+            buffer_append(out, entry->rows, entry->rows_length);
+            buffer_append_text(out, "</table>\n</body></html>\n");
+            compress_response(server, connection);
+            return "200 OK";
+        }
+        if (entry) search_cache_remove(&server->search_cache, entry);
+    }
+    return submit_search(server, connection);
+}
+
+static const char *handle_lookup(
+    struct Server *server,
+    struct Connection *connection
+) {
+    struct ResponseBuffer *out = &connection->output;
+    char decoded_key[MAX_FORM_VALUE_LEN];
+    size_t key_len = 0;
+    int key_result = parse_parameter(
+        connection->request.query,
+        "key",
+        decoded_key,
+        sizeof(decoded_key),
+        &key_len);
+
+    if (key_result != 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed key</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    trim_whitespace(decoded_key, &key_len);
+    if (validate_text_value(
+            decoded_key, key_len, MAX_SEARCH_KEY_LEN, 0) < 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid key</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    const char *form =
+        "<!DOCTYPE html>\n"
+        "<html><head><title>Database Search</title></head><body>\n"
+        "<h1>mdb-lookup</h1>\n"
+        "<p>\n"
+        "<form method=GET action=/mdb-lookup>\n"
+        "lookup: <input type=text name=key value=\"";
+    char escaped_key[MAX_SEARCH_KEY_LEN * 6 + 1];
+    html_escape(decoded_key, escaped_key, sizeof(escaped_key));
+    response_start(connection, "200 OK", "text/html");
+    buffer_printf(out,
+        "%s%s\">\n"
+        "<input type=submit>\n"
+        "</form>\n"
+        "<p>\n"
+        "<a href=\"/mdb-list\">List All Records</a> | <a href=\"/mdb-add\">Add New Record</a>\n"
+        "<p>\n"
+        "<table border=\"1\" cellpadding=\"5\" cellspacing=\"0\">\n"
+        "<tr><th>#</th><th>ID</th><th>Name</th><th>Message</th></tr>\n",
+        form,
+        escaped_key);
+
+    connection->result_cacheable = 0;
+    connection->lookup_row = 1;
+    connection->lookup_rows_start = out->length;
+    lookup_cache_key(connection, decoded_key, sizeof(decoded_key));
+    if (!server->generation_known ||
+        search_cache_lookup(&server->search_cache, decoded_key)) {
+        buffer_reset(&connection->backend_command);
+        buffer_append_text(&connection->backend_command, "GENERATION\n");
+        return backend_submit(server, connection, complete_lookup_generation,
+            BACKEND_IDEMPOTENT);
+    }
+    return submit_search(server, connection);
+}
+
+/*
+ * Answers /mdb-list from the cached page, compressed when --gzip is set and
+ * the client accepts it. The page is sent from the cache without a copy.
+ */
+static const char *respond_from_list_cache(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const struct ListCache *cache = &server->list_cache;
+    struct SharedBody *body = cache->page;
+
+    response_start(connection, "200 OK", "text/html");
+    if (server->config->gzip_level > 0) {
+        response_header(connection, "Vary: Accept-Encoding\r\n");
+        if (accepted_encodings(connection->request.accept_encoding) & ACCEPT_GZIP) {
+            response_header(connection, "Content-Encoding: gzip\r\n");
+            body = cache->gzipped;
+        }
+    }
+    body->references++;
+    connection->shared_body = body;
+    return "200 OK";
+}
+
+/* Moves the page built since the last call into the response body. */
+static void list_build_emit(struct Connection *connection) {
+    struct ListBuild *build = connection->list_build;
+
+    buffer_append(&connection->output,
+        build->page.data + build->streamed, build->page.length - build->streamed);
+    build->streamed = build->page.length;
+}
+
+/*
+ * Builds the page from the rows that have arrived so far and, once it
+ * fills a first chunk, streams it while LIST2 is still arriving.
+ */
+static void progress_list(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    if (!connection->list_build) connection->list_build = list_build_create();
+    if (!connection->list_build) return;
+    list_build_feed(&server->list_cache, connection->list_build, reply);
+    if (!connection->streaming &&
+        (!stream_allowed(server, connection) ||
+         connection->list_build->page.length < STREAM_START_LEN)) {
+        return;
+    }
+    if (!connection->streaming) response_start(connection, "200 OK", "text/html");
+    list_build_emit(connection);
+    stream_output(server, connection);
+}
+
+static const char *complete_list(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    struct ListCache *cache = &server->list_cache;
+    struct ListBuild *build;
+    int installed;
+
+    if (reply->result != BACKEND_REPLY_OK) {
+        list_build_free(connection->list_build);
+        connection->list_build = NULL;
+        /* Truncating a streamed body is the only way left to report this. */
+        if (connection->streaming) {
+            connection->output.failed = 1;
+            return "503 Service Unavailable";
+        }
+        send_page(connection, "503 Service Unavailable",
+            "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n");
+        return "503 Service Unavailable";
+    }
+
+    if (!connection->list_build) connection->list_build = list_build_create();
+    build = connection->list_build;
+    if (build) {
+        list_build_feed(cache, build, reply);
+        buffer_append_text(&build->page, "</table></body></html>\n");
+        if (connection->streaming) list_build_emit(connection);
+    }
+    if (!build || build->lines.failed || build->page.failed) {
+        list_build_free(build);
+        connection->list_build = NULL;
+        cache->valid = 0;
+        connection->output.failed = 1;
+        return "500 Internal Server Error";
+    }
+    installed = list_cache_install(cache, build, server->config->gzip_level) == 0;
+    if (!installed) {
+        /*
+         * The page is complete; only caching it failed, so send it as is.
+         * A streamed body already holds every row and just needs finishing.
+         */
+        cache->valid = 0;
+        if (!connection->streaming) {
+            response_start(connection, "200 OK", "text/html");
+            buffer_free(&connection->output);
+            connection->output = build->page;
+            memset(&build->page, 0, sizeof(build->page));
+            compress_response(server, connection);
+        }
+    }
+    list_build_free(build);
+    connection->list_build = NULL;
+    if (!installed) return "200 OK";
+    cache->valid = connection->result_cacheable;
+    cache->generation = connection->result_generation;
+    if (connection->streaming) return "200 OK";
+    return respond_from_list_cache(server, connection);
+}
+
+/* Sends LIST2; the page is cached under the generation seen beforehand. */
+static const char *submit_list(
+    struct Server *server,
+    struct Connection *connection
+) {
+    connection->result_cacheable = server->generation_known;
+    connection->result_generation = server->generation;
+    buffer_reset(&connection->backend_command);
+    buffer_append_text(&connection->backend_command, "LIST2\n");
+    connection->backend_progress = progress_list;
+    return backend_submit(server, connection, complete_list,
+        BACKEND_MULTILINE | BACKEND_IDEMPOTENT);
+}
+
+static const char *complete_list_generation(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    const struct ListCache *cache = &server->list_cache;
+
+    if (reply->result != BACKEND_REPLY_OK) return complete_list(server, connection, reply);
+    if (note_generation(server, reply) == 0 &&
+        cache->valid && cache->generation == server->generation) {
+        return respond_from_list_cache(server, connection);
+    }
+    return submit_list(server, connection);
+}
+
+/*
+ * One page of /mdb-list?limit=&after= or &before=, in ascending id order.
+ * cursor is the id the page starts after, or ends before; 0 means the first
+ * page.
+ */
+struct ListPage {
+    uint64_t limit;
+    uint64_t cursor;
+    int before;
+};
+
+static int parse_list_page(const char *query, struct ListPage *page) {
+    char text[64];
+    size_t text_len = 0;
+    int limit_result;
+    int after_result;
+    int before_result;
+
+    memset(page, 0, sizeof(*page));
+    page->limit = LIST_PAGE_DEFAULT_LIMIT;
+    limit_result = parse_parameter(query, "limit", text, sizeof(text), &text_len);
+    if (limit_result < 0) return -1;
+    if (limit_result == 0 &&
+        (parse_positive_u64(text, &page->limit) < 0 || page->limit > LIST_PAGE_MAX_LIMIT)) {
+        return -1;
+    }
+
+    after_result = parse_parameter(query, "after", text, sizeof(text), &text_len);
+    if (after_result < 0) return -1;
+    if (after_result == 0 && parse_positive_u64(text, &page->cursor) < 0) return -1;
+
+    before_result = parse_parameter(query, "before", text, sizeof(text), &text_len);
+    if (before_result < 0) return -1;
+    if (before_result == 0) {
+        if (after_result == 0 || parse_positive_u64(text, &page->cursor) < 0) return -1;
+        page->before = 1;
+    }
+    return 0;
+}
+
+/*
+ * Renders a page from a RANGE2 reply. handle_list_page asks for one row
+ * more than the page holds; that row, if it arrives, shows that another
+ * page lies in the direction of travel.
+ */
+static const char *complete_list_page(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    struct ResponseBuffer *out = &connection->output;
+    struct ListPage page;
+    struct BackendRecord *records;
+    size_t count = 0;
+    size_t first = 0;
+    int has_prev;
+    int has_next;
+    char *line;
+
+    /* handle_list_page already validated the query. */
+    parse_list_page(connection->request.query, &page);
+    line = backend_reply_line(reply);
+    if (reply->result != BACKEND_REPLY_OK || (line && strncmp(line, "ERROR:", 6) == 0)) {
+        send_page(connection, "503 Service Unavailable",
+            "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n");
+        return "503 Service Unavailable";
+    }
+
+    records = (struct BackendRecord *)calloc((size_t)page.limit + 1, sizeof(*records));
+    if (!records) {
+        out->failed = 1;
+        return "500 Internal Server Error";
+    }
+    for (; line; line = backend_reply_line(reply)) {
+        if (count <= page.limit && parse_backend_record(line, &records[count]) == 0) count++;
+    }
+    if (page.before) {
+        has_prev = count > page.limit;
+        has_next = 1;
+        if (has_prev) first = 1;
+    } else {
+        has_prev = page.cursor > 0;
+        has_next = count > page.limit;
+    }
+    if (count > page.limit) count = page.limit;
+
+    response_start(connection, "200 OK", "text/html");
+    buffer_append_text(out,
+        "<!DOCTYPE html>\n"
+        "<html><head><title>Database Records</title></head><body>\n"
+        "<h1>Database Records</h1>\n"
+        "<p><a href=\"/mdb-lookup\">Search</a> | <a href=\"/mdb-add\">Add New</a></p>\n"
+        "<table border=\"1\">\n"
+        "<tr><th>ID</th><th>Name</th><th>Message</th><th>Actions</th></tr>\n");
+    for (size_t i = 0; i < count; i++) render_list_row(out, &records[first + i]);
+    buffer_printf(out, "</table>\n<p><a href=\"/mdb-list?limit=%" PRIu64 "\">First</a>",
+        page.limit);
+    if (has_prev && count > 0) {
+        buffer_printf(out,
+            " | <a href=\"/mdb-list?limit=%" PRIu64 "&amp;before=%" PRIu64 "\">Previous</a>",
+            page.limit, records[first].id);
+    }
+    if (has_next && count > 0) {
+        buffer_printf(out,
+            " | <a href=\"/mdb-list?limit=%" PRIu64 "&amp;after=%" PRIu64 "\">Next</a>",
+            page.limit, records[first + count - 1].id);
+    }
+    buffer_append_text(out, "</p>\n</body></html>\n");
+    free(records);
+    compress_response(server, connection);
+    return "200 OK";
+}
+
+/* Pushes the page bounds down to the backend as RANGE2. */
+static const char *handle_list_page(
+    struct Server *server,
+    struct Connection *connection
+) {
+    struct ListPage page;
+
+    if (parse_list_page(connection->request.query, &page) < 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid page</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    buffer_reset(&connection->backend_command);
+    buffer_printf(&connection->backend_command, "RANGE2 %s %" PRIu64 " %" PRIu64 "\n",
+        page.before ? "BEFORE" : "AFTER", page.cursor, page.limit + 1);
+    return backend_submit(server, connection, complete_list_page,
+        BACKEND_MULTILINE | BACKEND_IDEMPOTENT);
+}
+
+static const char *handle_list(
+    struct Server *server,
+    struct Connection *connection
+) {
+    if (connection->request.query[0] != '\0') return handle_list_page(server, connection);
+    if (!server->generation_known || server->list_cache.valid) {
+        buffer_reset(&connection->backend_command);
+        buffer_append_text(&connection->backend_command, "GENERATION\n");
+        return backend_submit(server, connection, complete_list_generation,
+            BACKEND_IDEMPOTENT);
+    }
+    return submit_list(server, connection);
+}
+
+static const char *handle_add_form(struct Connection *connection) {
+    const char *form =
+        "<!DOCTYPE html>\n"
+        "<html><head><title>Add Record</title></head><body>\n"
+        "<h1>Add New Record</h1>\n"
+        "<p><a href=\"/mdb-lookup\">Search</a> | <a href=\"/mdb-list\">List All</a></p>\n"
+        "<form method=POST action=/mdb-add>\n"
+        "Name (max 15 chars): <input type=text name=name maxlength=15 required><br><br>\n"
+        "Message (max 23 chars): <input type=text name=msg maxlength=23 required><br><br>\n"
+        "<input type=submit value=Add>\n"
+        "</form>\n"
+        "</body></html>\n";
+
+    response_start(connection, "200 OK", "text/html");
+
+    buffer_append_text(&connection->output, form);
+    return "200 OK";
+}
+
+/*
+ * Answers ADD, UPDATE, and DELETE: a redirect to the list on success, 404
+ * for a missing record, and 500 when the backend could not persist the
+ * change.
+ */
+static const char *complete_mutation(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    const char *path = connection->request.path;
+    char *line = backend_reply_line(reply);
+
+    if (reply->result == BACKEND_REPLY_UNAVAILABLE) {
+        send_page(connection, "503 Service Unavailable",
+            "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n");
+        return "503 Service Unavailable";
+    }
+    if (reply->result == BACKEND_REPLY_OK && line && strncmp(line, "OK", 2) == 0) {
+        /* Every cached result predates the new generation now. */
+        search_cache_clear(&server->search_cache);
+        send_redirect(connection, "/mdb-list");
+        return "302 Found";
+    }
+    if (reply->result == BACKEND_REPLY_OK && line &&
+        strstr(line, "Record not found") != NULL) {
+        send_page(connection, "404 Not Found",
+            "<!DOCTYPE html><html><body><h1>404 Not Found: Record not found</h1></body></html>\n");
+        return "404 Not Found";
+    }
+    if (strcmp(path, "/mdb-add") == 0) {
+        send_page(connection, "500 Internal Server Error",
+            "<!DOCTYPE html><html><body><h1>500 Error: Failed to add record</h1></body></html>\n");
+    } else if (strcmp(path, "/mdb-update") == 0) {
+        send_page(connection, "500 Internal Server Error",
+            "<!DOCTYPE html><html><body><h1>500 Internal Server Error: Update was not persisted</h1></body></html>\n");
+    } else {
+        send_page(connection, "500 Internal Server Error",
+            "<!DOCTYPE html><html><body><h1>500 Internal Server Error: Delete was not persisted</h1></body></html>\n");
+    }
+    return "500 Internal Server Error";
+}
+
+static const char *handle_add(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const char *post_body = connection->request.body;
+    char name[MAX_FORM_VALUE_LEN], msg[MAX_FORM_VALUE_LEN];
+    size_t name_len = 0, msg_len = 0;
+
+    if (parse_parameter(
+            post_body, "name", name, sizeof(name), &name_len) != 0 ||
+        parse_parameter(
+            post_body, "msg", msg, sizeof(msg), &msg_len) != 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed fields</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    if (validate_text_value(name, name_len, MAX_NAME_LEN, 1) < 0 ||
+        validate_text_value(msg, msg_len, MAX_MSG_LEN, 1) < 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid fields</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    buffer_reset(&connection->backend_command);
+    buffer_printf(&connection->backend_command, "ADD %s|%s\n", name, msg);
+    return backend_submit(server, connection, complete_mutation, 0);
+}
+
+static int parse_edit_id(const char *query, uint64_t *id) {
+    char id_text[64];
+    size_t id_len = 0;
+
+    if (parse_parameter(query, "id", id_text, sizeof(id_text), &id_len) != 0) return -1;
+    return parse_positive_u64(id_text, id);
+}
+
+static const char *complete_edit(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    struct ResponseBuffer *out = &connection->output;
+    uint64_t edit_id = 0;
+    char *line = backend_reply_line(reply);
+    struct BackendRecord record;
+
+    (void)server;
+    /* handle_edit already validated the id. */
+    parse_edit_id(connection->request.query, &edit_id);
+    if (reply->result == BACKEND_REPLY_OK && line &&
+        strcmp(line, "ERROR: Record not found") == 0) {
+        send_page(connection, "404 Not Found",
+            "<!DOCTYPE html><html><body><h1>404 Not Found</h1></body></html>\n");
+        return "404 Not Found";
+    }
+    if (reply->result != BACKEND_REPLY_OK ||
+        parse_backend_record(line, &record) < 0 ||
+        record.id != edit_id) {
+        send_page(connection, "503 Service Unavailable",
+            "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n");
+        return "503 Service Unavailable";
+    }
+
+    char escaped_name[MAX_NAME_LEN * 6 + 1];
+    char escaped_msg[MAX_MSG_LEN * 6 + 1];
+    html_escape(record.name, escaped_name, sizeof(escaped_name));
+    html_escape(record.message, escaped_msg, sizeof(escaped_msg));
+
+    response_start(connection, "200 OK", "text/html");
+
+    buffer_printf(out,
+        "<!DOCTYPE html>\n"
+        "<html><head><title>Edit Record</title></head><body>\n"
+        "<h1>Edit Record #%" PRIu64 "</h1>\n"
+        "<p><a href=\"/mdb-list\">Back to List</a></p>\n"
+        "<form method=POST action=/mdb-update>\n"
+        "<input type=hidden name=id value=%" PRIu64 ">\n"
+        "Name (max 15 chars): <input type=text name=name value=\"%s\" maxlength=15 required><br><br>\n"
+        "Message (max 23 chars): <input type=text name=msg value=\"%s\" maxlength=23 required><br><br>\n"
+        "<input type=submit value=Update>\n"
+        "</form>\n"
+        "</body></html>\n",
+        edit_id, edit_id, escaped_name, escaped_msg);
+    return "200 OK";
+}
+
+static const char *handle_edit(
+    struct Server *server,
+    struct Connection *connection
+) {
+    uint64_t edit_id;
+
+    if (parse_edit_id(connection->request.query, &edit_id) < 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid ID</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    buffer_reset(&connection->backend_command);
+    buffer_printf(&connection->backend_command, "GET %" PRIu64 "\n", edit_id);
+    return backend_submit(server, connection, complete_edit, BACKEND_IDEMPOTENT);
+}
+
+static const char *handle_update(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const char *post_body = connection->request.body;
+    char id_str[64], name[MAX_FORM_VALUE_LEN], msg[MAX_FORM_VALUE_LEN];
+    size_t id_len = 0, name_len = 0, msg_len = 0;
+
+    if (parse_parameter(
+            post_body, "id", id_str, sizeof(id_str), &id_len) != 0 ||
+        parse_parameter(
+            post_body, "name", name, sizeof(name), &name_len) != 0 ||
+        parse_parameter(
+            post_body, "msg", msg, sizeof(msg), &msg_len) != 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed fields</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    uint64_t id;
+    if (parse_positive_u64(id_str, &id) < 0 ||
+        validate_text_value(name, name_len, MAX_NAME_LEN, 1) < 0 ||
+        validate_text_value(msg, msg_len, MAX_MSG_LEN, 1) < 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid data</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    buffer_reset(&connection->backend_command);
+    buffer_printf(&connection->backend_command,
+        "UPDATE %" PRIu64 "|%s|%s\n",
+        id,
+        name,
+        msg);
+    return backend_submit(server, connection, complete_mutation, 0);
+}
+
+static const char *handle_delete(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const char *post_body = connection->request.body;
+    char id_str[64];
+    size_t id_len = 0;
+
+    if (parse_parameter(
+            post_body, "id", id_str, sizeof(id_str), &id_len) != 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed ID</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    uint64_t id;
+    if (parse_positive_u64(id_str, &id) < 0) {
+        send_page(connection, "400 Bad Request",
+            "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid ID</h1></body></html>\n");
+        return "400 Bad Request";
+    }
+
+    buffer_reset(&connection->backend_command);
+    buffer_printf(&connection->backend_command, "DELETE %" PRIu64 "\n", id);
+    return backend_submit(server, connection, complete_mutation, 0);
+}
+
+/*
+ * Appends text as a JSON string. Runs of bytes that need no escape are
+ * copied in one append; stored fields never hold control bytes, so for
+ * most records that is the whole field.
+ */
+static void json_escape(struct ResponseBuffer *out, const char *text) {
+    const char *run = text;
+    const char *p;
+
+    buffer_append(out, "\"", 1);
+    for (p = text; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        buffer_append(out, run, (size_t)(p - run));
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            buffer_append(out, escaped, 2);
+        } else {
+            buffer_printf(out, "\\u%04x", c);
+        }
+        run = p + 1;
+    }
+    buffer_append(out, run, (size_t)(p - run));
+    buffer_append(out, "\"", 1);
+}
+
+static void render_json_record(struct ResponseBuffer *out, const struct BackendRecord *record) {
+    buffer_printf(out, "{\"id\":%" PRIu64 ",\"name\":", record->id);
+    json_escape(out, record->name);
+    buffer_append_text(out, ",\"message\":");
+    json_escape(out, record->message);
+    buffer_append(out, "}\n", 2);
+}
+
+static void send_json_error(struct Connection *connection, const char *status, const char *message) {
+    buffer_reset(&connection->output);
+    response_start(connection, status, "application/json");
+    buffer_append_text(&connection->output, "{\"error\":");
+    json_escape(&connection->output, message);
+    buffer_append_text(&connection->output, "}\n");
+}
+
+/* Converts the complete LIST2 or SEARCH2 rows of reply to NDJSON lines. */
+static void render_api_rows(struct Connection *connection, struct BackendReply *reply) {
+    char *line;
+
+    while ((line = backend_reply_line(reply)) != NULL) {
+        struct BackendRecord record;
+
+        if (parse_backend_record(line, &record) == 0) {
+            render_json_record(&connection->output, &record);
+        }
+    }
+}
+
+/* Streams NDJSON once it fills a first chunk, as progress_list does. */
+static void progress_api_rows(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    render_api_rows(connection, reply);
+    if (!connection->streaming &&
+        (!stream_allowed(server, connection) ||
+         connection->output.length < STREAM_START_LEN)) {
+        return;
+    }
+    if (!connection->streaming) response_start(connection, "200 OK", "application/x-ndjson");
+    stream_output(server, connection);
+}
+
+static const char *complete_api_rows(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    if (reply->result != BACKEND_REPLY_OK) {
+        /* Truncating a streamed body is the only way left to report this. */
+        if (connection->streaming) {
+            connection->output.failed = 1;
+            return "503 Service Unavailable";
+        }
+        send_json_error(connection, "503 Service Unavailable", "Backend unavailable");
+        return "503 Service Unavailable";
+    }
+
+    render_api_rows(connection, reply);
+    if (connection->streaming) return "200 OK";
+    response_start(connection, "200 OK", "application/x-ndjson");
+    compress_response(server, connection);
+    return "200 OK";
+}
+
+static const char *complete_api_record(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    char *line = backend_reply_line(reply);
+    struct BackendRecord record;
+
+    (void)server;
+    if (reply->result == BACKEND_REPLY_OK && line &&
+        strcmp(line, "ERROR: Record not found") == 0) {
+        send_json_error(connection, "404 Not Found", "Record not found");
+        return "404 Not Found";
+    }
+    if (reply->result != BACKEND_REPLY_OK || parse_backend_record(line, &record) < 0) {
+        send_json_error(connection, "503 Service Unavailable", "Backend unavailable");
+        return "503 Service Unavailable";
+    }
+
+    response_start(connection, "200 OK", "application/json");
+    render_json_record(&connection->output, &record);
+    return "200 OK";
+}
+
+/*
+ * /api/records lists every record, /api/records/<id> returns one, and
+ * /api/search?key= matches like /mdb-lookup. Lists are NDJSON, one object
+ * per line, so they stream the same way the HTML pages do.
+ */
+static const char *handle_api(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const char *path = connection->request.path;
+
+    buffer_reset(&connection->backend_command);
+    if (strcmp(path, "/api/records") == 0) {
+        buffer_append_text(&connection->backend_command, "LIST2\n");
+    } else if (strncmp(path, "/api/records/", 13) == 0) {
+        uint64_t id;
+
+        if (parse_positive_u64(path + 13, &id) < 0) {
+            send_json_error(connection, "400 Bad Request", "Invalid ID");
+            return "400 Bad Request";
+        }
+        buffer_printf(&connection->backend_command, "GET %" PRIu64 "\n", id);
+        return backend_submit(server, connection, complete_api_record, BACKEND_IDEMPOTENT);
+    } else {
+        char key[MAX_FORM_VALUE_LEN];
+        size_t key_len = 0;
+
+        if (parse_parameter(connection->request.query, "key", key, sizeof(key), &key_len) != 0) {
+            send_json_error(connection, "400 Bad Request", "Missing or malformed key");
+            return "400 Bad Request";
+        }
+        trim_whitespace(key, &key_len);
+        if (validate_text_value(key, key_len, MAX_SEARCH_KEY_LEN, 0) < 0) {
+            send_json_error(connection, "400 Bad Request", "Invalid key");
+            return "400 Bad Request";
+        }
+        buffer_printf(&connection->backend_command, "SEARCH2 %s\n", key);
+    }
+    connection->backend_progress = progress_api_rows;
+    return backend_submit(server, connection, complete_api_rows,
+        BACKEND_MULTILINE | BACKEND_IDEMPOTENT);
+}
+
+/*
+ * Appends the delimiter and headers that open one multipart/byteranges
+ * part, or the closing delimiter when range is NULL. Every delimiter starts
+ * with CRLF; before the first part that is an empty preamble.
+ */
+static int append_range_part_header(
+    struct ResponseBuffer *out,
+    const char *boundary,
+    const char *content_type,
+    const struct ByteRange *range,
+    off_t size
+) {
+    if (!range) return buffer_printf(out, "\r\n--%s--\r\n", boundary);
+    return buffer_printf(out,
+        "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %jd-%jd/%jd\r\n\r\n",
+        boundary,
+        content_type,
+        (intmax_t)range->first,
+        (intmax_t)range->last,
+        (intmax_t)size);
+}
+
+/*
+ * Moves a multipart response from a file on to its next part. Returns 1 when
+ * more output was queued and 0 once the closing delimiter has been sent.
+ */
+static int queue_next_range_part(struct Connection *connection) {
+    const struct ByteRange *range;
+
+    if (connection->range_next > connection->range_count) return 0;
+
+    buffer_reset(&connection->output);
+    range = connection->range_next < connection->range_count
+        ? &connection->ranges[connection->range_next]
+        : NULL;
+    append_range_part_header(
+        &connection->output,
+        connection->range_boundary,
+        connection->range_type,
+        range,
+        connection->range_file_size);
+    if (range) {
+        connection->file_offset = range->first;
+        connection->file_remaining = range->last - range->first + 1;
+    }
+    connection->range_next++;
+    /* The head went out with the first part. */
+    connection->output_sent = connection->head.length;
+    return 1;
+}
+
+/*
+ * Answers a Range request from an in-memory body (entry) or an open file.
+ * Returns NULL when the header does not apply and the whole file should be
+ * sent; the caller still owns file_fd unless connection->file_fd took it.
+ */
+static const char *respond_ranges(
+    struct Connection *connection,
+    const struct StaticCacheEntry *entry,
+    int file_fd,
+    off_t size,
+    const char *content_type,
+    const struct StaticValidators *validators
+) {
+    const struct HttpRequest *request = &connection->request;
+    struct ByteRange *ranges = connection->ranges;
+    static unsigned int boundary_counter;
+    int count;
+
+    if (!request->range || request->range_repeated) return NULL;
+    if (request->if_range && !if_range_matches(request->if_range, validators)) {
+        return NULL;
+    }
+    count = parse_byte_ranges(request->range, size, ranges, MAX_BYTE_RANGES);
+    if (count < 0) return NULL;
+
+    if (count == 0) {
+        char content_range[64];
+        snprintf(content_range, sizeof(content_range),
+            "Content-Range: bytes */%jd\r\n", (intmax_t)size);
+        send_error_page(connection, "416 Range Not Satisfiable", content_range);
+        return "416 Range Not Satisfiable";
+    }
+
+    if (count == 1) {
+        off_t length = ranges[0].last - ranges[0].first + 1;
+
+        response_start(connection, "206 Partial Content", content_type);
+        buffer_append(&connection->head, validators->headers, validators->headers_length);
+        response_header(connection, "Content-Range: bytes %jd-%jd/%jd\r\n",
+            (intmax_t)ranges[0].first, (intmax_t)ranges[0].last, (intmax_t)size);
+        if (entry) {
+            buffer_append(&connection->output, entry->body + ranges[0].first, (size_t)length);
+        } else {
+            connection->file_fd = file_fd;
+            connection->file_offset = ranges[0].first;
+            connection->file_remaining = length;
+            connection->file_copy = 0;
+        }
+        return "206 Partial Content";
+    }
+
+    snprintf(connection->range_boundary, sizeof(connection->range_boundary),
+        "%08x%08x",
+        (unsigned int)getpid() ^ (unsigned int)monotonic_ms(),
+        ++boundary_counter);
+    response_start(connection, "206 Partial Content", NULL);
+    response_header(connection,
+        "Content-Type: multipart/byteranges; boundary=%s\r\n",
+        connection->range_boundary);
+    buffer_append(&connection->head, validators->headers, validators->headers_length);
+
+    if (entry) {
+        for (int i = 0; i < count; i++) {
+            append_range_part_header(&connection->output,
+                connection->range_boundary, content_type, &ranges[i], size);
+            buffer_append(&connection->output, entry->body + ranges[i].first,
+                (size_t)(ranges[i].last - ranges[i].first + 1));
+        }
+        append_range_part_header(&connection->output,
+            connection->range_boundary, content_type, NULL, size);
+        return "206 Partial Content";
+    }
+
+    /*
+     * From a file, only the first part header is built now; the rest are
+     * queued as each part's file data finishes. Their total length is
+     * measured up front for Content-Length.
+     */
+    struct ResponseBuffer measure;
+    memset(&measure, 0, sizeof(measure));
+    connection->range_tail_length = 0;
+    for (int i = 1; i <= count; i++) {
+        buffer_reset(&measure);
+        append_range_part_header(&measure, connection->range_boundary,
+            content_type, i < count ? &ranges[i] : NULL, size);
+        connection->range_tail_length += (off_t)measure.length;
+        if (i < count) connection->range_tail_length += ranges[i].last - ranges[i].first + 1;
+    }
+    if (measure.failed) connection->head.failed = 1;
+    buffer_free(&measure);
+
+    append_range_part_header(&connection->output,
+        connection->range_boundary, content_type, &ranges[0], size);
+    connection->range_count = count;
+    connection->range_next = 1;
+    connection->range_type = content_type;
+    connection->range_file_size = size;
+    connection->file_fd = file_fd;
+    connection->file_offset = ranges[0].first;
+    connection->file_remaining = ranges[0].last - ranges[0].first + 1;
+    connection->file_copy = 0;
+    return "206 Partial Content";
+}
+
+static const char *respond_not_modified(
+    struct Connection *connection,
+    const struct StaticValidators *validators
+) {
+    response_start(connection, "304 Not Modified", NULL);
+    buffer_append(&connection->head, validators->headers, validators->headers_length);
+    return "304 Not Modified";
+}
+
+static const char *respond_from_cache(
+    struct Connection *connection,
+    struct StaticCacheEntry *entry
+) {
+    connection->bodiless = 0;
+    buffer_reset(&connection->head);
+    buffer_append(&connection->head, entry->head, entry->head_length);
+    entry->references++;
+    connection->cached = entry;
+    return "200 OK";
+}
+
+/*
+ * Replaces an open static file with its precompressed sibling (path + ".br"
+ * or ".gz") when the client accepts that coding and the sibling exists.
+ */
+static enum ContentEncoding open_static_sibling(
+    struct Server *server,
+    const char *path,
+    int serves_index,
+    int accepted,
+    int *file_fd,
+    struct stat *file_stat
+) {
+    static const char *suffixes[] = { NULL, ".gz", ".br" };
+    static const enum ContentEncoding preference[] = { ENCODING_BR, ENCODING_GZIP };
+    char sibling[MAX_URI_LEN];
+    size_t path_length = strlen(path);
+    const char *index = serves_index && path[path_length - 1] == '/' ? "index.html" : "";
+
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+        enum ContentEncoding encoding = preference[i];
+        int sibling_fd;
+        int sibling_index;
+        struct stat sibling_stat;
+        int length;
+
+        if (!(accepted & (1 << encoding))) continue;
+        length = snprintf(sibling, sizeof(sibling), "%s%s%s", path, index, suffixes[encoding]);
+        if (length < 0 || (size_t)length >= sizeof(sibling)) continue;
+        if (open_static_file(server->web_root_fd, sibling, &sibling_fd,
+                &sibling_stat, &sibling_index) != STATIC_FILE_OK) {
+            continue;
+        }
+        close(*file_fd);
+        *file_fd = sibling_fd;
+        *file_stat = sibling_stat;
+        return encoding;
+    }
+    return ENCODING_IDENTITY;
+}
+
+static const char *handle_static(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const char *path = connection->request.path;
+    char key[MAX_URI_LEN + 3];
+    int static_fd = -1;
+    struct stat st;
+    int serves_index = 0;
+    struct StaticCacheEntry *entry = NULL;
+    int accepted = accepted_encodings(connection->request.accept_encoding);
+    int cacheable = static_cache_normalize(path, key, MAX_URI_LEN) == 0;
+    struct StaticValidators validators;
+    enum ContentEncoding encoding;
+    int gzip_level = 0;
+    const char *content_type;
+    const char *cache_control;
+    const char *status;
+    enum StaticFileResult static_result;
+
+    /* Each set of accepted codings may select a different representation. */
+    if (cacheable && accepted) {
+        size_t key_length = strlen(key);
+        key[key_length] = '\t';
+        key[key_length + 1] = (char)('0' + accepted);
+        key[key_length + 2] = '\0';
+    }
+    if (cacheable) {
+        entry = static_cache_lookup(&server->static_cache, key);
+        if (entry) {
+            worker_metrics->static_cache_hits++;
+        } else {
+            worker_metrics->static_cache_misses++;
+        }
+    }
+    if (entry && static_not_modified(&connection->request, &entry->validators)) {
+        return respond_not_modified(connection, &entry->validators);
+    }
+    if (entry) {
+        status = respond_ranges(connection, entry, -1,
+            (off_t)entry->body_length, entry->content_type, &entry->validators);
+        if (status) return status;
+        return respond_from_cache(connection, entry);
+    }
+
+    static_result = open_static_file(
+        server->web_root_fd,
+        path,
+        &static_fd,
+        &st,
+        &serves_index);
+
+    if (static_result != STATIC_FILE_OK) {
+        if (static_result == STATIC_FILE_NOT_FOUND) {
+            status = "404 Not Found";
+        } else if (static_result == STATIC_FILE_FORBIDDEN) {
+            status = "403 Forbidden";
+        } else if (static_result == STATIC_FILE_PATH_TOO_LONG) {
+            status = "414 URI Too Long";
+        } else {
+            status = "500 Internal Server Error";
+        }
+        send_error_page(connection, status, NULL);
+        return status;
+    }
+
+    if (st.st_size < 0) {
+        close(static_fd);
+        send_error_page(connection, "500 Internal Server Error", NULL);
+        return "500 Internal Server Error";
+    }
+
+    content_type = static_content_type(path, serves_index, &cache_control);
+    encoding = open_static_sibling(server, path, serves_index, accepted, &static_fd, &st);
+    /* Text without a precompressed sibling is gzipped once into the cache. */
+    if (encoding == ENCODING_IDENTITY &&
+        (accepted & ACCEPT_GZIP) &&
+        server->config->gzip_level > 0 &&
+        cacheable &&
+        server->static_cache.enabled &&
+        st.st_size <= STATIC_CACHE_MAX_FILE &&
+        strncmp(content_type, "text/", 5) == 0) {
+        encoding = ENCODING_GZIP;
+        gzip_level = server->config->gzip_level;
+    }
+    if (static_validators_init(&validators, &st, cache_control, encoding) < 0) {
+        close(static_fd);
+        send_error_page(connection, "500 Internal Server Error", NULL);
+        return "500 Internal Server Error";
+    }
+    if (static_not_modified(&connection->request, &validators)) {
+        close(static_fd);
+        return respond_not_modified(connection, &validators);
+    }
+
+    if (cacheable) {
+        entry = static_cache_fill(
+            &server->static_cache,
+            key,
+            static_fd,
+            &st,
+            content_type,
+            &validators,
+            gzip_level);
+    }
+    if (!entry && gzip_level > 0 &&
+        static_validators_init(&validators, &st, cache_control, ENCODING_IDENTITY) < 0) {
+        close(static_fd);
+        send_error_page(connection, "500 Internal Server Error", NULL);
+        return "500 Internal Server Error";
+    }
+    if (entry) {
+        close(static_fd);
+        status = respond_ranges(connection, entry, -1,
+            (off_t)entry->body_length, content_type, &validators);
+        if (status) return status;
+        return respond_from_cache(connection, entry);
+    }
+
+    status = respond_ranges(connection, NULL, static_fd, st.st_size,
+        content_type, &validators);
+    if (status) {
+        if (connection->file_fd != static_fd) close(static_fd);
+        return status;
+    }
+
+    response_start(connection, "200 OK", content_type);
+    buffer_append(&connection->head, validators.headers, validators.headers_length);
+    connection->file_fd = static_fd;
+    connection->file_offset = 0;
+    connection->file_remaining = st.st_size;
+    connection->file_copy = 0;
+    return "200 OK";
+}
+
+/*
+ * Answers /metrics in the Prometheus text format with the sum of every
+ * worker's counters. Slots are read while their owners keep counting, so
+ * a scrape can be a request or two behind, never inconsistent in a way
+ * that makes a counter decrease between scrapes.
+ */
+static const char *handle_metrics(struct Server *server, struct Connection *connection) {
+    struct ResponseBuffer *out = &connection->output;
+    struct WorkerMetrics *total = (struct WorkerMetrics *)calloc(1, sizeof(*total));
+    uint64_t lookups;
+
+    if (!total) {
+        out->failed = 1;
+        return "500 Internal Server Error";
+    }
+    for (int slot = 0; slot < metrics_slot_count; slot++) {
+        const struct WorkerMetrics *worker = &metrics_slots[slot];
+
+        for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+            for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+                total->responses[route][code] += worker->responses[route][code];
+            }
+            total->bytes_sent[route] += worker->bytes_sent[route];
+            for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+                struct LatencyHistogram *sum = &total->latency[route][phase];
+                const struct LatencyHistogram *part = &worker->latency[route][phase];
+
+                for (int bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++) {
+                    sum->buckets[bucket] += part->buckets[bucket];
+                }
+                sum->count += part->count;
+                sum->sum_us += part->sum_us;
+            }
+        }
+        total->backend_connects += worker->backend_connects;
+        total->backend_retries += worker->backend_retries;
+        total->static_cache_hits += worker->static_cache_hits;
+        total->static_cache_misses += worker->static_cache_misses;
+        total->shed_connections += worker->shed_connections;
+        total->shed_requests += worker->shed_requests;
+    }
+
+    (void)server;
+    response_start(connection, "200 OK", "text/plain; version=0.0.4");
+    buffer_append_text(out,
+        "# HELP http_requests_total Responses by route and status code.\n"
+        "# TYPE http_requests_total counter\n");
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+            if (total->responses[route][code] == 0) continue;
+            buffer_printf(out, "http_requests_total{route=\"%s\",code=\"%d\"} %" PRIu64 "\n",
+                metrics_route_names[route], code + METRICS_MIN_STATUS,
+                total->responses[route][code]);
+        }
+    }
+
+    buffer_append_text(out,
+        "# HELP http_request_phase_seconds Time spent reading, handling and sending requests.\n"
+        "# TYPE http_request_phase_seconds histogram\n");
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+            const struct LatencyHistogram *histogram = &total->latency[route][phase];
+            uint64_t cumulative = 0;
+
+            if (histogram->count == 0) continue;
+            for (int bucket = 0; bucket < METRICS_LATENCY_BUCKETS; bucket++) {
+                cumulative += histogram->buckets[bucket];
+                buffer_printf(out,
+                    "http_request_phase_seconds_bucket{route=\"%s\",phase=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+                    metrics_route_names[route], metrics_phase_names[phase],
+                    (double)metrics_bucket_bounds[bucket] / 1e6, cumulative);
+            }
+            buffer_printf(out,
+                "http_request_phase_seconds_bucket{route=\"%s\",phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+                "http_request_phase_seconds_sum{route=\"%s\",phase=\"%s\"} %.6f\n"
+                "http_request_phase_seconds_count{route=\"%s\",phase=\"%s\"} %" PRIu64 "\n",
+                metrics_route_names[route], metrics_phase_names[phase], histogram->count,
+                metrics_route_names[route], metrics_phase_names[phase],
+                (double)histogram->sum_us / 1e6,
+                metrics_route_names[route], metrics_phase_names[phase], histogram->count);
+        }
+    }
+
+    buffer_append_text(out,
+        "# HELP http_response_bytes_total Bytes written to clients by route.\n"
+        "# TYPE http_response_bytes_total counter\n");
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        if (total->bytes_sent[route] == 0) continue;
+        buffer_printf(out, "http_response_bytes_total{route=\"%s\"} %" PRIu64 "\n",
+            metrics_route_names[route], total->bytes_sent[route]);
+    }
+
+    lookups = total->static_cache_hits + total->static_cache_misses;
+    buffer_printf(out,
+        "# HELP http_backend_connects_total Connections opened to the database server.\n"
+        "# TYPE http_backend_connects_total counter\n"
+        "http_backend_connects_total %" PRIu64 "\n"
+        "# HELP http_backend_retries_total Commands resent after a pooled connection was found closed.\n"
+        "# TYPE http_backend_retries_total counter\n"
+        "http_backend_retries_total %" PRIu64 "\n"
+        "# HELP http_static_cache_hits_total Static requests answered from the file cache.\n"
+        "# TYPE http_static_cache_hits_total counter\n"
+        "http_static_cache_hits_total %" PRIu64 "\n"
+        "# HELP http_static_cache_misses_total Cacheable static requests that missed the file cache.\n"
+        "# TYPE http_static_cache_misses_total counter\n"
+        "http_static_cache_misses_total %" PRIu64 "\n"
+        "# HELP http_static_cache_hit_ratio Share of cacheable static requests that hit.\n"
+        "# TYPE http_static_cache_hit_ratio gauge\n"
+        "http_static_cache_hit_ratio %g\n"
+        "# HELP http_shed_total Requests refused with 503 to shed load.\n"
+        "# TYPE http_shed_total counter\n"
+        "http_shed_total{reason=\"connections\"} %" PRIu64 "\n"
+        "http_shed_total{reason=\"backend_queue\"} %" PRIu64 "\n",
+        total->backend_connects,
+        total->backend_retries,
+        total->static_cache_hits,
+        total->static_cache_misses,
+        lookups ? (double)total->static_cache_hits / (double)lookups : 0.0,
+        total->shed_connections,
+        total->shed_requests);
+    free(total);
+    return "200 OK";
+}
+
+static const char *route_request(
+    struct Server *server,
+    struct Connection *connection
+) {
+    const struct HttpRequest *request = &connection->request;
+    const char *path = request->path;
+
+    if (request->is_get && strcmp(path, "/mdb-lookup") == 0) {
+        if (request->query[0] == '\0') return handle_lookup_form(connection);
+        return handle_lookup(server, connection);
+    }
+    if (request->is_get && strcmp(path, "/mdb-list") == 0) {
+        return handle_list(server, connection);
+    }
+    if (request->is_get && is_api_path(path)) {
+        return handle_api(server, connection);
+    }
+    if (request->is_get && strcmp(path, "/metrics") == 0) {
+        return handle_metrics(server, connection);
+    }
+    if (request->is_get && strcmp(path, "/mdb-add") == 0) {
+        return handle_add_form(connection);
+    }
+    if (request->is_post && strcmp(path, "/mdb-add") == 0) {
+        return handle_add(server, connection);
+    }
+    if (request->is_get && strcmp(path, "/mdb-edit") == 0) {
+        return handle_edit(server, connection);
+    }
+    if (request->is_post && strcmp(path, "/mdb-update") == 0) {
+        return handle_update(server, connection);
+    }
+    if (request->is_post && strcmp(path, "/mdb-delete") == 0) {
+        return handle_delete(server, connection);
+    }
+    return handle_static(server, connection);
+}
+
+/*
+ * Queues the response a handler (or backend completion) has built. A
+ * streamed response that fails part way can only be cut off.
+ */
+static void finish_request(
+    struct Server *server,
+    struct Connection *connection,
+    const char *status
+) {
+    if (connection->streaming &&
+        (connection->head.failed || connection->output.failed)) {
+        account_request(connection, status);
+        connection_close(server, connection);
+        return;
+    }
+    if ((!connection->streaming && connection->head.length == 0) ||
+        connection->head.failed ||
+        connection->output.failed) {
+        connection_release_body(connection);
+        respond_error(connection, "500 Internal Server Error", NULL);
+        return;
+    }
+    account_request(connection, status);
+    begin_response(connection, 1);
+}
+
+/*
+ * True when a database request should be turned away at once: the queue
+ * for a backend connection is full, or its oldest request has already
+ * waited longer than the budget. A request refused now can be retried
+ * elsewhere; one that waits would most likely time out anyway.
+ */
+static int backend_overloaded(const struct Server *server) {
+    const struct BackendPool *pool = &server->backend_pool;
+    const struct ServerConfig *config = server->config;
+
+    if (!pool->waiting_head) return 0;
+    if (pool->waiting_count >= config->max_backend_queue) return 1;
+    return config->queue_budget_ms > 0 &&
+        monotonic_ms() - pool->waiting_head->queued_ms > (uint64_t)config->queue_budget_ms;
+}
+
+static int uses_backend(enum MetricsRoute route) {
+    return route != METRICS_ROUTE_STATIC &&
+        route != METRICS_ROUTE_METRICS &&
+        route != METRICS_ROUTE_OTHER;
+}
+
+static void dispatch_request(struct Server *server, struct Connection *connection) {
+    const char *status;
+
+    buffer_reset(&connection->head);
+    buffer_reset(&connection->output);
+    connection->streaming = 0;
+    connection->backend_progress = NULL;
+    connection->dispatch_us = monotonic_us();
+    if (uses_backend(metrics_route(connection->request.path)) && backend_overloaded(server)) {
+        worker_metrics->shed_requests++;
+        send_error_page(connection, "503 Service Unavailable", RETRY_AFTER_HEADER);
+        finish_request(server, connection, "503 Service Unavailable");
+        return;
+    }
+    status = route_request(server, connection);
+    /* A database request finishes once its backend reply arrives. */
+    if (status) finish_request(server, connection, status);
+}
+
+/*
+ * Validates a complete request line. Anything that can be rejected from the
+ * line alone is answered immediately, before the header block is read.
+ */
+static void accept_request_line(struct Connection *connection, const char *line) {
+    struct HttpRequest *request = &connection->request;
+    const char *token_separators = "\t \r\n";
+    char *save_pointer = NULL;
+    char *extra_token;
+
+    connection->request_start_us = monotonic_us();
+    request->line = strdup(line);
+    if (!request->line) {
+        respond_error(connection, "500 Internal Server Error", NULL);
+        return;
+    }
+    request->method = strtok_r(request->line, token_separators, &save_pointer);
+    request->target = strtok_r(NULL, token_separators, &save_pointer);
+    request->version = strtok_r(NULL, token_separators, &save_pointer);
+    extra_token = strtok_r(NULL, token_separators, &save_pointer);
+
+    if (!request->method || !request->target || !request->version || extra_token) {
+        respond_error(connection, "400 Bad Request", NULL);
+        return;
+    }
+    if (strlen(request->target) >= MAX_URI_LEN) {
+        respond_error(connection, "414 URI Too Long", NULL);
+        return;
+    }
+
+    request->path = request->target;
+    char *query_start = strchr(request->target, '?');
+    if (query_start) {
+        *query_start = '\0';
+        request->query = query_start + 1;
+    }
+
+    request->is_get = strcmp(request->method, "GET") == 0;
+    request->is_post = strcmp(request->method, "POST") == 0;
+    if (strcmp(request->version, "HTTP/1.0") != 0 &&
+        strcmp(request->version, "HTTP/1.1") != 0) {
+        respond_error(connection, "505 HTTP Version Not Supported", NULL);
+        return;
+    }
+
+    if (request->path[0] != '/' || forbidden_dotdot(request->path)) {
+        respond_error(connection, "400 Bad Request", NULL);
+        return;
+    }
+
+    request->allowed_methods = allowed_db_methods(request->path);
+    if ((!request->is_get && !request->is_post) ||
+        (request->allowed_methods &&
+         !db_method_is_allowed(request->allowed_methods, request->method))) {
+        if (request->allowed_methods) {
+            char allow_header[64];
+            snprintf(
+                allow_header,
+                sizeof(allow_header),
+                "Allow: %s\r\n",
+                request->allowed_methods);
+            respond_error(connection, "405 Method Not Allowed", allow_header);
+        } else {
+            respond_error(connection, "501 Not Implemented", NULL);
+        }
+        return;
+    }
+
+    /*
+     * Every non-database path falls through to static-file handling, which
+     * is deliberately GET-only.
+     */
+    if (!request->allowed_methods && request->is_post) {
+        respond_error(connection, "405 Method Not Allowed", "Allow: GET\r\n");
+        return;
+    }
+
+    connection->state = CONNECTION_READING_HEADERS;
+}
+
+/*
+ * Consumes as much buffered input as possible. Returns 1 once a response has
+ * been queued and 0 when more input is required.
+ */
+static int advance_request(struct Server *server, struct Connection *connection) {
+    struct HttpRequest *request = &connection->request;
+
+    while (connection->state == CONNECTION_READING_REQUEST_LINE ||
+           connection->state == CONNECTION_READING_HEADERS ||
+           connection->state == CONNECTION_READING_BODY) {
+        char *data = connection->input + connection->input_start;
+        size_t available = connection->input_length - connection->input_start;
+        size_t wire_length = 0;
+        enum HttpLineResult line_result;
+
+        if (connection->state == CONNECTION_READING_BODY) {
+            enum RequestReadResult body_result;
+
+            if (available < request->content_length) return 0;
+            body_result = finish_request_body(
+                request, data, request->content_length);
+            connection->input_start += request->content_length;
+            if (body_result != REQUEST_READ_OK) {
+                respond_error(connection, request_read_status(body_result), NULL);
+            } else {
+                dispatch_request(server, connection);
+            }
+            return 1;
+        }
+
+        if (connection->state == CONNECTION_READING_REQUEST_LINE) {
+            line_result = scan_http_line(
+                data, available, MAX_REQUEST_LEN, &connection->line_scanned, &wire_length);
+            if (line_result == HTTP_LINE_INCOMPLETE) return 0;
+            if (line_result == HTTP_LINE_TOO_LONG) {
+                respond_error(connection, "414 URI Too Long", NULL);
+                return 1;
+            }
+            if (line_result == HTTP_LINE_NUL) {
+                respond_error(connection, "400 Bad Request", NULL);
+                return 1;
+            }
+            data[wire_length - 1] = '\0';
+            connection->input_start += wire_length;
+            accept_request_line(connection, data);
+            continue;
+        }
+
+        line_result = scan_http_line(
+            data,
+            available,
+            MAX_HEADER_LINE_LEN,
+            &connection->line_scanned,
+            &wire_length);
+        if (line_result == HTTP_LINE_INCOMPLETE) return 0;
+        if (line_result == HTTP_LINE_TOO_LONG) {
+            respond_error(connection, "431 Request Header Fields Too Large", NULL);
+            return 1;
+        }
+        if (line_result == HTTP_LINE_NUL) {
+            respond_error(connection, "400 Bad Request", NULL);
+            return 1;
+        }
+        if (wire_length > MAX_HEADER_BYTES - request->header_bytes) {
+            respond_error(connection, "431 Request Header Fields Too Large", NULL);
+            return 1;
+        }
+        request->header_bytes += wire_length;
+        connection->input_start += wire_length;
+
+        size_t line_length = wire_length - 1;
+        data[line_length] = '\0';
+        if (line_length == 0 || (line_length == 1 && data[0] == '\r')) {
+            enum RequestReadResult header_result = finish_request_headers(request);
+            if (header_result != REQUEST_READ_OK) {
+                respond_error(connection, request_read_status(header_result), NULL);
+                return 1;
+            }
+            connection->state = CONNECTION_READING_BODY;
             continue;
         }
 
-        const char *allowed_methods = allowed_db_methods(requestURI);
-        if (!is_get && !is_post) {
-            if (allowed_methods) {
-                char allow_header[64];
-                snprintf(
-                    allow_header,
-                    sizeof(allow_header),
-                    "Allow: %s\r\n",
-                    allowed_methods);
-                snprintf(resp, sizeof(resp), "405 Method Not Allowed");
-                send_error_page(
-                    clntsock,
-                    "405 Method Not Allowed",
-                    allow_header);
-            } else {
-                snprintf(resp, sizeof(resp), "501 Not Implemented");
-                send_error_page(clntsock, "501 Not Implemented", NULL);
-            }
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
-        }
+        enum RequestReadResult header_result =
+            parse_header_line(data, line_length, request);
+        if (header_result != REQUEST_READ_OK) {
+            respond_error(connection, request_read_status(header_result), NULL);
+            return 1;
+        }
+    }
+    return 1;
+}
+
+static enum IoStatus connection_fill(struct Connection *connection) {
+    if (connection->input_start > 0) {
+        memmove(
+            connection->input,
+            connection->input + connection->input_start,
+            connection->input_length - connection->input_start);
+        connection->input_length -= connection->input_start;
+        connection->input_start = 0;
+    }
+
+    if (connection->input_length == connection->input_capacity) {
+        size_t capacity = connection->input_capacity
+            ? connection->input_capacity * 2
+            : INPUT_BUFFER_INITIAL;
+        char *input;
+
+        if (connection->input_capacity >= INPUT_BUFFER_LIMIT) return IO_FULL;
+        if (capacity > INPUT_BUFFER_LIMIT) capacity = INPUT_BUFFER_LIMIT;
+        input = (char *)realloc(connection->input, capacity);
+        if (!input) return IO_ERROR;
+        connection->input = input;
+        connection->input_capacity = capacity;
+    }
+
+    while (1) {
+        ssize_t n = recv(
+            connection->fd,
+            connection->input + connection->input_length,
+            connection->input_capacity - connection->input_length,
+            0);
+        if (n > 0) {
+            connection->input_length += (size_t)n;
+            return IO_PROGRESS;
+        }
+        if (n == 0) return IO_EOF;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_WOULD_BLOCK;
+        return IO_ERROR;
+    }
+}
+
+/*
+ * Moves up to want bytes of the response file to the socket inside the
+ * kernel. Returns the number of bytes sent, 0 if the file ended early, or -1
+ * with errno set; EINVAL or ENOSYS mean this file cannot be sent this way.
+ */
+static ssize_t send_file_chunk(struct Connection *connection, size_t want) {
+#if defined(__linux__)
+    off_t offset = connection->file_offset;
+
+    return sendfile(connection->fd, connection->file_fd, &offset, want);
+#elif defined(__APPLE__)
+    off_t length = (off_t)want;
+    int result = sendfile(
+        connection->file_fd,
+        connection->fd,
+        connection->file_offset,
+        &length,
+        NULL,
+        0);
+
+    /* A partial send reports EAGAIN but still moved length bytes. */
+    if (length > 0) return (ssize_t)length;
+    return result < 0 ? -1 : 0;
+#else
+    (void)connection;
+    (void)want;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * Copies the next piece of the response file through the body buffer, for
+ * files and platforms that cannot use sendfile.
+ */
+static enum IoStatus read_file_chunk(struct Connection *connection) {
+    struct ResponseBuffer *out = &connection->output;
+    size_t want = FILE_CHUNK_LEN;
+    ssize_t n;
+
+    if ((off_t)want > connection->file_remaining) {
+        want = (size_t)connection->file_remaining;
+    }
+    buffer_reset(out);
+    if (buffer_reserve(out, want) < 0) return IO_ERROR;
+    do {
+        n = pread(connection->file_fd, out->data, want, connection->file_offset);
+    } while (n < 0 && errno == EINTR);
+    /* A file that shrinks cannot honour the promised Content-Length. */
+    if (n <= 0) return IO_ERROR;
+    out->length = (size_t)n;
+    connection->output_sent = connection->head.length;
+    connection->file_offset += n;
+    connection->file_remaining -= n;
+    return IO_PROGRESS;
+}
+
+/*
+ * Writes the response head, the body buffer, and any cached or shared body,
+ * then the file contents. output_sent counts bytes across the in-memory
+ * parts together, so they go out in one sendmsg and a small response costs
+ * a single segment.
+ */
+static enum IoStatus connection_flush(struct Connection *connection) {
+    struct ResponseBuffer *head = &connection->head;
+    struct ResponseBuffer *out = &connection->output;
+
+    while (1) {
+        const char *segments[4];
+        size_t lengths[4];
+        size_t total = 0;
+
+        segments[0] = head->data;
+        lengths[0] = head->length;
+        segments[1] = out->data;
+        lengths[1] = out->length;
+        segments[2] = connection->cached ? connection->cached->body : NULL;
+        lengths[2] = connection->cached ? connection->cached->body_length : 0;
+        segments[3] = connection->shared_body ? connection->shared_body->data : NULL;
+        lengths[3] = connection->shared_body ? connection->shared_body->length : 0;
+        for (int i = 0; i < 4; i++) total += lengths[i];
+
+        if (connection->output_sent < total) {
+            struct iovec parts[4];
+            struct msghdr message;
+            int flags = 0;
+            size_t skip = connection->output_sent;
+            ssize_t n;
+
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = parts;
+            for (int i = 0; i < 4; i++) {
+                if (skip >= lengths[i]) {
+                    skip -= lengths[i];
+                    continue;
+                }
+                parts[message.msg_iovlen].iov_base = (void *)(segments[i] + skip);
+                parts[message.msg_iovlen].iov_len = lengths[i] - skip;
+                message.msg_iovlen++;
+                skip = 0;
+            }
+            if (connection->file_remaining > 0) flags = SEND_MORE_FLAG;
+            n = sendmsg(connection->fd, &message, flags);
+            if (n > 0) {
+                connection->output_sent += (size_t)n;
+                connection->bytes_sent += (uint64_t)n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return IO_WOULD_BLOCK;
+            }
+            return IO_ERROR;
+        }
+
+        if (connection->file_fd >= 0 && connection->file_remaining > 0) {
+            size_t want = SENDFILE_CHUNK_LEN;
+            ssize_t n;
+
+            if (connection->file_copy) {
+                if (read_file_chunk(connection) != IO_PROGRESS) return IO_ERROR;
+                continue;
+            }
+            if ((off_t)want > connection->file_remaining) {
+                want = (size_t)connection->file_remaining;
+            }
+            n = send_file_chunk(connection, want);
+            if (n > 0) {
+                connection->bytes_sent += (uint64_t)n;
+                connection->file_offset += n;
+                connection->file_remaining -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return IO_WOULD_BLOCK;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS ||
+                          errno == EOPNOTSUPP)) {
+                connection->file_copy = 1;
+                continue;
+            }
+            return IO_ERROR;
+        }
+        if (connection->range_count > 0 && queue_next_range_part(connection)) continue;
+        return IO_DONE;
+    }
+}
+
+/*
+ * Half-closes the socket after the response and discards any remaining input
+ * for a short time, so unread request bytes do not turn the close into a
+ * reset that could destroy the response in flight.
+ */
+static void begin_lingering_close(struct Server *server, struct Connection *connection) {
+    connection_release_body(connection);
+    if (shutdown(connection->fd, SHUT_WR) < 0) {
+        connection_close(server, connection);
+        return;
+    }
+    connection->state = CONNECTION_LINGERING;
+    connection_touch(connection, LINGER_TIMEOUT_SEC);
+}
+
+/*
+ * Prepares a persistent connection for its next request. Input that arrived
+ * behind the finished request stays buffered and is parsed next.
+ */
+static void begin_next_request(struct Server *server, struct Connection *connection) {
+    connection_release_body(connection);
+    http_request_reset(&connection->request);
+    buffer_reset(&connection->head);
+    buffer_reset(&connection->output);
+    connection->output_sent = 0;
+    connection->streaming = 0;
+    connection->request_start_us = 0;
+    connection->dispatch_us = 0;
+    connection->bytes_sent = 0;
+    connection->state = CONNECTION_READING_REQUEST_LINE;
+    connection_touch(connection, server->config->keepalive_timeout);
+}
+
+static void connection_run(struct Server *server, struct Connection *connection) {
+    while (!connection->closed) {
+        enum IoStatus status;
+
+        switch (connection->state) {
+            case CONNECTION_READING_REQUEST_LINE:
+            case CONNECTION_READING_HEADERS:
+            case CONNECTION_READING_BODY:
+                if (advance_request(server, connection)) break;
+                if (connection->peer_closed) {
+                    if (connection->state == CONNECTION_READING_REQUEST_LINE &&
+                        connection->input_length == connection->input_start) {
+                        connection_close(server, connection);
+                    } else {
+                        respond_error(connection, "400 Bad Request", NULL);
+                    }
+                    break;
+                }
+                status = connection_fill(connection);
+                if (status == IO_WOULD_BLOCK) return;
+                if (status == IO_ERROR) {
+                    connection_close(server, connection);
+                } else if (status == IO_EOF) {
+                    connection->peer_closed = 1;
+                } else if (status == IO_FULL) {
+                    respond_error(connection, "400 Bad Request", NULL);
+                } else {
+                    connection_touch(connection, CLIENT_TIMEOUT_SEC);
+                }
+                break;
+
+            case CONNECTION_WAITING_BACKEND:
+                if (!connection->streaming) return;
+                status = connection_flush(connection);
+                if (status == IO_WOULD_BLOCK) return;
+                if (status == IO_ERROR) {
+                    connection_close(server, connection);
+                    break;
+                }
+                /* Everything framed so far is out; start the buffers over. */
+                buffer_reset(&connection->head);
+                buffer_reset(&connection->output);
+                connection->output_sent = 0;
+                connection->stream_framed = 0;
+                return;
+
+            case CONNECTION_WRITING_RESPONSE:
+                status = connection_flush(connection);
+                if (status == IO_WOULD_BLOCK) return;
+                if (status == IO_ERROR) {
+                    connection_close(server, connection);
+                    break;
+                }
+                request_sent(connection);
+                if (connection->keep_alive) {
+                    begin_next_request(server, connection);
+                } else {
+                    begin_lingering_close(server, connection);
+                }
+                break;
+
+            case CONNECTION_LINGERING: {
+                char discard[4096];
+                ssize_t n = recv(connection->fd, discard, sizeof(discard), 0);
+                if (n > 0) break;
+                if (n < 0 && errno == EINTR) break;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+                connection_close(server, connection);
+                break;
+            }
+        }
+    }
+}
+
+static void backend_deliver(
+    struct Server *server,
+    struct Connection *connection,
+    struct BackendReply *reply
+) {
+    const char *status = connection->backend_completion(server, connection, reply);
+
+    /* A completion that submitted a follow-up command returns NULL. */
+    if (!status) return;
+    finish_request(server, connection, status);
+    connection_run(server, connection);
+}
+
+/*
+ * Ends the exchange on backend, returns the socket to the pool when the
+ * reply ended cleanly where it should, and hands the reply to its client.
+ * The socket is released first so that a completion can submit a follow-up
+ * command; the reply stays readable because a reset keeps the buffer.
+ */
+static void backend_finish(
+    struct Server *server,
+    struct BackendConnection *backend,
+    enum BackendResult result
+) {
+    struct Connection *owner = backend->owner;
+    struct BackendReply reply;
+
+    /* backend_reply_line relies on the terminating NUL. */
+    if (buffer_append(&backend->reply, "", 1) == 0) {
+        backend->reply.length--;
+    } else if (result == BACKEND_REPLY_OK) {
+        result = BACKEND_REPLY_CLOSED;
+    }
+    memset(&reply, 0, sizeof(reply));
+    reply.result = result;
+    reply.data = backend->reply.failed ? NULL : backend->reply.data;
+    reply.length = backend->reply.failed ? 0 : backend->reply.length;
+
+    backend->owner = NULL;
+    if (result == BACKEND_REPLY_OK && backend->reply_scanned == backend->reply.length) {
+        backend->state = BACKEND_IDLE;
+        backend->reused = 1;
+        buffer_reset(&backend->reply);
+    } else {
+        backend_reset(backend);
+    }
+    server->backend_pool.pending = 1;
+    if (owner) {
+        owner->backend = NULL;
+        backend_deliver(server, owner, &reply);
+    }
+}
+
+/*
+ * Advances reply_scanned over the complete lines received so far. Returns 1
+ * at the end of the reply: its first line, or for a multi-line reply the
+ * blank line (or an ERROR line in its place).
+ */
+static int backend_reply_complete(struct BackendConnection *backend) {
+    const char *data = backend->reply.data;
+
+    while (backend->reply_scanned < backend->reply.length) {
+        size_t start = backend->reply_scanned;
+        const char *newline = memchr(data + start, '\n', backend->reply.length - start);
+        size_t line_length;
+
+        if (!newline) return 0;
+        line_length = (size_t)(newline - (data + start));
+        backend->reply_scanned = start + line_length + 1;
+        if (!(backend->flags & BACKEND_MULTILINE)) return 1;
+        if (line_length == 0 || (line_length == 1 && data[start] == '\r')) return 1;
+        if (start == 0 && line_length >= 6 && memcmp(data, "ERROR:", 6) == 0) return 1;
+    }
+    return 0;
+}
 
-        if (allowed_methods &&
-            !db_method_is_allowed(allowed_methods, method)) {
-            char allow_header[64];
-            snprintf(
-                allow_header,
-                sizeof(allow_header),
-                "Allow: %s\r\n",
-                allowed_methods);
-            snprintf(resp, sizeof(resp), "405 Method Not Allowed");
-            send_error_page(
-                clntsock,
-                "405 Method Not Allowed",
-                allow_header);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
-        }
+/* Returns 1 once the command is out, 0 if the socket is full, -1 on error. */
+static int backend_send(struct BackendConnection *backend) {
+    const struct ResponseBuffer *command = &backend->owner->backend_command;
 
-        /*
-         * Every non-database path falls through to static-file handling, which
-         * is deliberately GET-only.
-         */
-        if (!allowed_methods && is_post) {
-            snprintf(resp, sizeof(resp), "405 Method Not Allowed");
-            send_error_page(
-                clntsock,
-                "405 Method Not Allowed",
-                "Allow: GET\r\n");
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
+    while (backend->command_sent < command->length) {
+        ssize_t n = send(backend->sock,
+            command->data + backend->command_sent,
+            command->length - backend->command_sent,
+            0);
+
+        if (n > 0) {
+            backend->command_sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
             continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
         }
+    }
+    return 1;
+}
 
-        char post_body[MAX_FORM_BODY_LEN + 1] = {0};
-        if (is_post) {
-            enum PostReadResult post_result = read_post_body(
-                fp,
-                post_body,
-                sizeof(post_body),
-                NULL);
-            if (post_result != POST_READ_OK) {
-                const char *status = post_read_status(post_result);
-                snprintf(resp, sizeof(resp), "%s", status);
-                send_error_page(clntsock, status, NULL);
-                fprintf(stdout, "%s \"%s %s %s\" %s\n",
-                    inet_ntoa(clntaddr.sin_addr),
-                    method,
-                    requestURI,
-                    httpVersion,
-                    resp);
-                fclose(fp);
-                continue;
-            }
-        }
+/* Returns 1 once the reply is complete, 0 to wait for more, -1 on EOF or error. */
+static int backend_receive(struct BackendConnection *backend) {
+    while (1) {
+        struct ResponseBuffer *reply = &backend->reply;
+        ssize_t n;
 
-        if (is_get && strcmp(requestURI, "/mdb-lookup") == 0 && queryString[0] == '\0') {
-            const char *form =
-                "<!DOCTYPE html>\n"
-                "<h1>mdb-lookup</h1>\n"
-                "<p>\n"
-                "<form method=GET action=/mdb-lookup>\n"
-                "lookup: <input type=text name=key>\n"
-                "<input type=submit>\n"
-                "</form>\n"
-                "<p>\n";
-            char header[4096];
-            snprintf(header, sizeof(header),
-                "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n%s", form);
-            snprintf(resp, sizeof(resp), "200 OK");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
+        if (buffer_reserve(reply, 4096) < 0) return -1;
+        n = recv(backend->sock, reply->data + reply->length, reply->capacity - reply->length, 0);
+        if (n > 0) {
+            reply->length += (size_t)n;
+            if (backend_reply_complete(backend)) return 1;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EINTR) {
             continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else {
+            return -1;
         }
-        else if (is_get && strcmp(requestURI, "/mdb-lookup") == 0) {
-            char decoded_key[MAX_FORM_VALUE_LEN];
-            size_t key_len = 0;
-            int key_result = parse_parameter(
-                queryString, "key", decoded_key, sizeof(decoded_key), &key_len);
-
-            if (key_result != 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed key</h1></body></html>\n";
-                snprintf(resp, sizeof(resp), "400 Bad Request");
-                send(clntsock, header, strlen(header), 0);
-                fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                    method, requestURI, httpVersion, resp);
-                fclose(fp);
-                continue;
-            }
+    }
+}
 
-            trim_whitespace(decoded_key, &key_len);
-            if (validate_text_value(
-                    decoded_key, key_len, MAX_SEARCH_KEY_LEN, 0) < 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid key</h1></body></html>\n";
-                snprintf(resp, sizeof(resp), "400 Bad Request");
-                send(clntsock, header, strlen(header), 0);
-                fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                    method, requestURI, httpVersion, resp);
-                fclose(fp);
-                continue;
-            }
+/*
+ * Hands the complete lines received so far to the owner's progress
+ * callback, then drops the lines it consumed so a long reply does not pile
+ * up in the buffer.
+ */
+static void backend_progress(struct Server *server, struct BackendConnection *backend) {
+    struct Connection *owner = backend->owner;
+    struct ResponseBuffer *buffer = &backend->reply;
+    struct BackendReply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.result = BACKEND_REPLY_OK;
+    reply.data = buffer->data;
+    reply.length = backend->reply_scanned;
+    owner->backend_progress(server, owner, &reply);
+
+    memmove(buffer->data, buffer->data + reply.cursor, buffer->length - reply.cursor);
+    buffer->length -= reply.cursor;
+    backend->reply_scanned -= reply.cursor;
+    backend->reply_consumed += reply.cursor;
+    if (owner->streaming) connection_run(server, owner);
+}
 
-            const char *form =
-                "<!DOCTYPE html>\n"
-                "<html><head><title>Database Search</title></head><body>\n"
-                "<h1>mdb-lookup</h1>\n"
-                "<p>\n"
-                "<form method=GET action=/mdb-lookup>\n"
-                "lookup: <input type=text name=key value=\"";
-            char header[8192];
-            char escaped_key[MAX_SEARCH_KEY_LEN * 6 + 1];
-            html_escape(decoded_key, escaped_key, sizeof(escaped_key));
-            snprintf(header, sizeof(header),
-                "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n%s%s\">\n"
-                "<input type=submit>\n"
-                "</form>\n"
-                "<p>\n"
-                "<a href=\"/mdb-list\">List All Records</a> | <a href=\"/mdb-add\">Add New Record</a>\n"
-                "<p>\n"
-                "<table border=\"1\" cellpadding=\"5\" cellspacing=\"0\">\n"
-                "<tr><th>#</th><th>ID</th><th>Name</th><th>Message</th></tr>\n",
-                form,
-                escaped_key);
-            if (send(clntsock, header, strlen(header), 0) < 0) {
-                fclose(fp);
-                continue;
-            }
+/* Drives one pooled connection after an event or a new checkout. */
+static void backend_run(struct Server *server, struct BackendConnection *backend) {
+    int received;
 
-            if (backend_conn.fp == NULL || feof(backend_conn.fp) || ferror(backend_conn.fp)) {
-                fprintf(stderr, "Backend connection lost, reconnecting...\n");
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char error_msg[] = "<tr><td colspan=4>Error: Backend server unavailable</td></tr>\n";
-                    send(clntsock, error_msg, strlen(error_msg), 0);
-                    send(clntsock, "</table>\n", 9, 0);
-                    snprintf(resp, sizeof(resp), "503 Service Unavailable");
-                    fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                        method, requestURI, httpVersion, resp);
-                    fclose(fp);
-                    continue;
-                }
-            }
+    backend->pending = 0;
+    if (backend->state == BACKEND_CLOSED) return;
+    if (backend->state == BACKEND_IDLE) {
+        char byte;
+        ssize_t n = recv(backend->sock, &byte, 1, MSG_PEEK);
 
-            if (fprintf(backend_conn.fp, "SEARCH2 %s\n", decoded_key) < 0 ||
-                fflush(backend_conn.fp) != 0) {
-                fprintf(stderr, "Error writing to backend, reconnecting...\n");
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char error_msg[] = "<tr><td colspan=4>Error: Backend server unavailable</td></tr>\n";
-                    send(clntsock, error_msg, strlen(error_msg), 0);
-                    send(clntsock, "</table>\n", 9, 0);
-                    snprintf(resp, sizeof(resp), "503 Service Unavailable");
-                    fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                        method, requestURI, httpVersion, resp);
-                    fclose(fp);
-                    continue;
-                }
-                fprintf(backend_conn.fp, "SEARCH2 %s\n", decoded_key);
-                fflush(backend_conn.fp);
-            }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+        backend_reset(backend);
+        server->backend_pool.pending = 1;
+        return;
+    }
 
-            clearerr(backend_conn.fp);
-            
-            // Set receive timeout to prevent indefinite blocking
-            struct timeval timeout;
-            timeout.tv_sec = 2;
-            timeout.tv_usec = 0;
-            setsockopt(backend_conn.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-            char line[1024];
-            int row = 1;
-            int found_any = 0;
-            int got_empty_line = 0;
-            int client_write_ok = 1;
-            
-            // Read response from backend
-            while (fgets(line, sizeof(line), backend_conn.fp)) {
-                size_t llen = strlen(line);
-                
-                while (llen > 0 && (line[llen-1] == '\n' || line[llen-1] == '\r')) {
-                    line[--llen] = '\0';
-                }
-                
-                if (llen == 0) {
-                    got_empty_line = 1;
-                    break;
-                }
-                
-                struct BackendRecord record;
-                if (parse_backend_record(line, &record) < 0) {
-                    fprintf(stderr, "Ignoring malformed SEARCH2 response row\n");
-                    continue;
-                }
+    if (backend->state == BACKEND_CONNECTING) {
+        struct sockaddr_storage peer;
+        socklen_t peer_length = sizeof(peer);
+        int error = 0;
+        socklen_t error_length = sizeof(error);
 
-                char escaped_name[MAX_NAME_LEN * 6 + 1];
-                char escaped_message[MAX_MSG_LEN * 6 + 1];
-                html_escape(
-                    record.name,
-                    escaped_name,
-                    sizeof(escaped_name));
-                html_escape(
-                    record.message,
-                    escaped_message,
-                    sizeof(escaped_message));
-
-                char rowbuf[
-                    MAX_NAME_LEN * 6 +
-                    MAX_MSG_LEN * 6 +
-                    256];
-                snprintf(
-                    rowbuf,
-                    sizeof(rowbuf),
-                    "<tr><td>%d</td><td>%" PRIu64 "</td><td>%s</td><td>%s</td></tr>\n",
-                    row++,
-                    record.id,
-                    escaped_name,
-                    escaped_message);
-                if (client_write_ok &&
-                    send(clntsock, rowbuf, strlen(rowbuf), 0) < 0) {
-                    fprintf(stderr, "Error sending to client\n");
-                    client_write_ok = 0;
-                }
-                found_any = 1;
-            }
-            
-            // Reset timeout to default after reading
-            timeout.tv_sec = BACKEND_TIMEOUT_SEC;
-            timeout.tv_usec = 0;
-            setsockopt(backend_conn.sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-            
-            if (ferror(backend_conn.fp)) {
-                fprintf(stderr, "Error reading from backend for search key: %s\n", decoded_key);
-            }
-            
-            if (!found_any) {
-                if (got_empty_line) {
-                    char not_found_msg[] = "<tr><td colspan=\"4\"><strong>ENTRY NOT FOUND</strong></td></tr>\n";
-                    if (client_write_ok) {
-                        send(clntsock, not_found_msg, strlen(not_found_msg), 0);
-                    }
-                    fprintf(stderr, "Search for '%s' returned no matches\n", decoded_key);
-                } else if (feof(backend_conn.fp)) {
-                    char error_msg[] = "<tr><td colspan=\"4\">Error: Database connection closed</td></tr>\n";
-                    if (client_write_ok) {
-                        send(clntsock, error_msg, strlen(error_msg), 0);
-                    }
-                    fprintf(stderr, "Backend connection closed during search for: %s\n", decoded_key);
-                } else {
-                    char error_msg[] = "<tr><td colspan=\"4\">Error: No response from database</td></tr>\n";
-                    if (client_write_ok) {
-                        send(clntsock, error_msg, strlen(error_msg), 0);
-                    }
-                    fprintf(stderr, "No response received for search key: %s\n", decoded_key);
-                }
-            } else {
-                fprintf(stderr, "Search for '%s' returned %d result(s)\n", decoded_key, row - 1);
-            }
-            
-            if (client_write_ok) {
-                const char closing[] = "</table>\n</body></html>\n";
-                send(clntsock, closing, sizeof(closing) - 1, 0);
+        if (getsockopt(backend->sock, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0) {
+            error = errno;
+        }
+        if (error == 0 &&
+            getpeername(backend->sock, (struct sockaddr *)&peer, &peer_length) < 0) {
+            if (errno == ENOTCONN) return;
+            error = errno;
+        }
+        if (error != 0) {
+            close(backend->sock);
+            backend->sock = -1;
+            if (backend->owner &&
+                backend_open(server, backend, backend->address_index + 1) == 0) {
+                return;
             }
-            snprintf(resp, sizeof(resp), "200 OK");
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
+            backend_finish(server, backend, BACKEND_REPLY_UNAVAILABLE);
+            return;
         }
+        backend->state = BACKEND_BUSY;
+        backend->deadline_ms = monotonic_ms() + (uint64_t)BACKEND_TIMEOUT_SEC * 1000;
+    }
 
-        if (is_get && strcmp(requestURI, "/mdb-list") == 0) {
-            if (backend_conn.fp == NULL || feof(backend_conn.fp) || ferror(backend_conn.fp)) {
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char header[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/html\r\n\r\n"
-                                    "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n";
-                    send(clntsock, header, strlen(header), 0);
-                    fclose(fp);
-                    continue;
-                }
-            }
+    if (backend->owner) {
+        int sent = backend_send(backend);
 
-            fprintf(backend_conn.fp, "LIST2\n");
-            fflush(backend_conn.fp);
-
-            char html[8192];
-            snprintf(html, sizeof(html),
-                "<!DOCTYPE html>\n"
-                "<html><head><title>Database Records</title></head><body>\n"
-                "<h1>All Database Records</h1>\n"
-                "<p><a href=\"/mdb-lookup\">Search</a> | <a href=\"/mdb-add\">Add New</a></p>\n"
-                "<table border=\"1\">\n"
-                "<tr><th>ID</th><th>Name</th><th>Message</th><th>Actions</th></tr>\n");
-
-            int client_write_ok =
-                send(clntsock,
-                    "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n",
-                    44,
-                    0) >= 0;
-            if (client_write_ok && send(clntsock, html, strlen(html), 0) < 0) {
-                client_write_ok = 0;
-            }
+        if (sent == 0) return;
+        received = sent < 0 ? -1 : backend_receive(backend);
+    } else {
+        received = backend_receive(backend);
+    }
+    if (received == 0) {
+        if (backend->owner && backend->owner->backend_progress &&
+            backend->reply_scanned > 0) {
+            backend_progress(server, backend);
+        }
+        return;
+    }
+    if (received > 0) {
+        backend_finish(server, backend, BACKEND_REPLY_OK);
+        return;
+    }
 
-            char line[1024];
-            while (fgets(line, sizeof(line), backend_conn.fp)) {
-                if (strcmp(line, "\n") == 0 || strcmp(line, "\r\n") == 0) break;
-                struct BackendRecord record;
-                if (parse_backend_record(line, &record) == 0) {
-                    char escaped_name[MAX_NAME_LEN * 6 + 1];
-                    char escaped_msg[MAX_MSG_LEN * 6 + 1];
-                    html_escape(
-                        record.name,
-                        escaped_name,
-                        sizeof(escaped_name));
-                    html_escape(
-                        record.message,
-                        escaped_msg,
-                        sizeof(escaped_msg));
-                    
-                    char row[
-                        MAX_NAME_LEN * 6 +
-                        MAX_MSG_LEN * 6 +
-                        512];
-                    snprintf(row, sizeof(row),
-                        "<tr><td>%" PRIu64 "</td><td>%s</td><td>%s</td>"
-                        "<td><a href=\"/mdb-edit?id=%" PRIu64 "\">Edit</a> | "
-                        "<form method=POST action=/mdb-delete style=display:inline>"
-                        "<input type=hidden name=id value=%" PRIu64 ">"
-                        "<input type=submit value=Delete onclick=\"return confirm('Delete this record?')\">"
-                        "</form></td></tr>\n",
-                        record.id,
-                        escaped_name,
-                        escaped_msg,
-                        record.id,
-                        record.id);
-                    if (client_write_ok &&
-                        send(clntsock, row, strlen(row), 0) < 0) {
-                        client_write_ok = 0;
-                    }
-                }
-            }
-            if (client_write_ok) {
-                const char closing[] = "</table></body></html>\n";
-                send(clntsock, closing, sizeof(closing) - 1, 0);
+    /* A reused socket may have been closed by the backend while idle. */
+    if (backend->owner && backend->reused && backend->reply.length == 0 &&
+        backend->reply_consumed == 0 && (backend->flags & BACKEND_IDEMPOTENT)) {
+        close(backend->sock);
+        backend->sock = -1;
+        backend->reused = 0;
+        backend->command_sent = 0;
+        worker_metrics->backend_retries++;
+        if (backend_open(server, backend, 0) == 0) return;
+    }
+    backend_finish(server, backend, BACKEND_REPLY_CLOSED);
+}
+
+/*
+ * Gives free connections to queued requests, then runs every connection
+ * that was handed an exchange since the pool last ran. Repeats while that
+ * frees or hands out more.
+ */
+static void backend_pool_run_pending(struct Server *server) {
+    struct BackendPool *pool = &server->backend_pool;
+
+    while (pool->pending) {
+        pool->pending = 0;
+        while (pool->waiting_head) {
+            struct Connection *connection = pool->waiting_head;
+            int failed;
+            struct BackendConnection *backend = backend_checkout(server, &failed);
+
+            if (!backend && !failed) break;
+            pool->waiting_head = connection->backend_next;
+            if (!pool->waiting_head) pool->waiting_tail = NULL;
+            pool->waiting_count--;
+            connection->backend_waiting = 0;
+            if (backend) {
+                backend_start(server, backend, connection);
+            } else {
+                struct BackendReply reply;
+
+                memset(&reply, 0, sizeof(reply));
+                reply.result = BACKEND_REPLY_UNAVAILABLE;
+                backend_deliver(server, connection, &reply);
             }
-            snprintf(resp, sizeof(resp), "200 OK");
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
         }
-
-        if (is_get && strcmp(requestURI, "/mdb-add") == 0) {
-            const char *form =
-                "<!DOCTYPE html>\n"
-                "<html><head><title>Add Record</title></head><body>\n"
-                "<h1>Add New Record</h1>\n"
-                "<p><a href=\"/mdb-lookup\">Search</a> | <a href=\"/mdb-list\">List All</a></p>\n"
-                "<form method=POST action=/mdb-add>\n"
-                "Name (max 15 chars): <input type=text name=name maxlength=15 required><br><br>\n"
-                "Message (max 23 chars): <input type=text name=msg maxlength=23 required><br><br>\n"
-                "<input type=submit value=Add>\n"
-                "</form>\n"
-                "</body></html>\n";
-            char header[4096];
-            snprintf(header, sizeof(header),
-                "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n%s", form);
-            snprintf(resp, sizeof(resp), "200 OK");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
+        for (int i = 0; i < pool->size; i++) {
+            if (pool->connections[i].pending) backend_run(server, &pool->connections[i]);
         }
+    }
+}
 
-        if (is_post && strcmp(requestURI, "/mdb-add") == 0) {
-            char name[MAX_FORM_VALUE_LEN], msg[MAX_FORM_VALUE_LEN];
-            size_t name_len = 0, msg_len = 0;
-            if (parse_parameter(
-                    post_body, "name", name, sizeof(name), &name_len) != 0 ||
-                parse_parameter(
-                    post_body, "msg", msg, sizeof(msg), &msg_len) != 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed fields</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+/* Fails exchanges and queued requests that have waited too long. */
+static void backend_pool_expire(struct Server *server) {
+    struct BackendPool *pool = &server->backend_pool;
+    uint64_t now = monotonic_ms();
 
-            if (validate_text_value(name, name_len, MAX_NAME_LEN, 1) < 0 ||
-                validate_text_value(msg, msg_len, MAX_MSG_LEN, 1) < 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid fields</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+    for (int i = 0; i < pool->size; i++) {
+        struct BackendConnection *backend = &pool->connections[i];
 
-            if (backend_conn.fp == NULL || feof(backend_conn.fp) || ferror(backend_conn.fp)) {
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char header[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/html\r\n\r\n"
-                                    "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n";
-                    send(clntsock, header, strlen(header), 0);
-                    fclose(fp);
-                    continue;
-                }
-            }
+        if ((backend->state == BACKEND_CONNECTING || backend->state == BACKEND_BUSY) &&
+            backend->deadline_ms <= now) {
+            access_log_printf("Backend request timed out\n");
+            backend_finish(server, backend, BACKEND_REPLY_TIMEOUT);
+        }
+    }
+    while (pool->waiting_head && pool->waiting_head->deadline_ms <= now) {
+        struct Connection *connection = pool->waiting_head;
+        struct BackendReply reply;
+
+        pool->waiting_head = connection->backend_next;
+        if (!pool->waiting_head) pool->waiting_tail = NULL;
+        pool->waiting_count--;
+        connection->backend_waiting = 0;
+        memset(&reply, 0, sizeof(reply));
+        reply.result = BACKEND_REPLY_UNAVAILABLE;
+        backend_deliver(server, connection, &reply);
+    }
+    backend_pool_run_pending(server);
+}
 
-            fprintf(backend_conn.fp, "ADD %s|%s\n", name, msg);
-            fflush(backend_conn.fp);
+static int backend_pool_owns(const struct BackendPool *pool, const void *data) {
+    uintptr_t address = (uintptr_t)data;
 
-            char response[256] = {0};
-            if (fgets(response, sizeof(response), backend_conn.fp) && strncmp(response, "OK", 2) == 0) {
-                clearerr(backend_conn.fp);
+    return address >= (uintptr_t)&pool->connections[0] &&
+           address < (uintptr_t)&pool->connections[MAX_BACKEND_CONNECTIONS];
+}
 
-                char header[] = "HTTP/1.0 302 Found\r\nLocation: /mdb-list\r\n\r\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "302 Found");
+static void expire_connections(struct Server *server) {
+    uint64_t now = monotonic_ms();
+    struct Connection *connection = server->connections;
+
+    while (connection) {
+        struct Connection *next = connection->next;
+
+        /* The backend pool enforces its own timeouts on parked requests. */
+        if (connection->deadline_ms <= now &&
+            connection->state != CONNECTION_WAITING_BACKEND) {
+            int idle = connection->state == CONNECTION_READING_REQUEST_LINE &&
+                       connection->input_length == connection->input_start;
+            int reading = connection->state == CONNECTION_READING_REQUEST_LINE ||
+                          connection->state == CONNECTION_READING_HEADERS ||
+                          connection->state == CONNECTION_READING_BODY;
+
+            if (reading && !idle) {
+                respond_error(connection, "408 Request Timeout", NULL);
+                connection_run(server, connection);
             } else {
-                char header[] = "HTTP/1.0 500 Internal Server Error\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>500 Error: Failed to add record</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "500 Internal Server Error");
+                connection_close(server, connection);
             }
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
+        }
+        connection = next;
+    }
+}
+
+static void accept_connections(struct Server *server) {
+    server->accept_pending = 0;
+
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t address_length = sizeof(address);
+        struct Connection *connection;
+        int fd = accept(
+            server->listen_fd,
+            (struct sockaddr *)&address,
+            &address_length);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            /*
+             * Descriptor or memory exhaustion leaves connections queued; the
+             * edge will not repeat, so retry on the next loop iteration.
+             */
+            server->accept_pending = 1;
+            access_log_printf("accept failed, continuing\n");
+            return;
+        }
+
+        connection = (struct Connection *)calloc(1, sizeof(*connection));
+        if (!connection || set_nonblocking(fd) < 0) {
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->file_fd = -1;
+        connection->address = address;
+        connection->state = CONNECTION_READING_REQUEST_LINE;
+        connection->requests_left = server->config->keepalive_requests;
+        http_request_reset(&connection->request);
+        connection_touch(connection, CLIENT_TIMEOUT_SEC);
+
+        if (event_queue_add(server->event_fd, fd, connection, 1) < 0) {
+            close(fd);
+            free(connection);
             continue;
         }
 
-        if (is_get && strcmp(requestURI, "/mdb-edit") == 0) {
-            char id_text[64];
-            size_t id_len = 0;
-            uint64_t edit_id;
-            if (parse_parameter(
-                    queryString, "id", id_text, sizeof(id_text), &id_len) != 0 ||
-                parse_positive_u64(id_text, &edit_id) < 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid ID</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+        connection->next = server->connections;
+        if (server->connections) server->connections->previous = connection;
+        server->connections = connection;
+        server->connection_count++;
 
-            if (backend_conn.fp == NULL || feof(backend_conn.fp) || ferror(backend_conn.fp)) {
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char header[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/html\r\n\r\n"
-                                    "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n";
-                    send(clntsock, header, strlen(header), 0);
-                    fclose(fp);
-                    continue;
-                }
-            }
+        /*
+         * Past the limit the client still gets an answer rather than a
+         * dropped connection; the usual lingering close then reads off
+         * its request.
+         */
+        if (server->config->max_connections > 0 &&
+            server->connection_count > server->config->max_connections) {
+            worker_metrics->shed_connections++;
+            respond_error(connection, "503 Service Unavailable", RETRY_AFTER_HEADER);
+        }
+        connection_run(server, connection);
+    }
+}
 
-            fprintf(backend_conn.fp, "LIST2\n");
-            fflush(backend_conn.fp);
-
-            char line[1024];
-            char name[16] = "", msg[24] = "";
-            int found = 0;
-            while (fgets(line, sizeof(line), backend_conn.fp)) {
-                if (strcmp(line, "\n") == 0 || strcmp(line, "\r\n") == 0) break;
-                struct BackendRecord record;
-                if (parse_backend_record(line, &record) == 0 &&
-                    record.id == edit_id) {
-                    memcpy(name, record.name, strlen(record.name) + 1);
-                    memcpy(msg, record.message, strlen(record.message) + 1);
-                    found = 1;
-                }
-            }
+static int open_listener(const struct ServerConfig *config) {
+    int listen_fd;
+    int opt = 1;
 
-            if (!found) {
-                char header[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>404 Not Found</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+    if((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        die("socket failed");
+    }
+    
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        die("setsockopt failed");
+    }
+    /*
+     * Each worker binds its own listener to the shared port so the kernel
+     * spreads incoming connections across them.
+     */
+    if (config->workers > 0 &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        die("setsockopt SO_REUSEPORT failed");
+    }
+    
+    struct sockaddr_in servAddr;
+    memset(&servAddr, 0, sizeof(servAddr));
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servAddr.sin_port = htons(config->port);
+    if(bind(listen_fd, (struct sockaddr *) &servAddr, sizeof(servAddr)) < 0) {
+        die("bind failed");
+    }
+    if(listen(listen_fd, config->listen_backlog) < 0) {
+        die("listen failed, too many requests");
+    }
+    if (set_nonblocking(listen_fd) < 0) {
+        die("fcntl failed");
+    }
+    return listen_fd;
+}
 
-            char escaped_name[MAX_NAME_LEN * 6 + 1];
-            char escaped_msg[MAX_MSG_LEN * 6 + 1];
-            html_escape(name, escaped_name, sizeof(escaped_name));
-            html_escape(msg, escaped_msg, sizeof(escaped_msg));
-
-            char form[2048];
-            snprintf(form, sizeof(form),
-                "<!DOCTYPE html>\n"
-                "<html><head><title>Edit Record</title></head><body>\n"
-                "<h1>Edit Record #%" PRIu64 "</h1>\n"
-                "<p><a href=\"/mdb-list\">Back to List</a></p>\n"
-                "<form method=POST action=/mdb-update>\n"
-                "<input type=hidden name=id value=%" PRIu64 ">\n"
-                "Name (max 15 chars): <input type=text name=name value=\"%s\" maxlength=15 required><br><br>\n"
-                "Message (max 23 chars): <input type=text name=msg value=\"%s\" maxlength=23 required><br><br>\n"
-                "<input type=submit value=Update>\n"
-                "</form>\n"
-                "</body></html>\n",
-                edit_id, edit_id, escaped_name, escaped_msg);
-            char header[4096];
-            snprintf(header, sizeof(header),
-                "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n%s", form);
-            snprintf(resp, sizeof(resp), "200 OK");
-            send(clntsock, header, strlen(header), 0);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
-        }
+/*
+ * Sets up one serving process and runs its event loop forever. Setup errors
+ * exit the process; ready_fd, when valid, receives one byte once the worker
+ * is accepting connections.
+ */
+static void run_server(const struct ServerConfig *config, int ready_fd) {
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.config = config;
+    server.web_root_fd = open(
+        config->web_root,
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (server.web_root_fd < 0) {
+        die("open web root failed");
+    }
 
-        if (is_post && strcmp(requestURI, "/mdb-update") == 0) {
-            char id_str[64], name[MAX_FORM_VALUE_LEN], msg[MAX_FORM_VALUE_LEN];
-            size_t id_len = 0, name_len = 0, msg_len = 0;
-            if (parse_parameter(
-                    post_body, "id", id_str, sizeof(id_str), &id_len) != 0 ||
-                parse_parameter(
-                    post_body, "name", name, sizeof(name), &name_len) != 0 ||
-                parse_parameter(
-                    post_body, "msg", msg, sizeof(msg), &msg_len) != 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed fields</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+    server.event_fd = event_queue_create();
+    if (server.event_fd < 0) {
+        die("event queue failed");
+    }
 
-            uint64_t id;
-            if (parse_positive_u64(id_str, &id) < 0 ||
-                validate_text_value(name, name_len, MAX_NAME_LEN, 1) < 0 ||
-                validate_text_value(msg, msg_len, MAX_MSG_LEN, 1) < 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid data</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+    server.backend_pool.host = config->backend_host;
+    server.backend_pool.port = config->backend_port;
+    server.backend_pool.size = config->backend_connections;
+    for (int i = 0; i < MAX_BACKEND_CONNECTIONS; i++) {
+        server.backend_pool.connections[i].sock = -1;
+    }
+    if (backend_pool_resolve(&server.backend_pool) < 0 ||
+        backend_pool_connect_first(&server.backend_pool, server.event_fd) < 0) {
+        die("connect to backend failed");
+    }
 
-            if (backend_conn.fp == NULL || feof(backend_conn.fp) || ferror(backend_conn.fp)) {
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char header[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/html\r\n\r\n"
-                                    "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n";
-                    send(clntsock, header, strlen(header), 0);
-                    fclose(fp);
-                    continue;
-                }
-            }
+    server.listen_fd = open_listener(config);
+    if (event_queue_add(server.event_fd, server.listen_fd, &server, 0) < 0) {
+        die("event registration failed");
+    }
+    static_cache_init(&server.static_cache, config->web_root);
+    if (server.static_cache.enabled &&
+        event_queue_add(
+            server.event_fd,
+            server.static_cache.notify_fd,
+            &server.static_cache,
+            0) < 0) {
+        die("event registration failed");
+    }
+
+    access_log_start(config->log_block, config->log_sample);
+    if (ready_fd >= 0) {
+        char ready_byte = 1;
+        if (write(ready_fd, &ready_byte, 1) != 1) die("ready notification failed");
+        close(ready_fd);
+    }
 
-            fprintf(
-                backend_conn.fp,
-                "UPDATE %" PRIu64 "|%s|%s\n",
-                id,
-                name,
-                msg);
-            fflush(backend_conn.fp);
-
-            char response[256] = {0};
-            if (fgets(response, sizeof(response), backend_conn.fp) && strncmp(response, "OK", 2) == 0) {
-                clearerr(backend_conn.fp);
-
-                char header[] = "HTTP/1.0 302 Found\r\nLocation: /mdb-list\r\n\r\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "302 Found");
-            } else if (strstr(response, "Record not found") != NULL) {
-                char header[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>404 Not Found: Record not found</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "404 Not Found");
+    uint64_t next_sweep = monotonic_ms() + 1000;
+    while(1) {
+        void *ready[MAX_EVENTS];
+        int count = event_queue_wait(server.event_fd, ready, MAX_EVENTS, 1000);
+
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            die("event wait failed");
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (ready[i] == &server.static_cache) {
+                static_cache_drain_events(&server.static_cache);
+            } else if (ready[i] == &server) {
+                accept_connections(&server);
+            } else if (backend_pool_owns(&server.backend_pool, ready[i])) {
+                backend_run(&server, (struct BackendConnection *)ready[i]);
             } else {
-                char header[] = "HTTP/1.0 500 Internal Server Error\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>500 Internal Server Error: Update was not persisted</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "500 Internal Server Error");
+                struct Connection *connection = (struct Connection *)ready[i];
+                if (!connection->closed) connection_run(&server, connection);
             }
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
         }
 
-        if (is_post && strcmp(requestURI, "/mdb-delete") == 0) {
-            char id_str[64];
-            size_t id_len = 0;
-            if (parse_parameter(
-                    post_body, "id", id_str, sizeof(id_str), &id_len) != 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Missing or malformed ID</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+        backend_pool_run_pending(&server);
+        if (monotonic_ms() >= next_sweep) {
+            backend_pool_expire(&server);
+            expire_connections(&server);
+            next_sweep = monotonic_ms() + 1000;
+        }
+        if (server.accept_pending) accept_connections(&server);
+        backend_pool_run_pending(&server);
+        free_closed_connections(&server);
+    }
+}
 
-            uint64_t id;
-            if (parse_positive_u64(id_str, &id) < 0) {
-                char header[] = "HTTP/1.0 400 Bad Request\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>400 Bad Request: Invalid ID</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                fclose(fp);
-                continue;
-            }
+static volatile sig_atomic_t supervisor_stop_requested = 0;
 
-            if (backend_conn.fp == NULL || feof(backend_conn.fp) || ferror(backend_conn.fp)) {
-                if (reconnect_backend(&backend_conn) < 0) {
-                    char header[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/html\r\n\r\n"
-                                    "<!DOCTYPE html><html><body><h1>503 Service Unavailable</h1></body></html>\n";
-                    send(clntsock, header, strlen(header), 0);
-                    fclose(fp);
-                    continue;
-                }
-            }
+static void request_supervisor_stop(int signal_number) {
+    (void)signal_number;
+    supervisor_stop_requested = 1;
+}
 
-            fprintf(backend_conn.fp, "DELETE %" PRIu64 "\n", id);
-            fflush(backend_conn.fp);
-
-            char response[256] = {0};
-            if (fgets(response, sizeof(response), backend_conn.fp) && strncmp(response, "OK", 2) == 0) {
-                clearerr(backend_conn.fp);
-
-                char header[] = "HTTP/1.0 302 Found\r\nLocation: /mdb-list\r\n\r\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "302 Found");
-            } else if (strstr(response, "Record not found") != NULL) {
-                char header[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>404 Not Found: Record not found</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "404 Not Found");
-            } else {
-                char header[] = "HTTP/1.0 500 Internal Server Error\r\nContent-Type: text/html\r\n\r\n"
-                                "<!DOCTYPE html><html><body><h1>500 Internal Server Error: Delete was not persisted</h1></body></html>\n";
-                send(clntsock, header, strlen(header), 0);
-                snprintf(resp, sizeof(resp), "500 Internal Server Error");
+static pid_t spawn_worker(
+    const struct ServerConfig *config,
+    int slot,
+    int ready_fd,
+    int ready_read_fd
+) {
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+
+    if (pid != 0) return pid;
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+#if defined(__linux__)
+    /* Never outlive the supervisor, even if it is killed outright. */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor) _exit(1);
+#else
+    (void)supervisor;
+#endif
+    if (ready_read_fd >= 0) close(ready_read_fd);
+    worker_metrics = &metrics_slots[slot];
+    run_server(config, ready_fd);
+    _exit(1);
+}
+
+static void stop_workers(pid_t *workers, int count) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+    for (int i = 0; i < count; i++) {
+        if (workers[i] > 0) {
+            while (waitpid(workers[i], NULL, 0) < 0 && errno == EINTR) {
             }
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
+            workers[i] = 0;
         }
+    }
+}
 
-        int static_fd = -1;
-        struct stat st;
-        int serves_index = 0;
-        enum StaticFileResult static_result = open_static_file(
-            web_root_fd,
-            requestURI,
-            &static_fd,
-            &st,
-            &serves_index);
-
-        if (static_result != STATIC_FILE_OK) {
-            const char *status;
-            if (static_result == STATIC_FILE_NOT_FOUND) {
-                status = "404 Not Found";
-            } else if (static_result == STATIC_FILE_FORBIDDEN) {
-                status = "403 Forbidden";
-            } else if (static_result == STATIC_FILE_PATH_TOO_LONG) {
-                status = "414 URI Too Long";
-            } else {
-                status = "500 Internal Server Error";
-            }
-            snprintf(resp, sizeof(resp), "%s", status);
-            send_error_page(clntsock, status, NULL);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
+/*
+ * Starts config->workers serving processes and replaces any that exit. The
+ * first generation must all come up, which catches configuration errors
+ * such as an unusable port before the supervisor reports success.
+ */
+static int supervise_workers(const struct ServerConfig *config) {
+    pid_t *workers = (pid_t *)calloc((size_t)config->workers, sizeof(pid_t));
+    uint64_t *started_ms = (uint64_t *)calloc((size_t)config->workers, sizeof(uint64_t));
+    struct sigaction action;
+    int ready_pipe[2];
+    int ready_count = 0;
+
+    if (!workers || !started_ms) die("calloc failed");
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_supervisor_stop;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGTERM, &action, NULL) < 0 ||
+        sigaction(SIGINT, &action, NULL) < 0) {
+        die("sigaction failed");
+    }
+
+    if (pipe(ready_pipe) < 0) die("pipe failed");
+    for (int i = 0; i < config->workers; i++) {
+        workers[i] = spawn_worker(config, i, ready_pipe[1], ready_pipe[0]);
+        if (workers[i] < 0) {
+            perror("fork failed");
+            workers[i] = 0;
+            break;
+        }
+        started_ms[i] = monotonic_ms();
+    }
+    close(ready_pipe[1]);
+
+    /* EOF arrives early if any worker exits before it is ready. */
+    while (ready_count < config->workers && !supervisor_stop_requested) {
+        char ready_byte;
+        ssize_t n = read(ready_pipe[0], &ready_byte, 1);
+        if (n == 1) {
+            ready_count++;
+        } else if (n < 0 && errno == EINTR) {
             continue;
+        } else {
+            break;
         }
+    }
+    close(ready_pipe[0]);
 
-        if (st.st_size < 0 || st.st_size > 100 * 1024 * 1024) {
-            close(static_fd);
-            snprintf(resp, sizeof(resp), "413 Payload Too Large");
-            send_error_page(clntsock, "413 Payload Too Large", NULL);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
+    if (ready_count < config->workers) {
+        if (!supervisor_stop_requested) {
+            fprintf(stderr, "Error: worker startup failed\n");
         }
+        stop_workers(workers, config->workers);
+        return supervisor_stop_requested ? 0 : 1;
+    }
+    fprintf(stderr, "Started %d workers on port %u\n",
+        config->workers, (unsigned int)config->port);
 
-        FILE *file = fdopen(static_fd, "rb");
-        if (!file) {
-            close(static_fd);
-            snprintf(resp, sizeof(resp), "500 Internal Server Error");
-            send_error_page(clntsock, "500 Internal Server Error", NULL);
-            fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-                method, requestURI, httpVersion, resp);
-            fclose(fp);
-            continue;
+    while (!supervisor_stop_requested) {
+        int status;
+        int slot = -1;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < config->workers; i++) {
+            if (workers[i] == pid) slot = i;
+        }
+        if (slot < 0) continue;
+
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Worker %ld killed by signal %d, restarting\n",
+                (long)pid, WTERMSIG(status));
+        } else {
+            fprintf(stderr, "Worker %ld exited with status %d, restarting\n",
+                (long)pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+        workers[slot] = 0;
+
+        /* Back off when a worker dies right after starting. */
+        if (monotonic_ms() - started_ms[slot] < 1000) sleep(1);
+        if (supervisor_stop_requested) break;
+
+        workers[slot] = spawn_worker(config, slot, -1, -1);
+        if (workers[slot] < 0) {
+            perror("fork failed");
+            workers[slot] = 0;
         }
+        started_ms[slot] = monotonic_ms();
+    }
+
+    stop_workers(workers, config->workers);
+    free(workers);
+    free(started_ms);
+    return 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "usage: %s [--workers N] [--keepalive-timeout SECONDS] "
+        "[--keepalive-requests N] [--backend-connections N] [--gzip LEVEL] "
+        "[--log-overflow drop|block] [--log-sample N] "
+        "[--listen-backlog N] [--max-connections N] [--max-backend-queue N] "
+        "[--queue-budget-ms MS] "
+        "[--cache-control EXT=VALUE]... "
+        "<server_port> <web_root> "
+        "<mdb-lookup-host> <mdb-lookup-port>\n",
+        program);
+    exit(1);
+}
 
-        const char *ctype = static_content_type(requestURI, serves_index);
-        char header[4096];
-        snprintf(header, sizeof(header),
-            "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
-            ctype, (size_t)st.st_size);
-        int client_write_ok =
-            send(clntsock, header, strlen(header), 0) >= 0;
-        size_t n;
-        char file_buffer[MAX_REQUEST_LEN];
-        while (client_write_ok &&
-               (n = fread(file_buffer, 1, sizeof(file_buffer), file)) > 0) {
-            if (send(clntsock, file_buffer, n, 0) < 0) {
-                client_write_ok = 0;
+int main(int argc, char **argv) {
+    struct ServerConfig config;
+    int arg = 1;
+
+    memset(&config, 0, sizeof(config));
+    config.keepalive_timeout = KEEPALIVE_TIMEOUT_SEC;
+    config.keepalive_requests = KEEPALIVE_MAX_REQUESTS;
+    config.backend_connections = BACKEND_POOL_SIZE;
+    config.log_sample = 1;
+    config.listen_backlog = LISTEN_BACKLOG;
+    config.max_backend_queue = MAX_BACKEND_QUEUE;
+    config.queue_budget_ms = QUEUE_BUDGET_MS;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        uint64_t value;
+
+        if (arg + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[arg], "--workers") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 ||
+                value > MAX_WORKERS) {
+                fprintf(stderr, "Error: --workers must be between 1 and %d\n", MAX_WORKERS);
+                exit(1);
+            }
+            config.workers = (int)value;
+        } else if (strcmp(argv[arg], "--keepalive-timeout") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > 3600) {
+                fprintf(stderr, "Error: --keepalive-timeout must be between 1 and 3600\n");
+                exit(1);
+            }
+            config.keepalive_timeout = (int)value;
+        } else if (strcmp(argv[arg], "--keepalive-requests") == 0) {
+            /* A limit of 1 closes every connection after its first response. */
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > UINT_MAX) {
+                fprintf(stderr, "Error: --keepalive-requests must be a positive integer\n");
+                exit(1);
+            }
+            config.keepalive_requests = (unsigned int)value;
+        } else if (strcmp(argv[arg], "--backend-connections") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 ||
+                value > MAX_BACKEND_CONNECTIONS) {
+                fprintf(stderr, "Error: --backend-connections must be between 1 and %d\n",
+                    MAX_BACKEND_CONNECTIONS);
+                exit(1);
+            }
+            config.backend_connections = (int)value;
+        } else if (strcmp(argv[arg], "--gzip") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > 9) {
+                fprintf(stderr, "Error: --gzip must be a compression level between 1 and 9\n");
+                exit(1);
+            }
+            config.gzip_level = (int)value;
+        } else if (strcmp(argv[arg], "--listen-backlog") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > INT_MAX) {
+                fprintf(stderr, "Error: --listen-backlog must be a positive integer\n");
+                exit(1);
+            }
+            config.listen_backlog = (int)value;
+        } else if (strcmp(argv[arg], "--max-connections") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > INT_MAX) {
+                fprintf(stderr, "Error: --max-connections must be a positive integer\n");
+                exit(1);
+            }
+            config.max_connections = (int)value;
+        } else if (strcmp(argv[arg], "--max-backend-queue") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > INT_MAX) {
+                fprintf(stderr, "Error: --max-backend-queue must be a positive integer\n");
+                exit(1);
             }
+            config.max_backend_queue = (int)value;
+        } else if (strcmp(argv[arg], "--queue-budget-ms") == 0) {
+            /* 0 turns the latency budget off; the queue length still applies. */
+            if (strcmp(argv[arg + 1], "0") == 0) {
+                value = 0;
+            } else if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > INT_MAX) {
+                fprintf(stderr, "Error: --queue-budget-ms must be a non-negative integer\n");
+                exit(1);
+            }
+            config.queue_budget_ms = (int)value;
+        } else if (strcmp(argv[arg], "--log-overflow") == 0) {
+            if (strcmp(argv[arg + 1], "drop") == 0) {
+                config.log_block = 0;
+            } else if (strcmp(argv[arg + 1], "block") == 0) {
+                config.log_block = 1;
+            } else {
+                fprintf(stderr, "Error: --log-overflow must be drop or block\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[arg], "--log-sample") == 0) {
+            if (parse_positive_u64(argv[arg + 1], &value) < 0 || value > UINT_MAX) {
+                fprintf(stderr, "Error: --log-sample must be a positive integer\n");
+                exit(1);
+            }
+            config.log_sample = (unsigned int)value;
+        } else if (strcmp(argv[arg], "--cache-control") == 0) {
+            if (set_static_cache_control(argv[arg + 1]) < 0) {
+                fprintf(stderr, "Error: --cache-control expects EXT=VALUE for a known extension or default\n");
+                exit(1);
+            }
+        } else {
+            usage(argv[0]);
         }
-        fclose(file);
-        snprintf(resp, sizeof(resp), "200 OK");
-        fprintf(stdout, "%s \"%s %s %s\" %s\n", inet_ntoa(clntaddr.sin_addr),
-            method, requestURI, httpVersion, resp);
-        fclose(fp);
-        continue;
+        arg += 2;
+    }
+    if(argc - arg != 4) {
+        usage(argv[0]);
+    }
+    
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        die("signal failed");
+    }
+
+    if (parse_port(argv[arg], &config.port) < 0) {
+        fprintf(stderr, "Error: Invalid server port\n");
+        exit(1);
+    }
+    
+    config.web_root = argv[arg + 1];
+    if (strlen(config.web_root) == 0 || strlen(config.web_root) > MAX_PATH_LEN) {
+        fprintf(stderr, "Error: Invalid web root path\n");
+        exit(1);
+    }
+
+    config.backend_host = argv[arg + 2];
+    if (parse_port(argv[arg + 3], &config.backend_port) < 0) {
+        fprintf(stderr, "Error: Invalid backend port\n");
+        exit(1);
     }
-    close(servsock);
-    close_backend(&backend_conn);
-    close(web_root_fd);
+
+    metrics_init(config.workers > 0 ? config.workers : 1);
+    if (config.workers > 0) return supervise_workers(&config);
+    run_server(&config, -1);
     return 0;
 }
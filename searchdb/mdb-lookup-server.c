@@ -3,39 +3,111 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mdb.h"
-#include "mylist.h"
 
 #define KEY_MAX 1000
 #define MAX_LINE_LEN 4096
 #define MAX_RESPONSE_LEN 1200
 #define MAX_NAME_LEN 15
 #define MAX_MSG_LEN 23
+#define MAX_CLIENTS 256
+#define CLIENT_SEND_TIMEOUT_SEC 10
+#define LOG_SLOTS 1024
+#define LOG_LINE_MAX 256
+#define LOG_DRAIN_MS 5
+#define RECORD_CHUNK_SLOTS 1024
 
 #define LEGACY_RECORD_SIZE 40U
 #define MDB2_HEADER_SIZE 28U
 #define MDB2_RECORD_SIZE 48U
 #define MDB2_VERSION 1U
+#define MUTATION_LOG_SUFFIX ".wal"
+#define MUTATION_LOG_HEADER_SIZE 16U
+#define MUTATION_LOG_ENTRY_SIZE 56U
+#define MUTATION_LOG_VERSION 1U
+#define COMPACT_BYTES_DEFAULT (4U * 1024 * 1024)
+#define GROUP_COMMIT_MAX 256
+#define GROUP_COMMIT_WINDOW_US 1000
+#define GROUP_COMMIT_WINDOW_MAX_US 1000000
 
 static const unsigned char MDB2_MAGIC[8] = {
     'M', 'D', 'B', '2', '\r', '\n', 0x1a, '\n'
 };
 
+static const unsigned char MUTATION_LOG_MAGIC[8] = {
+    'M', 'D', 'B', 'L', '\r', '\n', 0x1a, '\n'
+};
+
+/*
+ * generation changes with every published mutation. It starts from the
+ * load time in microseconds, so a restarted server never repeats a value
+ * that clients saw from an earlier run.
+ *
+ * Records sit in slots sorted by id, RECORD_CHUNK_SLOTS slots to a chunk,
+ * so scans walk memory in order and a lookup by id for RANGE2 is a binary
+ * search. New ids are the largest yet, so ADD appends. DELETE only sets the
+ * slot's deleted byte and leaves its id in place, which keeps the slots
+ * sorted and every other record where it was; clone_database drops the
+ * tombstones once they outnumber live records.
+ *
+ * Chunks are shared between a published database and the candidate cloned
+ * from it. refs counts the databases holding a chunk, and a mutation copies
+ * a chunk before writing to it only while it is shared, so a clone costs
+ * one pointer per chunk and a mutation copies the chunk it touches.
+ *
+ * id_table is an open-addressing hash from id to slot, at most half full,
+ * and shared the same way. Ids are never 0 and never reused, so an id of 0
+ * marks an empty entry and a deleted record's entry can simply stay behind,
+ * pointing at its tombstone, until the next compaction rebuilds the table.
+ * ADD inserts into the shared table in place: an entry past the slot_count
+ * of an older database is invisible to it, because find_slot checks both
+ * the slot and the id stored there.
+ */
+struct RecordChunk {
+    size_t refs;
+    struct MdbRec records[RECORD_CHUNK_SLOTS];
+    unsigned char deleted[RECORD_CHUNK_SLOTS];
+};
+
+struct IdSlot {
+    uint64_t id;
+    size_t slot;
+};
+
+struct IdTable {
+    size_t refs;
+    size_t capacity;
+    struct IdSlot entries[];
+};
+
 struct Database {
-    struct List records;
+    struct RecordChunk **chunks;
+    size_t chunk_count;
+    size_t chunk_capacity;
+    size_t slot_count;
+    size_t live_count;
+    struct IdTable *id_table;
     uint64_t next_id;
+    uint64_t generation;
 };
 
 enum MutationResult {
@@ -52,6 +124,119 @@ static void die(const char *message)
     exit(1);
 }
 
+/*
+ * Per-command log lines go through a single-producer ring drained by a
+ * logger thread, so a slow stderr never delays a reply. Lines that find
+ * the ring full are dropped and counted.
+ */
+struct LogRing {
+    char lines[LOG_SLOTS][LOG_LINE_MAX];
+    size_t lengths[LOG_SLOTS];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint_fast64_t dropped;
+};
+
+static struct LogRing *log_ring;
+
+static void write_log_batch(const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(STDERR_FILENO, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+static void *log_ring_run(void *argument)
+{
+    struct LogRing *ring = (struct LogRing *)argument;
+    static char batch[LOG_SLOTS * LOG_LINE_MAX];
+    struct timespec delay;
+
+    delay.tv_sec = 0;
+    delay.tv_nsec = LOG_DRAIN_MS * 1000000L;
+    for (;;) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint_fast64_t dropped = atomic_exchange_explicit(
+            &ring->dropped, 0, memory_order_relaxed);
+        size_t used = 0;
+
+        while (tail != head) {
+            size_t slot = tail % LOG_SLOTS;
+
+            memcpy(batch + used, ring->lines[slot], ring->lengths[slot]);
+            used += ring->lengths[slot];
+            tail++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        if (dropped > 0) {
+            char note[64];
+            int length = snprintf(
+                note,
+                sizeof(note),
+                "log: %" PRIuFAST64 " line(s) dropped\n",
+                dropped);
+            if (length > 0 && (size_t)length < sizeof(note))
+                write_log_batch(note, (size_t)length);
+        }
+        if (used > 0)
+            write_log_batch(batch, used);
+        else
+            nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+static void log_start(void)
+{
+    pthread_t thread;
+
+    log_ring = (struct LogRing *)calloc(1, sizeof(*log_ring));
+    if (!log_ring)
+        die("calloc");
+    atomic_init(&log_ring->head, 0);
+    atomic_init(&log_ring->tail, 0);
+    atomic_init(&log_ring->dropped, 0);
+    if (pthread_create(&thread, NULL, log_ring_run, log_ring) != 0)
+        die("pthread_create");
+    pthread_detach(thread);
+}
+
+static void log_printf(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void log_printf(const char *format, ...)
+{
+    size_t head = atomic_load_explicit(&log_ring->head, memory_order_relaxed);
+    size_t slot = head % LOG_SLOTS;
+    va_list arguments;
+    int length;
+
+    if (head - atomic_load_explicit(&log_ring->tail, memory_order_acquire) ==
+        LOG_SLOTS) {
+        atomic_fetch_add_explicit(&log_ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    va_start(arguments, format);
+    length = vsnprintf(log_ring->lines[slot], LOG_LINE_MAX, format, arguments);
+    va_end(arguments);
+    if (length < 0)
+        return;
+    if (length >= LOG_LINE_MAX) {
+        length = LOG_LINE_MAX - 1;
+        log_ring->lines[slot][length - 1] = '\n';
+    }
+    log_ring->lengths[slot] = (size_t)length;
+    atomic_store_explicit(&log_ring->head, head + 1, memory_order_release);
+}
+
 static ssize_t write_all(int socket_fd, const void *buffer, size_t length)
 {
     const unsigned char *cursor = (const unsigned char *)buffer;
@@ -142,96 +327,391 @@ static int validate_text_value(
 }
 
 /*
- * Read one newline-framed backend command while retaining its true byte
- * length. Embedded NUL bytes and overlong lines are drained and rejected.
+ * Per-connection command framing. Clients are multiplexed with poll(), so
+ * bytes arrive in whatever chunks each socket delivers and a command runs
+ * once its newline has been seen.
+ */
+/*
+ * paused is set while the client waits for the batch holding its mutation
+ * to become durable. Its later commands wait in backlog until the reply
+ * is sent, so replies stay in command order.
+ */
+struct Client {
+    int socket;
+    struct sockaddr_in address;
+    char line[MAX_LINE_LEN];
+    size_t used;
+    int invalid;
+    int paused;
+    int broken;
+    char backlog[MAX_LINE_LEN];
+    size_t backlog_used;
+};
+
+struct BatchReply {
+    struct Client *client;
+    const char *operation;
+    char text[32];
+};
+
+/*
+ * The snapshot at filename holds the database as of the last compaction,
+ * and the mutation log at log_name holds one checksummed entry for every
+ * mutation published since. log_fd is -1 while the snapshot is still a
+ * legacy file or after an append failed; the next mutation then rewrites
+ * the whole snapshot and starts a fresh log.
+ *
+ * A compaction writes a clone of the database, sharing its chunks, to a new
+ * snapshot on a background thread. The main loop then rewrites the log to
+ * hold only the entries appended after the clone was taken. Replay skips
+ * ADDs below the snapshot's next id and ignores UPDATEs and DELETEs of
+ * missing ids, so replaying a log whose head the snapshot already holds
+ * ends in the same state, and a crash between the two renames loses
+ * nothing.
+ *
+ * Mutations are committed in groups. Each one is applied to pending, the
+ * live database plus every earlier mutation of the open batch, and its
+ * entry is written to the log unsynced. When the batch fills or its window
+ * closes, one fdatasync makes all of it durable, and only then is pending
+ * published and each client sent its reply. Readers see the published
+ * database until then. If the sync fails, the batch falls back to a full
+ * snapshot of pending, as a failed append does; batch_untrimmed records
+ * that its entries could not be cut off the log.
  */
-static int read_command_line(
-    int socket_fd,
-    char *line,
-    size_t capacity,
-    size_t *line_length)
+struct Storage {
+    const char *filename;
+    char *log_name;
+    int log_fd;
+    uint64_t log_bytes;
+    uint64_t snapshot_bytes;
+    uint64_t compact_bytes;
+    int compacting;
+    int compact_pipe[2];
+    pthread_t compact_thread;
+    struct Database compact_source;
+    uint64_t compact_log_offset;
+    int compact_error;
+    struct Database pending;
+    int batch_open;
+    size_t batch_count;
+    uint64_t batch_log_start;
+    int batch_untrimmed;
+    uint64_t batch_deadline_us;
+    uint64_t commit_window_us;
+    struct BatchReply batch[GROUP_COMMIT_MAX];
+};
+
+static void database_init(struct Database *database)
 {
-    size_t used = 0;
-    int invalid = 0;
+    database->chunks = NULL;
+    database->chunk_count = 0;
+    database->chunk_capacity = 0;
+    database->slot_count = 0;
+    database->live_count = 0;
+    database->id_table = NULL;
+    database->next_id = 1;
+    database->generation = 0;
+}
 
-    while (1) {
-        unsigned char c;
-        ssize_t received = recv(socket_fd, &c, 1, 0);
+static void id_table_release(struct IdTable *table)
+{
+    if (table && --table->refs == 0)
+        free(table);
+}
 
-        if (received == 0) {
-            if (used == 0 && !invalid)
-                return 0;
+static void database_free(struct Database *database)
+{
+    size_t index;
+
+    for (index = 0; index < database->chunk_count; index++) {
+        if (--database->chunks[index]->refs == 0)
+            free(database->chunks[index]);
+    }
+    free(database->chunks);
+    id_table_release(database->id_table);
+    database_init(database);
+}
+
+static const struct MdbRec *slot_record(
+    const struct Database *database,
+    size_t slot)
+{
+    return &database->chunks[slot / RECORD_CHUNK_SLOTS]
+        ->records[slot % RECORD_CHUNK_SLOTS];
+}
+
+static int slot_deleted(const struct Database *database, size_t slot)
+{
+    return database->chunks[slot / RECORD_CHUNK_SLOTS]
+        ->deleted[slot % RECORD_CHUNK_SLOTS];
+}
+
+/* Makes room in the chunk table for count slots. */
+static int database_reserve(struct Database *database, size_t count)
+{
+    struct RecordChunk **chunks;
+    size_t needed = count / RECORD_CHUNK_SLOTS + 1;
+    size_t capacity = database->chunk_capacity ? database->chunk_capacity : 16;
+
+    if (needed <= database->chunk_capacity)
+        return 0;
+    while (capacity < needed) {
+        if (capacity > SIZE_MAX / 2 / sizeof(*chunks)) {
+            errno = ENOMEM;
             return -1;
         }
-        if (received < 0) {
-            if (errno == EINTR)
-                continue;
-            return -2;
-        }
+        capacity *= 2;
+    }
+
+    chunks = (struct RecordChunk **)realloc(
+        database->chunks,
+        capacity * sizeof(*chunks));
+    if (!chunks)
+        return -1;
+    database->chunks = chunks;
+    database->chunk_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Returns the chunk holding slot, ready to be written: a chunk still shared
+ * with another database is copied first.
+ */
+static struct RecordChunk *writable_chunk(
+    struct Database *database,
+    size_t slot)
+{
+    size_t index = slot / RECORD_CHUNK_SLOTS;
+    struct RecordChunk *chunk = database->chunks[index];
+    struct RecordChunk *copy;
+
+    if (chunk->refs == 1)
+        return chunk;
+
+    copy = (struct RecordChunk *)malloc(sizeof(*copy));
+    if (!copy)
+        return NULL;
+    memcpy(copy, chunk, sizeof(*copy));
+    copy->refs = 1;
+    chunk->refs--;
+    database->chunks[index] = copy;
+    return copy;
+}
+
+static int database_append(
+    struct Database *database,
+    const struct MdbRec *record)
+{
+    size_t slot = database->slot_count;
+    struct RecordChunk *chunk;
+
+    if (database_reserve(database, slot + 1) < 0)
+        return -1;
+
+    if (slot / RECORD_CHUNK_SLOTS < database->chunk_count) {
+        chunk = writable_chunk(database, slot);
+        if (!chunk)
+            return -1;
+    } else {
+        chunk = (struct RecordChunk *)malloc(sizeof(*chunk));
+        if (!chunk)
+            return -1;
+        chunk->refs = 1;
+        database->chunks[database->chunk_count++] = chunk;
+    }
+
+    chunk->records[slot % RECORD_CHUNK_SLOTS] = *record;
+    chunk->deleted[slot % RECORD_CHUNK_SLOTS] = 0;
+    database->slot_count++;
+    database->live_count++;
+    return 0;
+}
+
+static int compare_record_ids(const void *left, const void *right)
+{
+    const struct MdbRec *a = (const struct MdbRec *)left;
+    const struct MdbRec *b = (const struct MdbRec *)right;
+
+    return a->id < b->id ? -1 : a->id > b->id;
+}
+
+/*
+ * Puts freshly loaded records in id order. Files this server wrote are
+ * already sorted, so the copy out for qsort only happens for older files.
+ * Fails with EINVAL if two records share an id.
+ */
+static int database_sort_records(struct Database *database)
+{
+    struct MdbRec *records;
+    size_t slot;
 
-        if (c == '\n')
+    for (slot = 1; slot < database->slot_count; slot++) {
+        if (slot_record(database, slot - 1)->id >
+            slot_record(database, slot)->id) {
             break;
-        if (c == '\0') {
-            invalid = 1;
-            continue;
         }
-        if (used + 1 >= capacity) {
-            invalid = 1;
-            continue;
+    }
+
+    if (slot < database->slot_count) {
+        records = (struct MdbRec *)malloc(
+            database->slot_count * sizeof(*records));
+        if (!records)
+            return -1;
+        for (slot = 0; slot < database->slot_count; slot++)
+            records[slot] = *slot_record(database, slot);
+        qsort(
+            records,
+            database->slot_count,
+            sizeof(*records),
+            compare_record_ids);
+        for (slot = 0; slot < database->slot_count; slot++) {
+            database->chunks[slot / RECORD_CHUNK_SLOTS]
+                ->records[slot % RECORD_CHUNK_SLOTS] = records[slot];
         }
-        line[used++] = (char)c;
+        free(records);
     }
 
-    if (invalid)
-        return -1;
-    if (used > 0 && line[used - 1] == '\r')
-        used--;
+    for (slot = 1; slot < database->slot_count; slot++) {
+        if (slot_record(database, slot - 1)->id ==
+            slot_record(database, slot)->id) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the first slot whose id is >= id. Tombstones keep their ids, so
+ * the result may be a deleted slot.
+ */
+static size_t slot_position(const struct Database *database, uint64_t id)
+{
+    size_t low = 0;
+    size_t high = database->slot_count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
 
-    line[used] = '\0';
-    *line_length = used;
-    return 1;
+        if (slot_record(database, middle)->id < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
 }
 
-static void database_init(struct Database *database)
+/* Spreads sequential ids across the table; capacity is a power of two. */
+static size_t id_table_home(uint64_t id, size_t capacity)
 {
-    initList(&database->records);
-    database->next_id = 1;
+    id ^= id >> 33;
+    id *= UINT64_C(0xff51afd7ed558ccd);
+    id ^= id >> 33;
+    return (size_t)id & (capacity - 1);
 }
 
-void freemdb(struct List *list)
+/*
+ * Points id at slot, reusing the entry left by an ADD that was never
+ * published.
+ */
+static void id_table_insert(struct IdTable *table, uint64_t id, size_t slot)
 {
-    traverseList(list, &free);
-    removeAllNodes(list);
+    size_t position = id_table_home(id, table->capacity);
+
+    while (table->entries[position].id != 0 &&
+           table->entries[position].id != id) {
+        position = (position + 1) & (table->capacity - 1);
+    }
+    table->entries[position].id = id;
+    table->entries[position].slot = slot;
 }
 
-static void database_free(struct Database *database)
+/*
+ * Gives the database a table of its own, sized for count entries and
+ * filled from the non-deleted slots.
+ */
+static int id_table_rebuild(struct Database *database, size_t count)
 {
-    freemdb(&database->records);
-    database->next_id = 1;
+    struct IdTable *table;
+    size_t capacity = 64;
+    size_t slot;
+
+    while (capacity / 2 < count) {
+        if (capacity > (SIZE_MAX - sizeof(*table)) / 2 /
+                sizeof(table->entries[0])) {
+            errno = ENOMEM;
+            return -1;
+        }
+        capacity *= 2;
+    }
+
+    table = (struct IdTable *)calloc(
+        1,
+        sizeof(*table) + capacity * sizeof(table->entries[0]));
+    if (!table)
+        return -1;
+    table->refs = 1;
+    table->capacity = capacity;
+    for (slot = 0; slot < database->slot_count; slot++) {
+        if (!slot_deleted(database, slot))
+            id_table_insert(table, slot_record(database, slot)->id, slot);
+    }
+
+    id_table_release(database->id_table);
+    database->id_table = table;
+    return 0;
 }
 
-static struct Node *append_owned_record(
-    struct List *list,
-    struct Node **tail,
-    struct MdbRec *record)
+/* Indexes the record just appended in the last slot. */
+static int id_table_add_last(struct Database *database)
 {
-    struct Node *node = addAfter(list, *tail, record);
-    if (node)
-        *tail = node;
-    return node;
+    size_t slot = database->slot_count - 1;
+
+    if (database->slot_count > database->id_table->capacity / 2)
+        return id_table_rebuild(database, database->slot_count * 2);
+
+    id_table_insert(database->id_table, slot_record(database, slot)->id, slot);
+    return 0;
 }
 
-static struct MdbRec *find_record(struct List *list, uint64_t id)
+static int find_slot(
+    const struct Database *database,
+    uint64_t id,
+    size_t *slot_out)
 {
-    struct Node *node;
+    const struct IdTable *table = database->id_table;
+    size_t position;
+
+    if (id == 0 || !table)
+        return -1;
 
-    for (node = list->head; node; node = node->next) {
-        struct MdbRec *record = (struct MdbRec *)node->data;
-        if (record && record->id == id)
-            return record;
+    position = id_table_home(id, table->capacity);
+    while (table->entries[position].id != 0) {
+        if (table->entries[position].id == id) {
+            size_t slot = table->entries[position].slot;
+
+            if (slot >= database->slot_count ||
+                slot_record(database, slot)->id != id ||
+                slot_deleted(database, slot)) {
+                return -1;
+            }
+            *slot_out = slot;
+            return 0;
+        }
+        position = (position + 1) & (table->capacity - 1);
     }
+    return -1;
+}
 
-    return NULL;
+static const struct MdbRec *find_record(
+    const struct Database *database,
+    uint64_t id)
+{
+    size_t slot;
+
+    return find_slot(database, id, &slot) < 0
+        ? NULL
+        : slot_record(database, slot);
 }
 
 static int validate_stored_field(const char *field, size_t capacity)
@@ -267,31 +747,24 @@ static int database_record_count(
     const struct Database *database,
     uint64_t *count_out)
 {
-    const struct Node *node;
     uint64_t count = 0;
+    size_t slot;
 
     if (!database || database->next_id == 0)
         return -1;
 
-    for (node = database->records.head; node; node = node->next) {
-        const struct Node *previous;
-        const struct MdbRec *record = (const struct MdbRec *)node->data;
+    /* Duplicate ids were already rejected when the records were sorted. */
+    for (slot = 0; slot < database->slot_count; slot++) {
+        const struct MdbRec *record = slot_record(database, slot);
 
-        if (!record || record->id == 0 || record->id >= database->next_id ||
+        if (slot_deleted(database, slot))
+            continue;
+        if (record->id == 0 || record->id >= database->next_id ||
             validate_stored_field(record->name, sizeof(record->name)) < 0 ||
             validate_stored_field(record->msg, sizeof(record->msg)) < 0) {
             return -1;
         }
 
-        for (previous = database->records.head;
-             previous != node;
-             previous = previous->next) {
-            const struct MdbRec *other =
-                (const struct MdbRec *)previous->data;
-            if (!other || other->id == record->id)
-                return -1;
-        }
-
         if (count == UINT64_MAX)
             return -1;
         count++;
@@ -402,7 +875,6 @@ static int load_legacy_database(
     uint64_t file_size,
     struct Database *database)
 {
-    struct Node *tail = NULL;
     uint64_t count;
     uint64_t index;
 
@@ -412,37 +884,36 @@ static int load_legacy_database(
     }
 
     count = file_size / LEGACY_RECORD_SIZE;
-    if (count == UINT64_MAX) {
+    if (count == UINT64_MAX || count > SIZE_MAX) {
         errno = EOVERFLOW;
         return -1;
     }
-    if (fseek(stream, 0, SEEK_SET) != 0)
+    if (fseek(stream, 0, SEEK_SET) != 0 ||
+        database_reserve(database, (size_t)count) < 0) {
         return -1;
+    }
 
     for (index = 0; index < count; index++) {
         unsigned char bytes[LEGACY_RECORD_SIZE];
-        struct MdbRec *record;
+        struct MdbRec record;
 
         if (read_exact(stream, bytes, sizeof(bytes)) < 0) {
             errno = EINVAL;
             return -1;
         }
 
-        record = (struct MdbRec *)calloc(1, sizeof(*record));
-        if (!record)
-            return -1;
-        record->id = index + 1;
+        memset(&record, 0, sizeof(record));
+        record.id = index + 1;
 
         if (copy_legacy_field(
-                record->name, sizeof(record->name),
-                bytes, sizeof(record->name)) < 0 ||
+                record.name, sizeof(record.name),
+                bytes, sizeof(record.name)) < 0 ||
             copy_legacy_field(
-                record->msg, sizeof(record->msg),
-                bytes + sizeof(record->name), sizeof(record->msg)) < 0 ||
-            !append_owned_record(&database->records, &tail, record)) {
-            int saved_errno = errno ? errno : ENOMEM;
-            free(record);
-            errno = saved_errno;
+                record.msg, sizeof(record.msg),
+                bytes + sizeof(record.name), sizeof(record.msg)) < 0 ||
+            database_append(database, &record) < 0) {
+            if (!errno)
+                errno = ENOMEM;
             return -1;
         }
     }
@@ -460,7 +931,6 @@ static int load_mdb2_database(
     unsigned char version_bytes[4];
     unsigned char next_id_bytes[8];
     unsigned char count_bytes[8];
-    struct Node *tail = NULL;
     uint32_t version;
     uint64_t next_id;
     uint64_t count;
@@ -494,37 +964,37 @@ static int load_mdb2_database(
         errno = EINVAL;
         return -1;
     }
+    if (count > SIZE_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (database_reserve(database, (size_t)count) < 0)
+        return -1;
 
     for (index = 0; index < count; index++) {
         unsigned char bytes[MDB2_RECORD_SIZE];
-        struct MdbRec *record;
+        struct MdbRec record;
 
         if (read_exact(stream, bytes, sizeof(bytes)) < 0) {
             errno = EINVAL;
             return -1;
         }
 
-        record = (struct MdbRec *)calloc(1, sizeof(*record));
-        if (!record)
-            return -1;
-
-        record->id = decode_le64(bytes);
-        memcpy(record->name, bytes + 8, sizeof(record->name));
+        record.id = decode_le64(bytes);
+        memcpy(record.name, bytes + 8, sizeof(record.name));
         memcpy(
-            record->msg,
-            bytes + 8 + sizeof(record->name),
-            sizeof(record->msg));
+            record.msg,
+            bytes + 8 + sizeof(record.name),
+            sizeof(record.msg));
 
-        if (record->id == 0 || record->id >= next_id ||
-            find_record(&database->records, record->id) ||
-            validate_stored_field(record->name, sizeof(record->name)) < 0 ||
-            validate_stored_field(record->msg, sizeof(record->msg)) < 0 ||
-            !append_owned_record(&database->records, &tail, record)) {
-            int saved_errno = errno ? errno : EINVAL;
-            free(record);
-            errno = saved_errno;
+        if (record.id == 0 || record.id >= next_id ||
+            validate_stored_field(record.name, sizeof(record.name)) < 0 ||
+            validate_stored_field(record.msg, sizeof(record.msg)) < 0) {
+            errno = EINVAL;
             return -1;
         }
+        if (database_append(database, &record) < 0)
+            return -1;
     }
 
     database->next_id = next_id;
@@ -553,13 +1023,17 @@ static int load_database(
         if (memcmp(magic, MDB2_MAGIC, sizeof(magic)) == 0) {
             *was_legacy = 0;
             result = load_mdb2_database(stream, file_size, database);
-            if (result < 0)
-                database_free(database);
-            return result;
+        } else {
+            result = load_legacy_database(stream, file_size, database);
         }
+    } else {
+        result = load_legacy_database(stream, file_size, database);
     }
 
-    result = load_legacy_database(stream, file_size, database);
+    if (result == 0)
+        result = database_sort_records(database);
+    if (result == 0)
+        result = id_table_rebuild(database, database->slot_count);
     if (result < 0)
         database_free(database);
     return result;
@@ -573,7 +1047,7 @@ static int write_mdb2_stream(
     unsigned char next_id_bytes[8];
     unsigned char count_bytes[8];
     uint64_t count;
-    const struct Node *node;
+    size_t slot;
 
     if (database_record_count(database, &count) < 0) {
         errno = EINVAL;
@@ -591,10 +1065,12 @@ static int write_mdb2_stream(
         return -1;
     }
 
-    for (node = database->records.head; node; node = node->next) {
-        const struct MdbRec *record = (const struct MdbRec *)node->data;
+    for (slot = 0; slot < database->slot_count; slot++) {
+        const struct MdbRec *record = slot_record(database, slot);
         unsigned char id_bytes[8];
 
+        if (slot_deleted(database, slot))
+            continue;
         encode_le64(id_bytes, record->id);
         if (write_exact(stream, id_bytes, sizeof(id_bytes)) < 0 ||
             write_exact(stream, record->name, sizeof(record->name)) < 0 ||
@@ -686,35 +1162,52 @@ fail:
     return -1;
 }
 
+/*
+ * Shares every chunk and the id table of source, so ids keep their slots
+ * and nothing is copied until the candidate writes. Once tombstones
+ * outnumber live records the clone instead copies the live records into
+ * fresh chunks.
+ */
 static int clone_database(
     const struct Database *source,
     struct Database *destination)
 {
-    const struct Node *node;
-    struct Node *tail = NULL;
+    size_t index;
+    size_t slot;
 
     database_init(destination);
     destination->next_id = source->next_id;
+    destination->generation = source->generation;
 
-    for (node = source->records.head; node; node = node->next) {
-        const struct MdbRec *source_record =
-            (const struct MdbRec *)node->data;
-        struct MdbRec *record =
-            (struct MdbRec *)malloc(sizeof(*record));
-
-        if (!record) {
+    if (source->slot_count - source->live_count <= source->live_count) {
+        if (database_reserve(destination, source->slot_count) < 0) {
             database_free(destination);
             return -1;
         }
-        memcpy(record, source_record, sizeof(*record));
+        for (index = 0; index < source->chunk_count; index++) {
+            destination->chunks[index] = source->chunks[index];
+            destination->chunks[index]->refs++;
+        }
+        destination->chunk_count = source->chunk_count;
+        destination->slot_count = source->slot_count;
+        destination->live_count = source->live_count;
+        destination->id_table = source->id_table;
+        if (destination->id_table)
+            destination->id_table->refs++;
+        return 0;
+    }
 
-        if (!append_owned_record(&destination->records, &tail, record)) {
-            free(record);
+    for (slot = 0; slot < source->slot_count; slot++) {
+        if (!slot_deleted(source, slot) &&
+            database_append(destination, slot_record(source, slot)) < 0) {
             database_free(destination);
             return -1;
         }
     }
-
+    if (id_table_rebuild(destination, destination->slot_count) < 0) {
+        database_free(destination);
+        return -1;
+    }
     return 0;
 }
 
@@ -724,6 +1217,7 @@ static void publish_candidate(
 {
     struct Database old = *live;
 
+    candidate->generation = live->generation + 1;
     *live = *candidate;
     database_init(candidate);
     database_free(&old);
@@ -735,7 +1229,7 @@ static int add_record(
     const char *message,
     uint64_t *assigned_id)
 {
-    struct MdbRec *record;
+    struct MdbRec record;
     uint64_t id;
 
     if (database->next_id == UINT64_MAX) {
@@ -744,19 +1238,19 @@ static int add_record(
     }
 
     id = database->next_id;
-    record = (struct MdbRec *)calloc(1, sizeof(*record));
-    if (!record)
-        return -1;
-
-    record->id = id;
-    memcpy(record->name, name, strlen(name));
-    memcpy(record->msg, message, strlen(message));
+    memset(&record, 0, sizeof(record));
+    record.id = id;
+    memcpy(record.name, name, strlen(name));
+    memcpy(record.msg, message, strlen(message));
 
-    if (!addAfter(&database->records, NULL, record)) {
-        free(record);
+    /* New ids are the largest yet, so appending keeps the slots sorted. */
+    if (database_append(database, &record) < 0)
+        return -1;
+    if (id_table_add_last(database) < 0) {
+        database->slot_count--;
+        database->live_count--;
         return -1;
     }
-
     database->next_id++;
     *assigned_id = id;
     return 0;
@@ -768,11 +1262,17 @@ static int update_record(
     const char *name,
     const char *message)
 {
-    struct MdbRec *record = find_record(&database->records, id);
+    struct RecordChunk *chunk;
+    struct MdbRec *record;
+    size_t slot;
 
-    if (!record)
+    if (find_slot(database, id, &slot) < 0)
+        return -1;
+    chunk = writable_chunk(database, slot);
+    if (!chunk)
         return -1;
 
+    record = &chunk->records[slot % RECORD_CHUNK_SLOTS];
     memset(record->name, 0, sizeof(record->name));
     memset(record->msg, 0, sizeof(record->msg));
     memcpy(record->name, name, strlen(name));
@@ -782,104 +1282,646 @@ static int update_record(
 
 static int delete_record(struct Database *database, uint64_t id)
 {
-    struct Node *node = database->records.head;
-    struct Node *previous = NULL;
-
-    while (node) {
-        struct MdbRec *record = (struct MdbRec *)node->data;
-        if (record && record->id == id) {
-            if (previous)
-                previous->next = node->next;
-            else
-                database->records.head = node->next;
-            free(record);
-            free(node);
-            return 0;
-        }
-        previous = node;
-        node = node->next;
-    }
+    struct RecordChunk *chunk;
+    size_t slot;
 
-    return -1;
+    if (find_slot(database, id, &slot) < 0)
+        return -1;
+    chunk = writable_chunk(database, slot);
+    if (!chunk)
+        return -1;
+
+    chunk->deleted[slot % RECORD_CHUNK_SLOTS] = 1;
+    database->live_count--;
+    return 0;
 }
 
-static enum MutationResult atomic_add(
-    struct Database *live,
-    const char *filename,
-    const char *name,
-    const char *message,
-    uint64_t *assigned_id)
+static uint32_t crc32_bytes(const unsigned char *bytes, size_t length)
 {
-    struct Database candidate;
-    uint64_t id;
+    static uint32_t table[256];
+    static int table_ready;
+    uint32_t crc = 0xffffffffU;
+    size_t i;
 
-    if (live->next_id == UINT64_MAX)
-        return MUTATION_ID_EXHAUSTED;
-    if (clone_database(live, &candidate) < 0)
-        return MUTATION_NO_MEMORY;
-    if (add_record(&candidate, name, message, &id) < 0) {
-        database_free(&candidate);
-        return errno == EOVERFLOW
-            ? MUTATION_ID_EXHAUSTED
-            : MUTATION_NO_MEMORY;
-    }
-    if (persist_database(filename, &candidate) < 0) {
-        database_free(&candidate);
-        return MUTATION_PERSISTENCE_FAILED;
+    if (!table_ready) {
+        uint32_t n;
+
+        for (n = 0; n < 256; n++) {
+            uint32_t c = n;
+            int k;
+
+            for (k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        table_ready = 1;
     }
 
-    publish_candidate(live, &candidate);
-    *assigned_id = id;
-    return MUTATION_OK;
+    for (i = 0; i < length; i++)
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffU;
 }
 
-static enum MutationResult atomic_update(
-    struct Database *live,
-    const char *filename,
-    uint64_t id,
-    const char *name,
-    const char *message)
+static int pread_exact(int fd, void *buffer, size_t length, uint64_t offset)
 {
-    struct Database candidate;
+    unsigned char *cursor = (unsigned char *)buffer;
 
-    if (!find_record(&live->records, id))
-        return MUTATION_NOT_FOUND;
-    if (clone_database(live, &candidate) < 0)
-        return MUTATION_NO_MEMORY;
-    if (update_record(&candidate, id, name, message) < 0) {
-        database_free(&candidate);
-        return MUTATION_NOT_FOUND;
-    }
-    if (persist_database(filename, &candidate) < 0) {
-        database_free(&candidate);
-        return MUTATION_PERSISTENCE_FAILED;
-    }
+    while (length > 0) {
+        ssize_t count = pread(fd, cursor, length, (off_t)offset);
 
-    publish_candidate(live, &candidate);
-    return MUTATION_OK;
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (count == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        cursor += count;
+        length -= (size_t)count;
+        offset += (uint64_t)count;
+    }
+    return 0;
 }
 
-static enum MutationResult atomic_delete(
-    struct Database *live,
+static int pwrite_all(int fd, const void *buffer, size_t length, uint64_t offset)
+{
+    const unsigned char *cursor = (const unsigned char *)buffer;
+
+    while (length > 0) {
+        ssize_t count = pwrite(fd, cursor, length, (off_t)offset);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        cursor += count;
+        length -= (size_t)count;
+        offset += (uint64_t)count;
+    }
+    return 0;
+}
+
+/* Makes a rename or a newly created file in path's directory durable. */
+static int sync_parent_directory(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char directory[1024];
+    int fd;
+    int result;
+
+    if (!slash) {
+        strcpy(directory, ".");
+    } else if (slash == path) {
+        strcpy(directory, "/");
+    } else {
+        size_t length = (size_t)(slash - path);
+
+        if (length >= sizeof(directory)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(directory, path, length);
+        directory[length] = '\0';
+    }
+
+    fd = open(directory, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    result = fsync(fd);
+    if (result < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return close(fd);
+}
+
+static void encode_log_header(unsigned char header[MUTATION_LOG_HEADER_SIZE])
+{
+    memset(header, 0, MUTATION_LOG_HEADER_SIZE);
+    memcpy(header, MUTATION_LOG_MAGIC, sizeof(MUTATION_LOG_MAGIC));
+    encode_le32(header + 8, MUTATION_LOG_VERSION);
+}
+
+/*
+ * An entry is a CRC-32 of the remaining bytes, the command letter (A, U,
+ * or D) padded to eight bytes, and the record in its MDB2 layout.
+ */
+static void encode_log_entry(
+    unsigned char entry[MUTATION_LOG_ENTRY_SIZE],
+    char type,
+    const struct MdbRec *record)
+{
+    memset(entry, 0, MUTATION_LOG_ENTRY_SIZE);
+    entry[4] = (unsigned char)type;
+    encode_le64(entry + 8, record->id);
+    memcpy(entry + 16, record->name, sizeof(record->name));
+    memcpy(entry + 32, record->msg, sizeof(record->msg));
+    encode_le32(entry, crc32_bytes(entry + 4, MUTATION_LOG_ENTRY_SIZE - 4));
+}
+
+static int storage_init(
+    struct Storage *storage,
     const char *filename,
-    uint64_t id)
+    uint64_t compact_bytes,
+    uint64_t commit_window_us)
+{
+    size_t length = strlen(filename);
+
+    storage->filename = filename;
+    storage->log_name = (char *)malloc(length + sizeof(MUTATION_LOG_SUFFIX));
+    if (!storage->log_name)
+        return -1;
+    memcpy(storage->log_name, filename, length);
+    memcpy(
+        storage->log_name + length,
+        MUTATION_LOG_SUFFIX,
+        sizeof(MUTATION_LOG_SUFFIX));
+
+    storage->log_fd = -1;
+    storage->log_bytes = 0;
+    storage->snapshot_bytes = 0;
+    storage->compact_bytes = compact_bytes;
+    storage->compacting = 0;
+    storage->compact_log_offset = 0;
+    storage->compact_error = 0;
+    database_init(&storage->compact_source);
+    database_init(&storage->pending);
+    storage->batch_open = 0;
+    storage->batch_count = 0;
+    storage->batch_log_start = 0;
+    storage->batch_untrimmed = 0;
+    storage->batch_deadline_us = 0;
+    storage->commit_window_us = commit_window_us;
+    return pipe(storage->compact_pipe);
+}
+
+static void storage_close_log(struct Storage *storage)
+{
+    if (storage->log_fd >= 0)
+        close(storage->log_fd);
+    storage->log_fd = -1;
+}
+
+/*
+ * Opens the mutation log, creating it next to the snapshot with the
+ * snapshot's mode. With reset set, or when the log is empty, it is
+ * truncated to a fresh header.
+ */
+static int storage_open_log(struct Storage *storage, int reset)
+{
+    unsigned char header[MUTATION_LOG_HEADER_SIZE];
+    struct stat status;
+    int fd;
+
+    if (stat(storage->filename, &status) < 0)
+        return -1;
+    fd = open(storage->log_name, O_RDWR | O_CREAT, status.st_mode & 07777);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &status) < 0)
+        goto fail;
+
+    if (reset || status.st_size == 0) {
+        encode_log_header(header);
+        if (ftruncate(fd, 0) < 0 ||
+            pwrite_all(fd, header, sizeof(header), 0) < 0 ||
+            fsync(fd) < 0 ||
+            sync_parent_directory(storage->log_name) < 0) {
+            goto fail;
+        }
+        storage->log_bytes = MUTATION_LOG_HEADER_SIZE;
+    } else {
+        storage->log_bytes = (uint64_t)status.st_size;
+    }
+
+    storage->log_fd = fd;
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+static int apply_log_entry(
+    struct Database *database,
+    const unsigned char entry[MUTATION_LOG_ENTRY_SIZE])
+{
+    struct MdbRec record;
+    uint64_t assigned_id;
+
+    record.id = decode_le64(entry + 8);
+    memcpy(record.name, entry + 16, sizeof(record.name));
+    memcpy(record.msg, entry + 32, sizeof(record.msg));
+    if (record.id == 0 ||
+        validate_stored_field(record.name, sizeof(record.name)) < 0 ||
+        validate_stored_field(record.msg, sizeof(record.msg)) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (entry[4]) {
+    case 'A':
+        /* The snapshot already holds every id below its next id. */
+        if (record.id < database->next_id)
+            return 0;
+        database->next_id = record.id;
+        return add_record(database, record.name, record.msg, &assigned_id);
+    case 'U':
+        update_record(database, record.id, record.name, record.msg);
+        return 0;
+    case 'D':
+        delete_record(database, record.id);
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Applies the log over the freshly loaded snapshot. A short or corrupt
+ * entry can only be the tail of an append that never finished, so the log
+ * is cut back to the last whole entry.
+ */
+static int storage_replay_log(
+    struct Storage *storage,
+    struct Database *database,
+    uint64_t *replayed)
+{
+    unsigned char header[MUTATION_LOG_HEADER_SIZE];
+    unsigned char expected[MUTATION_LOG_HEADER_SIZE];
+    uint64_t offset = MUTATION_LOG_HEADER_SIZE;
+
+    encode_log_header(expected);
+    if (storage->log_bytes < MUTATION_LOG_HEADER_SIZE ||
+        pread_exact(storage->log_fd, header, sizeof(header), 0) < 0 ||
+        memcmp(header, expected, sizeof(header)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *replayed = 0;
+    while (storage->log_bytes - offset >= MUTATION_LOG_ENTRY_SIZE) {
+        unsigned char entry[MUTATION_LOG_ENTRY_SIZE];
+
+        if (pread_exact(storage->log_fd, entry, sizeof(entry), offset) < 0)
+            return -1;
+        if (decode_le32(entry) !=
+            crc32_bytes(entry + 4, MUTATION_LOG_ENTRY_SIZE - 4)) {
+            break;
+        }
+        if (apply_log_entry(database, entry) < 0)
+            return -1;
+        offset += MUTATION_LOG_ENTRY_SIZE;
+        (*replayed)++;
+    }
+
+    if (offset != storage->log_bytes) {
+        fprintf(
+            stderr,
+            "Discarding %" PRIu64 " bytes of unfinished mutation log\n",
+            storage->log_bytes - offset);
+        if (ftruncate(storage->log_fd, (off_t)offset) < 0 ||
+            fsync(storage->log_fd) < 0) {
+            return -1;
+        }
+        storage->log_bytes = offset;
+    }
+    return 0;
+}
+
+/* Writes one entry after the batch's earlier ones; the flush syncs them. */
+static int storage_write_entry(
+    struct Storage *storage,
+    char type,
+    const struct MdbRec *record)
+{
+    unsigned char entry[MUTATION_LOG_ENTRY_SIZE];
+
+    encode_log_entry(entry, type, record);
+    if (pwrite_all(
+            storage->log_fd,
+            entry,
+            sizeof(entry),
+            storage->log_bytes) < 0) {
+        return -1;
+    }
+
+    storage->log_bytes += sizeof(entry);
+    return 0;
+}
+
+/*
+ * Cuts the open batch's entries off the log so they cannot be replayed,
+ * and stops using the log; the next snapshot starts a fresh one.
+ */
+static void storage_abandon_log(struct Storage *storage)
+{
+    if (ftruncate(storage->log_fd, (off_t)storage->batch_log_start) < 0 ||
+        fsync(storage->log_fd) < 0) {
+        log_printf("Could not trim mutation log: %s\n", strerror(errno));
+        storage->batch_untrimmed = 1;
+    }
+    storage_close_log(storage);
+}
+
+static void *compaction_run(void *argument)
+{
+    struct Storage *storage = (struct Storage *)argument;
+    ssize_t written;
+
+    if (persist_database(storage->filename, &storage->compact_source) < 0 ||
+        sync_parent_directory(storage->filename) < 0) {
+        storage->compact_error = errno ? errno : EIO;
+    } else {
+        storage->compact_error = 0;
+    }
+
+    do {
+        written = write(storage->compact_pipe[1], "", 1);
+    } while (written < 0 && errno == EINTR);
+    return NULL;
+}
+
+/*
+ * Replaces the log with one holding only the entries appended since the
+ * compaction took its clone.
+ */
+static int storage_rewrite_log(struct Storage *storage)
+{
+    static const char suffix[] = ".tmp.XXXXXX";
+    unsigned char buffer[64 * MUTATION_LOG_ENTRY_SIZE];
+    size_t name_length = strlen(storage->log_name);
+    char *temporary_name;
+    uint64_t offset = storage->compact_log_offset;
+    uint64_t written = MUTATION_LOG_HEADER_SIZE;
+    struct stat status;
+    int fd;
+    int saved_errno;
+
+    temporary_name = (char *)malloc(name_length + sizeof(suffix));
+    if (!temporary_name)
+        return -1;
+    memcpy(temporary_name, storage->log_name, name_length);
+    memcpy(temporary_name + name_length, suffix, sizeof(suffix));
+
+    fd = mkstemp(temporary_name);
+    if (fd < 0) {
+        saved_errno = errno;
+        free(temporary_name);
+        errno = saved_errno;
+        return -1;
+    }
+
+    encode_log_header(buffer);
+    if (fstat(storage->log_fd, &status) < 0 ||
+        fchmod(fd, status.st_mode & 07777) < 0 ||
+        pwrite_all(fd, buffer, MUTATION_LOG_HEADER_SIZE, 0) < 0) {
+        goto fail;
+    }
+    while (offset < storage->log_bytes) {
+        size_t length = storage->log_bytes - offset > sizeof(buffer)
+            ? sizeof(buffer)
+            : (size_t)(storage->log_bytes - offset);
+
+        if (pread_exact(storage->log_fd, buffer, length, offset) < 0 ||
+            pwrite_all(fd, buffer, length, written) < 0) {
+            goto fail;
+        }
+        offset += length;
+        written += length;
+    }
+    if (fsync(fd) < 0 || rename(temporary_name, storage->log_name) < 0)
+        goto fail;
+
+    free(temporary_name);
+    close(storage->log_fd);
+    storage->log_fd = fd;
+    storage->log_bytes = written;
+    return sync_parent_directory(storage->log_name);
+
+fail:
+    saved_errno = errno ? errno : EIO;
+    close(fd);
+    unlink(temporary_name);
+    free(temporary_name);
+    errno = saved_errno;
+    return -1;
+}
+
+/*
+ * Waits for the running compaction. With rewrite_log set, a successful
+ * one then drops the log entries its snapshot now holds.
+ */
+static void compaction_finish(struct Storage *storage, int rewrite_log)
+{
+    char byte;
+
+    pthread_join(storage->compact_thread, NULL);
+    while (read(storage->compact_pipe[0], &byte, 1) < 0 && errno == EINTR)
+        ;
+    storage->compacting = 0;
+
+    if (storage->compact_error != 0) {
+        log_printf(
+            "Compaction failed: %s\n",
+            strerror(storage->compact_error));
+    } else {
+        storage->snapshot_bytes = MDB2_HEADER_SIZE +
+            (uint64_t)storage->compact_source.live_count * MDB2_RECORD_SIZE;
+        if (rewrite_log && storage->log_fd >= 0) {
+            if (storage_rewrite_log(storage) < 0) {
+                log_printf(
+                    "Could not shorten mutation log: %s\n",
+                    strerror(errno));
+            } else {
+                log_printf(
+                    "Compacted %" PRIu64 " records into %s\n",
+                    (uint64_t)storage->compact_source.live_count,
+                    storage->filename);
+            }
+        }
+    }
+    database_free(&storage->compact_source);
+}
+
+/*
+ * Starts a background compaction once the log has outgrown both the
+ * configured size and half the snapshot.
+ */
+static void storage_maybe_compact(
+    struct Storage *storage,
+    const struct Database *database)
+{
+    uint64_t logged;
+
+    if (storage->compacting || storage->log_fd < 0)
+        return;
+    logged = storage->log_bytes - MUTATION_LOG_HEADER_SIZE;
+    if (logged < storage->compact_bytes || logged < storage->snapshot_bytes / 2)
+        return;
+
+    if (clone_database(database, &storage->compact_source) < 0)
+        return;
+    storage->compact_log_offset = storage->log_bytes;
+    if (pthread_create(
+            &storage->compact_thread,
+            NULL,
+            compaction_run,
+            storage) != 0) {
+        database_free(&storage->compact_source);
+        return;
+    }
+    storage->compacting = 1;
+}
+
+/*
+ * Writes the whole database as the new snapshot and starts an empty log.
+ * The snapshot rename is made durable before the old log is cleared, so a
+ * crash leaves either the old pair or a snapshot the old log replays over
+ * harmlessly. If the new log cannot be started, later mutations keep
+ * writing full snapshots.
+ */
+static int storage_write_snapshot(
+    struct Storage *storage,
+    const struct Database *database)
+{
+    if (storage->compacting)
+        compaction_finish(storage, 0);
+    if (persist_database(storage->filename, database) < 0)
+        return -1;
+
+    storage->snapshot_bytes = MDB2_HEADER_SIZE +
+        (uint64_t)database->live_count * MDB2_RECORD_SIZE;
+    storage_close_log(storage);
+    if (sync_parent_directory(storage->filename) < 0 ||
+        storage_open_log(storage, 1) < 0) {
+        log_printf("Could not start mutation log: %s\n", strerror(errno));
+    }
+    return 0;
+}
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/* The database the next mutation builds on. */
+static const struct Database *batch_base(
+    const struct Storage *storage,
+    const struct Database *live)
 {
+    return storage->batch_open ? &storage->pending : live;
+}
+
+/*
+ * Adds candidate, one mutation past batch_base, to the open batch. If its
+ * log entry cannot be written, the batch falls back to being flushed as a
+ * full snapshot.
+ */
+static void batch_stage(
+    struct Storage *storage,
+    struct Database *candidate,
+    char type,
+    const struct MdbRec *record)
+{
+    if (!storage->batch_open) {
+        storage->batch_open = 1;
+        storage->batch_log_start = storage->log_bytes;
+        storage->batch_deadline_us =
+            monotonic_us() + storage->commit_window_us;
+    }
+    if (storage->log_fd >= 0 &&
+        storage_write_entry(storage, type, record) < 0) {
+        log_printf("Could not append to mutation log: %s\n", strerror(errno));
+        storage_abandon_log(storage);
+    }
+
+    database_free(&storage->pending);
+    storage->pending = *candidate;
+    database_init(candidate);
+}
+
+static enum MutationResult atomic_add(
+    const struct Database *live,
+    struct Storage *storage,
+    const char *name,
+    const char *message,
+    uint64_t *assigned_id)
+{
+    const struct Database *base = batch_base(storage, live);
     struct Database candidate;
+    uint64_t id;
 
-    if (!find_record(&live->records, id))
+    if (base->next_id == UINT64_MAX)
+        return MUTATION_ID_EXHAUSTED;
+    if (clone_database(base, &candidate) < 0)
+        return MUTATION_NO_MEMORY;
+    if (add_record(&candidate, name, message, &id) < 0) {
+        database_free(&candidate);
+        return errno == EOVERFLOW
+            ? MUTATION_ID_EXHAUSTED
+            : MUTATION_NO_MEMORY;
+    }
+    batch_stage(storage, &candidate, 'A', find_record(&candidate, id));
+    *assigned_id = id;
+    return MUTATION_OK;
+}
+
+static enum MutationResult atomic_update(
+    const struct Database *live,
+    struct Storage *storage,
+    uint64_t id,
+    const char *name,
+    const char *message)
+{
+    const struct Database *base = batch_base(storage, live);
+    struct Database candidate;
+
+    if (!find_record(base, id))
         return MUTATION_NOT_FOUND;
-    if (clone_database(live, &candidate) < 0)
+    if (clone_database(base, &candidate) < 0)
         return MUTATION_NO_MEMORY;
-    if (delete_record(&candidate, id) < 0) {
+    if (update_record(&candidate, id, name, message) < 0) {
         database_free(&candidate);
         return MUTATION_NOT_FOUND;
     }
-    if (persist_database(filename, &candidate) < 0) {
+    batch_stage(storage, &candidate, 'U', find_record(&candidate, id));
+    return MUTATION_OK;
+}
+
+static enum MutationResult atomic_delete(
+    const struct Database *live,
+    struct Storage *storage,
+    uint64_t id)
+{
+    const struct Database *base = batch_base(storage, live);
+    struct Database candidate;
+    struct MdbRec deleted;
+
+    if (!find_record(base, id))
+        return MUTATION_NOT_FOUND;
+    if (clone_database(base, &candidate) < 0)
+        return MUTATION_NO_MEMORY;
+    if (delete_record(&candidate, id) < 0) {
         database_free(&candidate);
-        return MUTATION_PERSISTENCE_FAILED;
+        return MUTATION_NOT_FOUND;
     }
-
-    publish_candidate(live, &candidate);
+    memset(&deleted, 0, sizeof(deleted));
+    deleted.id = id;
+    batch_stage(storage, &candidate, 'D', &deleted);
     return MUTATION_OK;
 }
 
@@ -949,11 +1991,12 @@ static int list_all_records(
     const struct Database *database,
     int client_socket)
 {
-    const struct Node *node;
+    size_t slot;
 
-    for (node = database->records.head; node; node = node->next) {
-        const struct MdbRec *record = (const struct MdbRec *)node->data;
-        if (send_record(client_socket, record) < 0)
+    for (slot = 0; slot < database->slot_count; slot++) {
+        if (slot_deleted(database, slot))
+            continue;
+        if (send_record(client_socket, slot_record(database, slot)) < 0)
             return -1;
     }
 
@@ -964,11 +2007,60 @@ static int list_all_records_v2(
     const struct Database *database,
     int client_socket)
 {
-    const struct Node *node;
+    size_t slot;
 
-    for (node = database->records.head; node; node = node->next) {
-        const struct MdbRec *record = (const struct MdbRec *)node->data;
-        if (send_record_v2(client_socket, record) < 0)
+    for (slot = 0; slot < database->slot_count; slot++) {
+        if (slot_deleted(database, slot))
+            continue;
+        if (send_record_v2(client_socket, slot_record(database, slot)) < 0)
+            return -1;
+    }
+
+    return write_all(client_socket, "\n", 1) < 0 ? -1 : 0;
+}
+
+/*
+ * Sends up to count records in ascending id order: those just after id, or
+ * with before set, those just before it. Pages are cut by binary search on
+ * the slots, so the cost depends on count (plus any tombstones in the way)
+ * and not on the size of the database.
+ */
+static int list_range_v2(
+    const struct Database *database,
+    int client_socket,
+    int before,
+    uint64_t id,
+    uint64_t count)
+{
+    size_t start;
+    size_t end;
+    size_t slot;
+    uint64_t found = 0;
+
+    if (before) {
+        end = slot_position(database, id);
+        start = end;
+        while (start > 0 && found < count) {
+            start--;
+            if (!slot_deleted(database, start))
+                found++;
+        }
+    } else {
+        start = id == UINT64_MAX
+            ? database->slot_count
+            : slot_position(database, id + 1);
+        end = start;
+        while (end < database->slot_count && found < count) {
+            if (!slot_deleted(database, end))
+                found++;
+            end++;
+        }
+    }
+
+    for (slot = start; slot < end; slot++) {
+        if (slot_deleted(database, slot))
+            continue;
+        if (send_record_v2(client_socket, slot_record(database, slot)) < 0)
             return -1;
     }
 
@@ -981,11 +2073,13 @@ static int search_records(
     const char *key,
     int *match_count)
 {
-    const struct Node *node;
     int matches = 0;
+    size_t slot;
 
-    for (node = database->records.head; node; node = node->next) {
-        const struct MdbRec *record = (const struct MdbRec *)node->data;
+    for (slot = 0; slot < database->slot_count; slot++) {
+        const struct MdbRec *record = slot_record(database, slot);
+        if (slot_deleted(database, slot))
+            continue;
         if (my_strcasestr(record->name, key) ||
             my_strcasestr(record->msg, key)) {
             if (send_record(client_socket, record) < 0)
@@ -1007,11 +2101,13 @@ static int search_records_v2(
     const char *key,
     int *match_count)
 {
-    const struct Node *node;
     int matches = 0;
+    size_t slot;
 
-    for (node = database->records.head; node; node = node->next) {
-        const struct MdbRec *record = (const struct MdbRec *)node->data;
+    for (slot = 0; slot < database->slot_count; slot++) {
+        const struct MdbRec *record = slot_record(database, slot);
+        if (slot_deleted(database, slot))
+            continue;
         if (my_strcasestr(record->name, key) ||
             my_strcasestr(record->msg, key)) {
             if (send_record_v2(client_socket, record) < 0)
@@ -1046,35 +2142,589 @@ static int send_mutation_error(
     return send_text(client_socket, "ERROR: Failed to persist deleted record\n");
 }
 
+/*
+ * Makes the open batch durable with one sync, or with one snapshot while
+ * there is no log or the sync failed, then publishes it and answers every
+ * client in it. If that fails, the whole batch is dropped and each client
+ * is told so. Entries that could not be trimmed off the log are then
+ * superseded by a snapshot of live, so a restart cannot replay them.
+ */
+static void batch_flush(struct Storage *storage, struct Database *live)
+{
+    int failed = 0;
+    size_t index;
+
+    if (!storage->batch_open)
+        return;
+    if (storage->log_fd >= 0 && fdatasync(storage->log_fd) < 0) {
+        log_printf("Could not sync mutation log: %s\n", strerror(errno));
+        storage_abandon_log(storage);
+    }
+    if (storage->log_fd < 0 &&
+        storage_write_snapshot(storage, &storage->pending) < 0) {
+        failed = 1;
+        if (storage->batch_untrimmed &&
+            storage_write_snapshot(storage, live) < 0) {
+            log_printf("Could not supersede failed batch in mutation log\n");
+        }
+    }
+    storage->batch_open = 0;
+    storage->batch_untrimmed = 0;
+
+    if (failed) {
+        database_free(&storage->pending);
+    } else {
+        publish_candidate(live, &storage->pending);
+        storage_maybe_compact(storage, live);
+    }
+
+    for (index = 0; index < storage->batch_count; index++) {
+        struct BatchReply *reply = &storage->batch[index];
+        int result = failed
+            ? send_mutation_error(
+                  reply->client->socket,
+                  MUTATION_PERSISTENCE_FAILED,
+                  reply->operation)
+            : send_text(reply->client->socket, reply->text);
+
+        reply->client->paused = 0;
+        if (result < 0)
+            reply->client->broken = 1;
+    }
+    storage->batch_count = 0;
+}
+
+/* Holds client's reply to a staged mutation until its batch is durable. */
+static void batch_defer(
+    struct Storage *storage,
+    struct Database *live,
+    struct Client *client,
+    const char *operation,
+    const char *text)
+{
+    struct BatchReply *reply = &storage->batch[storage->batch_count++];
+
+    reply->client = client;
+    reply->operation = operation;
+    snprintf(reply->text, sizeof(reply->text), "%s", text);
+    client->paused = 1;
+    if (storage->batch_count == GROUP_COMMIT_MAX)
+        batch_flush(storage, live);
+}
+
+/*
+ * Executes one complete command line. A mutation's reply is held for its
+ * batch and the client is paused. Returns -1 when the client connection
+ * can no longer be used and should be closed.
+ */
+static int handle_command(
+    struct Database *database,
+    struct Storage *storage,
+    struct Client *client,
+    char *line)
+{
+    int client_socket = client->socket;
+
+    if (strncmp(line, "SEARCH2 ", 8) == 0) {
+        char *key = line + 8;
+        int match_count;
+
+        if (validate_text_value(key, KEY_MAX, 0) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid search key\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (search_records_v2(
+                database,
+                client_socket,
+                key,
+                &match_count) < 0) {
+            return -1;
+        }
+        log_printf(
+            "SEARCH2 for '%s' completed: %d match(es) found\n",
+            key,
+            match_count);
+    } else if (strncmp(line, "SEARCH ", 7) == 0) {
+        char *key = line + 7;
+        int match_count;
+
+        if (validate_text_value(key, KEY_MAX, 0) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid search key\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (search_records(
+                database,
+                client_socket,
+                key,
+                &match_count) < 0) {
+            return -1;
+        }
+        log_printf(
+            "SEARCH for '%s' completed: %d match(es) found\n",
+            key,
+            match_count);
+    } else if (strncmp(line, "ADD ", 4) == 0) {
+        char *data = line + 4;
+        char *pipe = strchr(data, '|');
+        char *name;
+        char *message;
+        uint64_t assigned_id;
+        enum MutationResult result;
+
+        if (!pipe || strchr(pipe + 1, '|')) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid ADD format\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+        *pipe = '\0';
+        name = data;
+        message = pipe + 1;
+
+        if (validate_text_value(name, MAX_NAME_LEN, 1) < 0 ||
+            validate_text_value(message, MAX_MSG_LEN, 1) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid name or message\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        result = atomic_add(
+            database,
+            storage,
+            name,
+            message,
+            &assigned_id);
+        if (result == MUTATION_OK) {
+            char response[32];
+
+            snprintf(
+                response,
+                sizeof(response),
+                "OK %" PRIu64 "\n",
+                assigned_id);
+            batch_defer(storage, database, client, "add", response);
+        } else if (send_mutation_error(
+                       client_socket, result, "add") < 0) {
+            return -1;
+        }
+    } else if (strncmp(line, "DELETE ", 7) == 0) {
+        uint64_t id;
+        enum MutationResult result;
+
+        if (parse_positive_u64(line + 7, &id) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid record ID\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        result = atomic_delete(database, storage, id);
+        if (result == MUTATION_OK) {
+            batch_defer(storage, database, client, "delete", "OK\n");
+        } else if (send_mutation_error(
+                       client_socket, result, "delete") < 0) {
+            return -1;
+        }
+    } else if (strncmp(line, "UPDATE ", 7) == 0) {
+        char *data = line + 7;
+        char *first_pipe = strchr(data, '|');
+        char *second_pipe;
+        char *name;
+        char *message;
+        uint64_t id;
+        enum MutationResult result;
+
+        if (!first_pipe) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid UPDATE format\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+        *first_pipe = '\0';
+        if (parse_positive_u64(data, &id) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid record ID\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        second_pipe = strchr(first_pipe + 1, '|');
+        if (!second_pipe || strchr(second_pipe + 1, '|')) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid UPDATE format\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+        *second_pipe = '\0';
+        name = first_pipe + 1;
+        message = second_pipe + 1;
+
+        if (validate_text_value(name, MAX_NAME_LEN, 1) < 0 ||
+            validate_text_value(message, MAX_MSG_LEN, 1) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid name or message\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        result = atomic_update(
+            database,
+            storage,
+            id,
+            name,
+            message);
+        if (result == MUTATION_OK) {
+            batch_defer(storage, database, client, "update", "OK\n");
+        } else if (send_mutation_error(
+                       client_socket, result, "update") < 0) {
+            return -1;
+        }
+    } else if (strncmp(line, "GET ", 4) == 0) {
+        uint64_t id;
+        const struct MdbRec *record;
+
+        if (parse_positive_u64(line + 4, &id) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid record ID\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        record = find_record(database, id);
+        if (!record) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Record not found\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+        if (send_record_v2(client_socket, record) < 0)
+            return -1;
+    } else if (strcmp(line, "GENERATION") == 0) {
+        char response[64];
+        int response_length = snprintf(
+            response,
+            sizeof(response),
+            "GENERATION %" PRIu64 "\n",
+            database->generation);
+        if (response_length < 0 ||
+            (size_t)response_length >= sizeof(response) ||
+            write_all(
+                client_socket,
+                response,
+                (size_t)response_length) < 0) {
+            return -1;
+        }
+    } else if (strncmp(line, "RANGE2 ", 7) == 0) {
+        char *direction = line + 7;
+        char *id_text = strchr(direction, ' ');
+        char *count_text = id_text ? strchr(id_text + 1, ' ') : NULL;
+        int before;
+        uint64_t id = 0;
+        uint64_t count;
+
+        if (id_text)
+            *id_text++ = '\0';
+        if (count_text)
+            *count_text++ = '\0';
+        before = strcmp(direction, "BEFORE") == 0;
+        if (!count_text ||
+            (!before && strcmp(direction, "AFTER") != 0) ||
+            (strcmp(id_text, "0") != 0 &&
+             parse_positive_u64(id_text, &id) < 0) ||
+            parse_positive_u64(count_text, &count) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid RANGE2 format\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (list_range_v2(database, client_socket, before, id, count) < 0)
+            return -1;
+    } else if (strcmp(line, "LIST2") == 0) {
+        if (list_all_records_v2(database, client_socket) < 0)
+            return -1;
+    } else if (strcmp(line, "LIST") == 0) {
+        if (list_all_records(database, client_socket) < 0)
+            return -1;
+    } else if (strcmp(line, "SAVE") == 0) {
+        batch_flush(storage, database);
+        if (storage_write_snapshot(storage, database) == 0) {
+            if (send_text(client_socket, "OK\n") < 0)
+                return -1;
+        } else if (send_text(
+                       client_socket,
+                       "ERROR: Failed to save\n") < 0) {
+            return -1;
+        }
+    } else {
+        int match_count;
+
+        if (validate_text_value(line, KEY_MAX, 0) < 0) {
+            if (send_text(
+                    client_socket,
+                    "ERROR: Invalid search key\n") < 0) {
+                return -1;
+            }
+            return 0;
+        }
+
+        if (search_records(
+                database,
+                client_socket,
+                line,
+                &match_count) < 0) {
+            return -1;
+        }
+        log_printf(
+            "Search for '%s' completed: %d match(es) found\n",
+            line,
+            match_count);
+    }
+
+    return 0;
+}
+
+/*
+ * Feeds received bytes through the command framer while retaining each
+ * line's true byte length. Embedded NUL bytes and overlong lines are drained
+ * to the next newline and rejected. Returns -1 when the client should be
+ * disconnected.
+ */
+static int client_consume(
+    struct Database *database,
+    struct Storage *storage,
+    struct Client *client,
+    const char *bytes,
+    size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        char c = bytes[i];
+
+        if (c == '\n') {
+            size_t used = client->used;
+            int invalid = client->invalid;
+
+            client->used = 0;
+            client->invalid = 0;
+            if (invalid) {
+                if (send_text(
+                        client->socket,
+                        "ERROR: Invalid command line\n") < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (used > 0 && client->line[used - 1] == '\r')
+                used--;
+            client->line[used] = '\0';
+            if (used == 0)
+                continue;
+            if (handle_command(
+                    database,
+                    storage,
+                    client,
+                    client->line) < 0) {
+                return -1;
+            }
+            if (client->paused) {
+                client->backlog_used = count - i - 1;
+                memcpy(client->backlog, bytes + i + 1, client->backlog_used);
+                return 0;
+            }
+            continue;
+        }
+        if (c == '\0' || client->used + 1 >= sizeof(client->line)) {
+            client->invalid = 1;
+            continue;
+        }
+        client->line[client->used++] = c;
+    }
+
+    return 0;
+}
+
+static int serve_client_input(
+    struct Database *database,
+    struct Storage *storage,
+    struct Client *client)
+{
+    char buffer[MAX_LINE_LEN];
+    ssize_t received = recv(client->socket, buffer, sizeof(buffer), 0);
+
+    if (received < 0) {
+        if (errno == EINTR)
+            return 0;
+        log_printf("Error reading from client connection\n");
+        return -1;
+    }
+    if (received == 0) {
+        if (client->used > 0 || client->invalid)
+            send_text(client->socket, "ERROR: Invalid command line\n");
+        return -1;
+    }
+
+    return client_consume(
+        database,
+        storage,
+        client,
+        buffer,
+        (size_t)received);
+}
+
+/* Runs the commands a client sent while its reply was held for a batch. */
+static int client_resume(
+    struct Database *database,
+    struct Storage *storage,
+    struct Client *client)
+{
+    char bytes[MAX_LINE_LEN];
+    size_t count = client->backlog_used;
+
+    memcpy(bytes, client->backlog, count);
+    client->backlog_used = 0;
+    return client_consume(database, storage, client, bytes, count);
+}
+
+static struct Client *accept_client(int server_socket)
+{
+    struct Client *client;
+    struct timeval timeout;
+    socklen_t client_length;
+
+    client = (struct Client *)calloc(1, sizeof(*client));
+    if (!client)
+        return NULL;
+
+    client_length = sizeof(client->address);
+    client->socket = accept(
+        server_socket,
+        (struct sockaddr *)&client->address,
+        &client_length);
+    if (client->socket < 0) {
+        free(client);
+        return NULL;
+    }
+
+    /*
+     * Responses are written with blocking sends. Bound them so a client that
+     * stops reading cannot stall every other connection indefinitely.
+     */
+    timeout.tv_sec = CLIENT_SEND_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(
+        client->socket,
+        SOL_SOCKET,
+        SO_SNDTIMEO,
+        &timeout,
+        sizeof(timeout));
+
+    log_printf(
+        "\nconnection started from: %s\n",
+        inet_ntoa(client->address.sin_addr));
+    return client;
+}
+
+static void disconnect_client(struct Client *client)
+{
+    close(client->socket);
+    log_printf(
+        "connection terminated from: %s\n",
+        inet_ntoa(client->address.sin_addr));
+    free(client);
+}
+
 int main(int argc, char **argv)
 {
     const char *filename;
     unsigned short port;
     FILE *database_file;
     struct Database database;
+    struct Storage storage;
+    uint64_t compact_bytes = COMPACT_BYTES_DEFAULT;
+    uint64_t commit_window_us = GROUP_COMMIT_WINDOW_US;
+    uint64_t replayed = 0;
     int was_legacy = 0;
     uint64_t loaded_count;
+    int argi = 1;
     int server_socket;
     int reuse = 1;
     struct sockaddr_in server_address;
+    struct Client *clients[MAX_CLIENTS];
+    size_t client_count = 0;
 
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         die("signal");
+    /* A log append past a file size limit fails with EFBIG instead. */
+    if (signal(SIGXFSZ, SIG_IGN) == SIG_ERR)
+        die("signal");
 
-    if (argc != 3) {
+    while (argc - argi > 2) {
+        const char *option = argv[argi];
+        const char *value = argv[argi + 1];
+        int valid = 0;
+
+        if (strcmp(option, "--compact-bytes") == 0) {
+            valid = parse_positive_u64(value, &compact_bytes) == 0;
+        } else if (strcmp(option, "--commit-window-us") == 0) {
+            commit_window_us = 0;
+            valid = (strcmp(value, "0") == 0 ||
+                     parse_positive_u64(value, &commit_window_us) == 0) &&
+                commit_window_us <= GROUP_COMMIT_WINDOW_MAX_US;
+        }
+        if (!valid) {
+            fprintf(stderr, "Error: Invalid option %s %s\n", option, value);
+            return 1;
+        }
+        argi += 2;
+    }
+    if (argc - argi != 2) {
         fprintf(
             stderr,
-            "Usage: %s <database_file> <server_port>\n",
+            "Usage: %s [--compact-bytes N] [--commit-window-us N] "
+            "<database_file> <server_port>\n",
             argv[0]);
         return 1;
     }
 
-    filename = argv[1];
+    filename = argv[argi];
     if (!filename || !*filename || strlen(filename) >= 1024) {
         fprintf(stderr, "Error: Invalid database filename\n");
         return 1;
     }
-    if (parse_port(argv[2], &port) < 0) {
+    if (parse_port(argv[argi + 1], &port) < 0) {
         fprintf(stderr, "Error: Invalid port number (must be 1-65535)\n");
         return 1;
     }
@@ -1092,18 +2742,49 @@ int main(int argc, char **argv)
         database_free(&database);
         die("close database");
     }
+
+    if (storage_init(&storage, filename, compact_bytes, commit_window_us) < 0) {
+        database_free(&database);
+        die("storage");
+    }
+    storage.snapshot_bytes = MDB2_HEADER_SIZE +
+        (uint64_t)database.live_count * MDB2_RECORD_SIZE;
+    /* A legacy snapshot gets its log when the first mutation migrates it. */
+    if (!was_legacy &&
+        (storage_open_log(&storage, 0) < 0 ||
+         storage_replay_log(&storage, &database, &replayed) < 0)) {
+        database_free(&database);
+        die(storage.log_name);
+    }
+
     if (database_record_count(&database, &loaded_count) < 0) {
         database_free(&database);
         errno = EINVAL;
         die("validate database");
     }
 
+    {
+        struct timeval loaded_at;
+
+        gettimeofday(&loaded_at, NULL);
+        database.generation =
+            (uint64_t)loaded_at.tv_sec * 1000000 + (uint64_t)loaded_at.tv_usec;
+    }
+
     fprintf(
         stderr,
         "Loaded %" PRIu64 " records from %s database; next ID is %" PRIu64 "\n",
         loaded_count,
         was_legacy ? "legacy" : "MDB2",
         database.next_id);
+    if (replayed > 0) {
+        fprintf(
+            stderr,
+            "Replayed %" PRIu64 " logged mutations from %s\n",
+            replayed,
+            storage.log_name);
+    }
+    log_start();
 
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
@@ -1141,287 +2822,94 @@ int main(int argc, char **argv)
     }
 
     while (1) {
-        struct sockaddr_in client_address;
-        socklen_t client_length = sizeof(client_address);
-        int client_socket = accept(
-            server_socket,
-            (struct sockaddr *)&client_address,
-            &client_length);
-        char line[MAX_LINE_LEN];
+        struct pollfd descriptors[MAX_CLIENTS + 2];
+        size_t compact_slot = client_count + 1;
+        size_t index;
+        int timeout = -1;
+        int ready;
+
+        /* Stop accepting while the client table is full. */
+        descriptors[0].fd = client_count < MAX_CLIENTS ? server_socket : -1;
+        descriptors[0].events = POLLIN;
+        descriptors[0].revents = 0;
+        /* Paused clients are left alone until their batch is flushed. */
+        for (index = 0; index < client_count; index++) {
+            descriptors[index + 1].fd =
+                clients[index]->paused ? -1 : clients[index]->socket;
+            descriptors[index + 1].events = POLLIN;
+            descriptors[index + 1].revents = 0;
+        }
+        /* The log is only rewritten between batches. */
+        descriptors[compact_slot].fd =
+            storage.compacting && !storage.batch_open
+                ? storage.compact_pipe[0]
+                : -1;
+        descriptors[compact_slot].events = POLLIN;
+        descriptors[compact_slot].revents = 0;
+
+        if (storage.batch_open) {
+            uint64_t now = monotonic_us();
+
+            timeout = now >= storage.batch_deadline_us
+                ? 0
+                : (int)((storage.batch_deadline_us - now + 999) / 1000);
+        }
 
-        if (client_socket < 0) {
+        ready = poll(descriptors, (nfds_t)(client_count + 2), timeout);
+        if (ready < 0) {
             if (errno == EINTR)
                 continue;
             database_free(&database);
             close(server_socket);
-            die("accept");
+            die("poll");
         }
 
-        fprintf(
-            stderr,
-            "\nconnection started from: %s\n",
-            inet_ntoa(client_address.sin_addr));
+        if (descriptors[compact_slot].revents)
+            compaction_finish(&storage, 1);
 
-        while (1) {
-            size_t length = 0;
-            int read_result = read_command_line(
-                client_socket,
-                line,
-                sizeof(line),
-                &length);
-
-            if (read_result == 0)
-                break;
-            if (read_result == -2) {
-                fprintf(stderr, "Error reading from client connection\n");
-                break;
-            }
-            if (read_result == -1) {
-                if (send_text(
-                        client_socket,
-                        "ERROR: Invalid command line\n") < 0) {
-                    break;
-                }
+        index = client_count;
+        while (index > 0) {
+            index--;
+            if (!descriptors[index + 1].revents)
                 continue;
+            if (serve_client_input(&database, &storage, clients[index]) < 0) {
+                disconnect_client(clients[index]);
+                clients[index] = clients[--client_count];
             }
-            if (length == 0)
-                continue;
-
-            if (strncmp(line, "SEARCH2 ", 8) == 0) {
-                char *key = line + 8;
-                int match_count;
-
-                if (validate_text_value(key, KEY_MAX, 0) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid search key\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
-
-                if (search_records_v2(
-                        &database,
-                        client_socket,
-                        key,
-                        &match_count) < 0) {
-                    break;
-                }
-                fprintf(
-                    stderr,
-                    "SEARCH2 for '%s' completed: %d match(es) found\n",
-                    key,
-                    match_count);
-            } else if (strncmp(line, "SEARCH ", 7) == 0) {
-                char *key = line + 7;
-                int match_count;
-
-                if (validate_text_value(key, KEY_MAX, 0) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid search key\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
-
-                if (search_records(
-                        &database,
-                        client_socket,
-                        key,
-                        &match_count) < 0) {
-                    break;
-                }
-                fprintf(
-                    stderr,
-                    "SEARCH for '%s' completed: %d match(es) found\n",
-                    key,
-                    match_count);
-            } else if (strncmp(line, "ADD ", 4) == 0) {
-                char *data = line + 4;
-                char *pipe = strchr(data, '|');
-                char *name;
-                char *message;
-                uint64_t assigned_id;
-                enum MutationResult result;
-
-                if (!pipe || strchr(pipe + 1, '|')) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid ADD format\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
-                *pipe = '\0';
-                name = data;
-                message = pipe + 1;
-
-                if (validate_text_value(name, MAX_NAME_LEN, 1) < 0 ||
-                    validate_text_value(message, MAX_MSG_LEN, 1) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid name or message\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
-
-                result = atomic_add(
-                    &database,
-                    filename,
-                    name,
-                    message,
-                    &assigned_id);
-                if (result == MUTATION_OK) {
-                    char response[64];
-                    int response_length = snprintf(
-                        response,
-                        sizeof(response),
-                        "OK %" PRIu64 "\n",
-                        assigned_id);
-                    if (response_length < 0 ||
-                        (size_t)response_length >= sizeof(response) ||
-                        write_all(
-                            client_socket,
-                            response,
-                            (size_t)response_length) < 0) {
-                        break;
-                    }
-                } else if (send_mutation_error(
-                               client_socket, result, "add") < 0) {
-                    break;
-                }
-            } else if (strncmp(line, "DELETE ", 7) == 0) {
-                uint64_t id;
-                enum MutationResult result;
-
-                if (parse_positive_u64(line + 7, &id) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid record ID\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
+        }
 
-                result = atomic_delete(&database, filename, id);
-                if (result == MUTATION_OK) {
-                    if (send_text(client_socket, "OK\n") < 0)
-                        break;
-                } else if (send_mutation_error(
-                               client_socket, result, "delete") < 0) {
-                    break;
-                }
-            } else if (strncmp(line, "UPDATE ", 7) == 0) {
-                char *data = line + 7;
-                char *first_pipe = strchr(data, '|');
-                char *second_pipe;
-                char *name;
-                char *message;
-                uint64_t id;
-                enum MutationResult result;
-
-                if (!first_pipe) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid UPDATE format\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
-                *first_pipe = '\0';
-                if (parse_positive_u64(data, &id) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid record ID\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
+        if (descriptors[0].revents & POLLIN) {
+            struct Client *client = accept_client(server_socket);
+
+            if (client) {
+                clients[client_count++] = client;
+            } else if (errno != EINTR && errno != ECONNABORTED &&
+                       errno != EMFILE && errno != ENFILE &&
+                       errno != ENOMEM) {
+                database_free(&database);
+                close(server_socket);
+                die("accept");
+            }
+        }
 
-                second_pipe = strchr(first_pipe + 1, '|');
-                if (!second_pipe || strchr(second_pipe + 1, '|')) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid UPDATE format\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
-                *second_pipe = '\0';
-                name = first_pipe + 1;
-                message = second_pipe + 1;
-
-                if (validate_text_value(name, MAX_NAME_LEN, 1) < 0 ||
-                    validate_text_value(message, MAX_MSG_LEN, 1) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid name or message\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
+        if (storage.batch_open &&
+            monotonic_us() >= storage.batch_deadline_us) {
+            batch_flush(&storage, &database);
+        }
 
-                result = atomic_update(
-                    &database,
-                    filename,
-                    id,
-                    name,
-                    message);
-                if (result == MUTATION_OK) {
-                    if (send_text(client_socket, "OK\n") < 0)
-                        break;
-                } else if (send_mutation_error(
-                               client_socket, result, "update") < 0) {
-                    break;
-                }
-            } else if (strcmp(line, "LIST2") == 0) {
-                if (list_all_records_v2(&database, client_socket) < 0)
-                    break;
-            } else if (strcmp(line, "LIST") == 0) {
-                if (list_all_records(&database, client_socket) < 0)
-                    break;
-            } else if (strcmp(line, "SAVE") == 0) {
-                if (persist_database(filename, &database) == 0) {
-                    if (send_text(client_socket, "OK\n") < 0)
-                        break;
-                } else if (send_text(
-                               client_socket,
-                               "ERROR: Failed to save\n") < 0) {
-                    break;
-                }
-            } else {
-                int match_count;
-
-                if (validate_text_value(line, KEY_MAX, 0) < 0) {
-                    if (send_text(
-                            client_socket,
-                            "ERROR: Invalid search key\n") < 0) {
-                        break;
-                    }
-                    continue;
-                }
+        index = client_count;
+        while (index > 0) {
+            struct Client *client = clients[--index];
 
-                if (search_records(
-                        &database,
-                        client_socket,
-                        line,
-                        &match_count) < 0) {
-                    break;
-                }
-                fprintf(
-                    stderr,
-                    "Search for '%s' completed: %d match(es) found\n",
-                    line,
-                    match_count);
+            if (!client->broken && !client->paused &&
+                client->backlog_used > 0 &&
+                client_resume(&database, &storage, client) < 0) {
+                client->broken = 1;
+            }
+            if (client->broken) {
+                disconnect_client(client);
+                clients[index] = clients[--client_count];
             }
         }
-
-        close(client_socket);
-        fprintf(
-            stderr,
-            "connection terminated from: %s\n",
-            inet_ntoa(client_address.sin_addr));
     }
 }
@@ -1,9 +1,14 @@
+import gzip
 import hashlib
 import html
 import http.client
+import json
 import os
 from pathlib import Path
 import re
+import resource
+import shutil
+import signal
 import socket
 import stat
 import struct
@@ -13,6 +18,7 @@ import threading
 import time
 import unittest
 from urllib.parse import urlencode
+import zlib
 
 
 PROJECT_ROOT = Path(__file__).resolve().parents[1]
@@ -35,6 +41,9 @@ MDB2_MAGIC = b"MDB2\r\n\x1a\n"
 MDB2_VERSION = 1
 MDB2_HEADER = struct.Struct("<8sIQQ")
 MDB2_RECORD = struct.Struct("<Q16s24s")
+MUTATION_LOG_MAGIC = b"MDBL\r\n\x1a\n"
+MUTATION_LOG_HEADER = struct.Struct("<8sI4x")
+MUTATION_LOG_ENTRY = struct.Struct("<Ic3xQ16s24s")
 
 
 def unused_port():
@@ -127,6 +136,41 @@ def parse_mdb2(data):
     return next_id, records
 
 
+def read_stored_records(path):
+    """Returns the snapshot at path with its mutation log replayed."""
+    next_id, records = parse_mdb2(path.read_bytes())
+    by_id = {record_id: (name, msg) for record_id, name, msg in records}
+    log_path = path.with_name(path.name + ".wal")
+    data = log_path.read_bytes() if log_path.exists() else b""
+
+    if data:
+        magic, version = MUTATION_LOG_HEADER.unpack_from(data)
+        if magic != MUTATION_LOG_MAGIC or version != 1:
+            raise ValueError("invalid mutation log header")
+    offset = MUTATION_LOG_HEADER.size
+    while len(data) - offset >= MUTATION_LOG_ENTRY.size:
+        checksum, kind, record_id, raw_name, raw_message = (
+            MUTATION_LOG_ENTRY.unpack_from(data, offset)
+        )
+        body = data[offset + 4 : offset + MUTATION_LOG_ENTRY.size]
+        if checksum != zlib.crc32(body):
+            break
+        name = raw_name.split(b"\0", 1)[0].decode("ascii")
+        message = raw_message.split(b"\0", 1)[0].decode("ascii")
+        if kind == b"A" and record_id >= next_id:
+            by_id[record_id] = (name, message)
+            next_id = record_id + 1
+        elif kind == b"U" and record_id in by_id:
+            by_id[record_id] = (name, message)
+        elif kind == b"D":
+            by_id.pop(record_id, None)
+        offset += MUTATION_LOG_ENTRY.size
+
+    return next_id, [
+        (record_id, *by_id[record_id]) for record_id in sorted(by_id)
+    ]
+
+
 def parse_http_response(raw_response):
     header_block, separator, body = raw_response.partition(b"\r\n\r\n")
     if not separator:
@@ -241,8 +285,10 @@ class OneShotHttpServer:
 
 
 class RunningSystem:
-    def __init__(self, record_count=32):
+    def __init__(self, record_count=32, http_args=(), db_args=()):
         self.record_count = record_count
+        self.http_args = list(http_args)
+        self.db_args = list(db_args)
         self.temp_dir = None
         self.db_process = None
         self.http_process = None
@@ -281,12 +327,18 @@ class RunningSystem:
             raise
         return self
 
-    def start_database(self):
+    def start_database(self, preexec_fn=None):
         self.db_process = subprocess.Popen(
-            [str(DB_SERVER), str(self.database), str(self.db_port)],
+            [
+                str(DB_SERVER),
+                *self.db_args,
+                str(self.database),
+                str(self.db_port),
+            ],
             cwd=PROJECT_ROOT,
             stdout=self.db_log,
             stderr=subprocess.STDOUT,
+            preexec_fn=preexec_fn,
         )
         wait_for_port(self.db_port, self.db_process)
 
@@ -294,6 +346,7 @@ class RunningSystem:
         self.http_process = subprocess.Popen(
             [
                 str(HTTP_SERVER),
+                *self.http_args,
                 str(self.http_port),
                 str(self.web_root),
                 "127.0.0.1",
@@ -432,6 +485,34 @@ class RoutingTests(unittest.TestCase):
             self.assertEqual(status, 200)
             self.assertIn(b"ENTRY NOT FOUND", missing)
 
+    def test_cached_search_results_follow_mutations_from_every_worker(self):
+        with RunningSystem(http_args=("--workers", "2")) as system:
+            def search(key):
+                status, _, body = system.request("GET", f"/mdb-lookup?key={key}")
+                self.assertEqual(status, 200)
+                return body
+
+            for _ in range(4):
+                self.assertIn(b"ENTRY NOT FOUND", search("CacheProbe"))
+
+            status, _, _ = system.post_form("/mdb-add", {"name": "CacheProbe", "msg": "first"})
+            self.assertEqual(status, 302)
+            for _ in range(4):
+                self.assertIn(b"first", search("cacheprobe"))
+
+            record_id = system.list_records()["CacheProbe"][0]
+            status, _, _ = system.post_form(
+                "/mdb-update", {"id": str(record_id), "name": "CacheProbe", "msg": "second"}
+            )
+            self.assertEqual(status, 302)
+            for _ in range(4):
+                self.assertIn(b"second", search("CacheProbe"))
+
+            status, _, _ = system.post_form("/mdb-delete", {"id": str(record_id)})
+            self.assertEqual(status, 302)
+            for _ in range(4):
+                self.assertIn(b"ENTRY NOT FOUND", search("CacheProbe"))
+
     def test_search_rejects_missing_empty_duplicate_and_malformed_keys(self):
         with RunningSystem() as system:
             targets = [
@@ -484,6 +565,121 @@ class RoutingTests(unittest.TestCase):
             status, _, _ = system.request("GET", "/mdb-edit?id=999999")
             self.assertEqual(status, 404)
 
+    def test_list_pages_follow_next_and_previous_links(self):
+        row_id = re.compile(rb"<tr><td>([0-9]+)</td>")
+
+        def page(target):
+            status, _, body = system.request("GET", target)
+            self.assertEqual(status, 200, target)
+            links = {
+                label.decode(): html.unescape(href.decode())
+                for href, label in re.findall(
+                    rb'<a href="(/mdb-list\?[^"]*)">(\w+)</a>', body
+                )
+            }
+            return [int(value) for value in row_id.findall(body)], links
+
+        with RunningSystem(record_count=32) as system:
+            ids, links = page("/mdb-list?limit=10")
+            self.assertEqual(ids, list(range(1, 11)))
+            self.assertNotIn("Previous", links)
+            self.assertEqual(links["Next"], "/mdb-list?limit=10&after=10")
+
+            ids, links = page(links["Next"])
+            self.assertEqual(ids, list(range(11, 21)))
+            self.assertEqual(links["Previous"], "/mdb-list?limit=10&before=11")
+
+            ids, links = page(links["Previous"])
+            self.assertEqual(ids, list(range(1, 11)))
+            self.assertNotIn("Previous", links)
+
+            status, _, _ = system.post_form("/mdb-delete", {"id": "15"})
+            self.assertEqual(status, 302)
+            status, _, _ = system.post_form(
+                "/mdb-add", {"name": "PagedName", "msg": "PagedMessage"}
+            )
+            self.assertEqual(status, 302)
+
+            ids, _ = page("/mdb-list?limit=10&after=10")
+            self.assertEqual(ids, [11, 12, 13, 14, 16, 17, 18, 19, 20, 21])
+            ids, links = page("/mdb-list?after=30&limit=10")
+            self.assertEqual(ids, [31, 32, 33])
+            self.assertNotIn("Next", links)
+            self.assertEqual(links["Previous"], "/mdb-list?limit=10&before=31")
+            ids, links = page("/mdb-list?limit=10&after=999999")
+            self.assertEqual(ids, [])
+            self.assertEqual(links["First"], "/mdb-list?limit=10")
+
+            for target in (
+                "/mdb-list?limit=0",
+                "/mdb-list?limit=1001",
+                "/mdb-list?after=x",
+                "/mdb-list?after=0",
+                "/mdb-list?after=1&before=5",
+                "/mdb-list?limit=5&limit=6",
+            ):
+                with self.subTest(target=target):
+                    status, _, _ = system.request("GET", target)
+                    self.assertEqual(status, 400)
+
+    def test_json_api_returns_records_searches_and_errors(self):
+        def ndjson(body):
+            return [json.loads(line) for line in body.decode().splitlines()]
+
+        with RunningSystem(record_count=1024) as system:
+            status, headers, body = system.request("GET", "/api/records")
+            self.assertEqual(status, 200)
+            self.assertEqual(headers["Content-Type"], "application/x-ndjson")
+            records = ndjson(body)
+            self.assertEqual(len(records), 1024)
+            self.assertIn(
+                {"id": 1, "name": "RouteAlpha", "message": "KnownMessage"},
+                records,
+            )
+
+            status, headers, body = system.request("GET", "/api/records/2")
+            self.assertEqual(status, 200)
+            self.assertEqual(headers["Content-Type"], "application/json")
+            self.assertEqual(
+                json.loads(body),
+                {"id": 2, "name": "SecondRecord", "message": "OtherMessage"},
+            )
+
+            status, _, _ = system.post_form(
+                "/mdb-add", {"name": 'Q"\\<>&\'', "msg": "JsonNeedle {}"}
+            )
+            self.assertEqual(status, 302)
+            status, headers, body = system.request(
+                "GET", "/api/search?key=jsonneedle"
+            )
+            self.assertEqual(status, 200)
+            self.assertIn("Content-Length", headers)
+            self.assertEqual(
+                ndjson(body),
+                [{"id": 1025, "name": 'Q"\\<>&\'', "message": "JsonNeedle {}"}],
+            )
+            status, _, body = system.request(
+                "GET", "/api/search?key=NeverPresent987"
+            )
+            self.assertEqual((status, body), (200, b""))
+
+            for target, expected in (
+                ("/api/records/999999", 404),
+                ("/api/records/0", 400),
+                ("/api/records/abc", 400),
+                ("/api/search", 400),
+                ("/api/search?key=%20", 400),
+            ):
+                with self.subTest(target=target):
+                    status, headers, body = system.request("GET", target)
+                    self.assertEqual(status, expected)
+                    self.assertEqual(headers["Content-Type"], "application/json")
+                    self.assertIn("error", json.loads(body))
+
+            status, headers, _ = system.post_form("/api/records", {"id": "1"})
+            self.assertEqual(status, 405)
+            self.assertEqual(headers.get("Allow"), "GET")
+
 
 class ProtocolValidationTests(unittest.TestCase):
     def assert_rejected_without_mutation(self, system, body):
@@ -567,7 +763,8 @@ class ProtocolValidationTests(unittest.TestCase):
             self.assertEqual(status, 302)
             self.assertEqual(headers.get("Location"), "/mdb-list")
             self.assertIn(b"UpdatedName", system.list_snapshot())
-            self.assertIn(b"UpdatedName", system.database.read_bytes())
+            _, stored = read_stored_records(system.database)
+            self.assertIn("UpdatedName", {name for _, name, _ in stored})
 
             status, _, edit = system.request("GET", "/mdb-edit?id=1")
             self.assertEqual(status, 200)
@@ -577,7 +774,8 @@ class ProtocolValidationTests(unittest.TestCase):
             self.assertEqual(status, 302)
             self.assertEqual(headers.get("Location"), "/mdb-list")
             self.assertNotIn(b"UpdatedName", system.list_snapshot())
-            self.assertNotIn(b"UpdatedName", system.database.read_bytes())
+            _, stored = read_stored_records(system.database)
+            self.assertNotIn("UpdatedName", {name for _, name, _ in stored})
 
     def test_search_command_words_are_literal_and_newlines_are_rejected(self):
         with RunningSystem() as system:
@@ -934,6 +1132,44 @@ class HttpRequestValidationTests(unittest.TestCase):
             status, _, _ = system.raw_request(aggregate_headers)
             self.assertEqual(status, 431)
 
+    def test_requests_split_across_many_reads_are_parsed_exactly(self):
+        def send_in_pieces(system, request_bytes, piece=7):
+            with socket.create_connection(
+                ("127.0.0.1", system.http_port), timeout=3
+            ) as sock:
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                for offset in range(0, len(request_bytes), piece):
+                    sock.sendall(request_bytes[offset:offset + piece])
+                    time.sleep(0.002)
+                response = bytearray()
+                while True:
+                    chunk = sock.recv(4096)
+                    if not chunk:
+                        break
+                    response.extend(chunk)
+            return parse_http_response(bytes(response))
+
+        with RunningSystem() as system:
+            request = (
+                b"GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+                + b"".join(
+                    f"X-Client-Hint-{index}: {'v' * 40}\r\n".encode("ascii")
+                    for index in range(20)
+                )
+                + b"if-none-match: \"other\"\r\nCONNECTION: close\r\n\r\n"
+            )
+            status, _, body = send_in_pieces(system, request)
+            self.assertEqual(status, 200)
+            self.assertEqual(body, system.index_body)
+
+            for bad in (
+                b"GET /index.html HTTP/1.1\r\nX-Late: abcdefghijkl\x00mn\r\n\r\n",
+                b"GET /index.html HTTP/1.1\r\nX-Fold: a\r\n  folded\r\n\r\n",
+                b"GET /index.html HTTP/1.1\r\nX-Bare: a\rb\r\n\r\n",
+            ):
+                status, _, _ = send_in_pieces(system, bad)
+                self.assertEqual(status, 400, bad)
+
     def test_post_to_static_resource_returns_method_not_allowed(self):
         with RunningSystem() as system:
             status, headers, _ = system.request(
@@ -1098,6 +1334,135 @@ class PersistenceAndStableIdTests(unittest.TestCase):
                 replacement_id,
             )
 
+    def test_logged_mutations_replay_and_unfinished_entries_are_cut(self):
+        with RunningSystem() as system:
+            log = system.database.with_name(system.database.name + ".wal")
+            self.assertFalse(log.exists())
+
+            # The first mutation migrates the legacy file and starts the log.
+            status, _, _ = system.post_form(
+                "/mdb-add",
+                {"name": "Migrates", "msg": "Snapshot"},
+            )
+            self.assertEqual(status, 302)
+            snapshot = system.database.read_bytes()
+            self.assertEqual(log.stat().st_size, MUTATION_LOG_HEADER.size)
+
+            route_id = system.list_records()["RouteAlpha"][0]
+            status, _, _ = system.post_form(
+                "/mdb-add",
+                {"name": "LoggedAdd", "msg": "Appended"},
+            )
+            self.assertEqual(status, 302)
+            status, _, _ = system.post_form(
+                "/mdb-update",
+                {"id": str(route_id), "name": "LoggedUpdate", "msg": "Appended"},
+            )
+            self.assertEqual(status, 302)
+            self.assertEqual(system.database.read_bytes(), snapshot)
+            logged_size = MUTATION_LOG_HEADER.size + 2 * MUTATION_LOG_ENTRY.size
+            self.assertEqual(log.stat().st_size, logged_size)
+            expected = system.list_records()
+            self.assertIn("LoggedUpdate", expected)
+
+            system.stop_servers()
+            with log.open("ab") as stream:
+                stream.write(b"\x01" * (MUTATION_LOG_ENTRY.size + 7))
+            system.start_database()
+            system.start_http()
+
+            self.assertEqual(system.list_records(), expected)
+            self.assertEqual(log.stat().st_size, logged_size)
+            self.assertIn(
+                b"Replayed 2 logged mutations",
+                (system.root / "database.log").read_bytes(),
+            )
+
+    def test_background_compaction_folds_the_log_into_the_snapshot(self):
+        with RunningSystem(db_args=("--compact-bytes", "1024")) as system:
+            log = system.database.with_name(system.database.name + ".wal")
+            for index in range(40):
+                status, _, _ = system.post_form(
+                    "/mdb-add",
+                    {"name": f"Compact{index}", "msg": "Folded"},
+                )
+                self.assertEqual(status, 302)
+            expected = system.list_records()
+
+            deadline = time.monotonic() + 5
+            while True:
+                _, snapshot = parse_mdb2(system.database.read_bytes())
+                folded = {name for _, name, _ in snapshot}
+                if "Compact10" in folded:
+                    break
+                if time.monotonic() > deadline:
+                    self.fail("the log was never compacted")
+                time.sleep(0.05)
+
+            self.assertLess(
+                log.stat().st_size,
+                MUTATION_LOG_HEADER.size + 39 * MUTATION_LOG_ENTRY.size,
+            )
+            _, stored = read_stored_records(system.database)
+            self.assertEqual(
+                {name: (record_id, msg) for record_id, name, msg in stored},
+                expected,
+            )
+
+            system.restart()
+            self.assertEqual(system.list_records(), expected)
+
+    @unittest.skipUnless(
+        hasattr(resource, "prlimit"),
+        "needs prlimit to make log appends fail",
+    )
+    def test_log_append_failure_changes_neither_memory_nor_disk(self):
+        with RunningSystem() as system:
+            log = system.database.with_name(system.database.name + ".wal")
+            status, _, _ = system.post_form(
+                "/mdb-add",
+                {"name": "Migrates", "msg": "Snapshot"},
+            )
+            self.assertEqual(status, 302)
+            before_records = system.list_records()
+            before_snapshot = system.database.read_bytes()
+            before_log = log.read_bytes()
+
+            _, hard_limit = resource.prlimit(
+                system.db_process.pid,
+                resource.RLIMIT_FSIZE,
+                (len(before_log), resource.RLIM_INFINITY),
+            )
+            try:
+                status, _, _ = system.post_form(
+                    "/mdb-add",
+                    {"name": "MustRollback", "msg": "NoDiskWrite"},
+                )
+                self.assertEqual(status, 500)
+                self.assertEqual(system.list_records(), before_records)
+                self.assertEqual(system.database.read_bytes(), before_snapshot)
+                self.assertEqual(log.read_bytes(), before_log)
+            finally:
+                resource.prlimit(
+                    system.db_process.pid,
+                    resource.RLIMIT_FSIZE,
+                    (hard_limit, hard_limit),
+                )
+
+            # The next mutation rewrites the snapshot and starts a new log.
+            status, _, _ = system.post_form(
+                "/mdb-add",
+                {"name": "AfterFailure", "msg": "Durable"},
+            )
+            self.assertEqual(status, 302)
+            self.assertEqual(log.stat().st_size, MUTATION_LOG_HEADER.size)
+            expected = system.list_records()
+            self.assertIn("AfterFailure", expected)
+            self.assertNotIn("MustRollback", expected)
+
+            system.restart()
+            self.assertEqual(system.list_records(), expected)
+
     @unittest.skipUnless(
         os.name == "posix" and hasattr(os, "chmod"),
         "requires POSIX directory permissions",
@@ -1210,6 +1575,1033 @@ class StaticPathContainmentTests(unittest.TestCase):
             self.assertEqual(index, system.index_body)
 
 
+class StaticCacheTests(unittest.TestCase):
+    def test_cached_files_follow_changes_on_disk(self):
+        with RunningSystem() as system:
+            index = system.web_root / "index.html"
+            self.assertEqual(system.request("GET", "/index.html")[2], system.index_body)
+            self.assertEqual(system.request("GET", "//index.html")[2], system.index_body)
+
+            index.write_bytes(b"rewritten in place\n")
+            self.assertEqual(
+                system.request("GET", "/index.html")[2], b"rewritten in place\n"
+            )
+            self.assertEqual(system.request("GET", "/")[2], b"rewritten in place\n")
+
+            replacement = system.web_root / "replacement.tmp"
+            replacement.write_bytes(b"renamed over the original\n")
+            replacement.rename(index)
+            self.assertEqual(
+                system.request("GET", "/index.html")[2],
+                b"renamed over the original\n",
+            )
+
+            index.unlink()
+            self.assertEqual(system.request("GET", "/index.html")[0], 404)
+            self.assertEqual(system.request("GET", "/")[0], 404)
+
+    def test_nested_directory_changes_invalidate_entries(self):
+        with RunningSystem() as system:
+            docs = system.web_root / "docs"
+            (docs / "guide").mkdir(parents=True)
+            (docs / "guide" / "index.html").write_bytes(b"guide v1\n")
+            (docs / "page.html").write_bytes(b"page v1\n")
+
+            self.assertEqual(system.request("GET", "/docs/guide/")[2], b"guide v1\n")
+            self.assertEqual(system.request("GET", "/docs/page.html")[2], b"page v1\n")
+
+            (docs / "guide" / "index.html").write_bytes(b"guide v2\n")
+            self.assertEqual(system.request("GET", "/docs/guide/")[2], b"guide v2\n")
+            self.assertEqual(system.request("GET", "/docs/page.html")[2], b"page v1\n")
+
+            docs.rename(system.web_root / "moved")
+            self.assertEqual(system.request("GET", "/docs/page.html")[0], 404)
+            self.assertEqual(system.request("GET", "/docs/guide/")[0], 404)
+            self.assertEqual(system.request("GET", "/moved/page.html")[2], b"page v1\n")
+
+
+class ConditionalRequestTests(unittest.TestCase):
+    def test_matching_validators_return_not_modified(self):
+        with RunningSystem() as system:
+            for target in ("/index.html", "/large.bin"):
+                status, headers, _ = system.request("GET", target)
+                self.assertEqual(status, 200)
+                etag = headers["ETag"]
+                last_modified = headers["Last-Modified"]
+                self.assertRegex(etag, r'^"[0-9a-f.-]+"$')
+
+                connection = http.client.HTTPConnection(
+                    "127.0.0.1", system.http_port, timeout=5
+                )
+                try:
+                    for conditional in (
+                        {"If-None-Match": etag},
+                        {"If-None-Match": f'"other", W/{etag}'},
+                        {"If-None-Match": "*"},
+                        {"If-Modified-Since": last_modified},
+                    ):
+                        connection.request("GET", target, headers=conditional)
+                        response = connection.getresponse()
+                        self.assertEqual(response.status, 304, conditional)
+                        self.assertEqual(response.read(), b"")
+                        self.assertEqual(response.getheader("ETag"), etag)
+                        self.assertIsNone(response.getheader("Content-Length"))
+
+                    connection.request("GET", target, headers={"If-None-Match": '"other"'})
+                    response = connection.getresponse()
+                    self.assertEqual(response.status, 200)
+                    response.read()
+                finally:
+                    connection.close()
+
+    def test_stale_validators_and_unusable_dates_return_the_file(self):
+        with RunningSystem() as system:
+            index = system.web_root / "index.html"
+            status, headers, _ = system.request("GET", "/index.html")
+            etag = headers["ETag"]
+            last_modified = headers["Last-Modified"]
+
+            for conditional in (
+                {"If-Modified-Since": "Sun, 06 Nov 1994 08:49:37 GMT"},
+                {"If-Modified-Since": "not a date"},
+                {"If-None-Match": '"other"', "If-Modified-Since": last_modified},
+            ):
+                status, _, body = system.request("GET", "/index.html", headers=conditional)
+                self.assertEqual(status, 200, conditional)
+                self.assertEqual(body, system.index_body)
+
+            index.write_bytes(b"a newer version\n")
+            status, headers, body = system.request(
+                "GET", "/index.html", headers={"If-None-Match": etag}
+            )
+            self.assertEqual(status, 200)
+            self.assertEqual(body, b"a newer version\n")
+            self.assertNotEqual(headers["ETag"], etag)
+
+    def test_cache_control_depends_on_extension_and_is_configurable(self):
+        args = ("--cache-control", "jpg=no-store", "--cache-control", "default=private")
+        with RunningSystem(http_args=args) as system:
+            (system.web_root / "ship.jpg").write_bytes(b"\xff\xd8not-really-a-jpeg")
+            (system.web_root / "logo.png").write_bytes(b"\x89PNG")
+
+            self.assertEqual(system.request("GET", "/")[1]["Cache-Control"], "no-cache")
+            self.assertEqual(
+                system.request("GET", "/ship.jpg")[1]["Cache-Control"], "no-store"
+            )
+            self.assertEqual(
+                system.request("GET", "/logo.png")[1]["Cache-Control"],
+                "public, max-age=86400",
+            )
+            self.assertEqual(
+                system.request("GET", "/large.bin")[1]["Cache-Control"], "private"
+            )
+
+
+def parse_byteranges(content_type, body):
+    boundary = content_type.split("boundary=", 1)[1].encode("ascii")
+    parts = []
+    for chunk in body.split(b"--" + boundary)[1:]:
+        if chunk.startswith(b"--"):
+            break
+        header_block, _, data = chunk[2:].partition(b"\r\n\r\n")
+        headers = dict(
+            line.decode("ascii").split(": ", 1)
+            for line in header_block.split(b"\r\n")
+        )
+        parts.append((headers["Content-Range"], data[:-2]))
+    return parts
+
+
+class RangeRequestTests(unittest.TestCase):
+    def test_single_ranges_from_cached_and_streamed_files(self):
+        with RunningSystem() as system:
+            large = (system.web_root / "large.bin").read_bytes()
+            for target, content in (
+                ("/index.html", system.index_body),
+                ("/large.bin", large),
+            ):
+                size = len(content)
+                for header, first, last in (
+                    ("bytes=0-4", 0, 4),
+                    ("bytes=7-", 7, size - 1),
+                    ("bytes=-6", size - 6, size - 1),
+                    (f"bytes=10-{size + 100}", 10, size - 1),
+                ):
+                    status, headers, body = system.request(
+                        "GET", target, headers={"Range": header}
+                    )
+                    self.assertEqual(status, 206, header)
+                    self.assertEqual(
+                        headers["Content-Range"], f"bytes {first}-{last}/{size}"
+                    )
+                    self.assertEqual(headers["Accept-Ranges"], "bytes")
+                    self.assertEqual(body, content[first : last + 1])
+
+                status, headers, body = system.request(
+                    "GET", target, headers={"Range": f"bytes={size}-"}
+                )
+                self.assertEqual(status, 416)
+                self.assertEqual(headers["Content-Range"], f"bytes */{size}")
+
+    def test_multiple_ranges_use_multipart_byteranges(self):
+        with RunningSystem() as system:
+            large = (system.web_root / "large.bin").read_bytes()
+            connection = http.client.HTTPConnection(
+                "127.0.0.1", system.http_port, timeout=5
+            )
+            try:
+                for target, content in (
+                    ("/index.html", system.index_body),
+                    ("/large.bin", large),
+                ):
+                    size = len(content)
+                    connection.request(
+                        "GET", target, headers={"Range": "bytes=0-2, 5-9,-4"}
+                    )
+                    response = connection.getresponse()
+                    body = response.read()
+                    self.assertEqual(response.status, 206)
+                    self.assertEqual(int(response.getheader("Content-Length")), len(body))
+                    self.assertEqual(
+                        parse_byteranges(response.getheader("Content-Type"), body),
+                        [
+                            (f"bytes 0-2/{size}", content[0:3]),
+                            (f"bytes 5-9/{size}", content[5:10]),
+                            (f"bytes {size - 4}-{size - 1}/{size}", content[-4:]),
+                        ],
+                    )
+
+                connection.request("GET", "/index.html")
+                response = connection.getresponse()
+                self.assertEqual(response.read(), system.index_body)
+            finally:
+                connection.close()
+
+    def test_unusable_or_stale_ranges_send_the_whole_file(self):
+        with RunningSystem() as system:
+            status, headers, _ = system.request("GET", "/index.html")
+            etag = headers["ETag"]
+            for range_headers in (
+                {"Range": "bytes=5-2"},
+                {"Range": "items=0-1"},
+                {"Range": "bytes=0-20,0-20"},
+                {"Range": "bytes=0-1", "If-Range": '"stale"'},
+                {"Range": "bytes=0-1", "If-Range": "W/" + etag},
+            ):
+                status, _, body = system.request(
+                    "GET", "/index.html", headers=range_headers
+                )
+                self.assertEqual(status, 200, range_headers)
+                self.assertEqual(body, system.index_body)
+
+            status, _, body = system.request(
+                "GET", "/index.html", headers={"Range": "bytes=0-1", "If-Range": etag}
+            )
+            self.assertEqual(status, 206)
+            self.assertEqual(body, system.index_body[:2])
+
+
+class ContentEncodingTests(unittest.TestCase):
+    def test_precompressed_siblings_follow_accept_encoding(self):
+        with RunningSystem() as system:
+            page = b"<p>plain page</p>\n" * 40
+            (system.web_root / "page.html").write_bytes(page)
+            _, headers, body = system.request(
+                "GET", "/page.html", headers={"Accept-Encoding": "gzip, br"}
+            )
+            self.assertNotIn("Content-Encoding", headers)
+            self.assertEqual(body, page)
+
+            (system.web_root / "page.html.gz").write_bytes(gzip.compress(page))
+            (system.web_root / "page.html.br").write_bytes(b"pretend brotli")
+
+            status, headers, body = system.request(
+                "GET", "/page.html", headers={"Accept-Encoding": "gzip, br"}
+            )
+            self.assertEqual(status, 200)
+            self.assertEqual(headers["Content-Encoding"], "br")
+            self.assertEqual(headers["Content-Type"], "text/html")
+            self.assertEqual(headers["Vary"], "Accept-Encoding")
+            self.assertEqual(body, b"pretend brotli")
+            br_etag = headers["ETag"]
+
+            status, headers, body = system.request(
+                "GET", "/page.html", headers={"Accept-Encoding": "gzip, br;q=0"}
+            )
+            self.assertEqual(headers["Content-Encoding"], "gzip")
+            self.assertEqual(gzip.decompress(body), page)
+            self.assertNotEqual(headers["ETag"], br_etag)
+
+            status, headers, body = system.request("GET", "/page.html")
+            self.assertNotIn("Content-Encoding", headers)
+            self.assertEqual(headers["Vary"], "Accept-Encoding")
+            self.assertEqual(body, page)
+
+            status, headers, _ = system.request(
+                "GET",
+                "/page.html",
+                headers={"Accept-Encoding": "br", "If-None-Match": br_etag},
+            )
+            self.assertEqual(status, 304)
+
+            (system.web_root / "page.html.br").unlink()
+            status, headers, body = system.request(
+                "GET", "/page.html", headers={"Accept-Encoding": "*"}
+            )
+            self.assertEqual(headers["Content-Encoding"], "gzip")
+            self.assertEqual(gzip.decompress(body), page)
+
+    def test_text_and_generated_pages_are_gzipped_on_the_fly(self):
+        with RunningSystem(http_args=("--gzip", "6")) as system:
+            page = b"<tr><td>row</td></tr>\n" * 200
+            (system.web_root / "table.html").write_bytes(page)
+            accept = {"Accept-Encoding": "gzip, deflate"}
+
+            for _ in range(2):
+                status, headers, body = system.request("GET", "/table.html", headers=accept)
+                self.assertEqual(status, 200)
+                self.assertEqual(headers["Content-Encoding"], "gzip")
+                self.assertEqual(headers["Vary"], "Accept-Encoding")
+                self.assertEqual(gzip.decompress(body), page)
+                self.assertLess(len(body), len(page) // 10)
+
+            status, headers, body = system.request(
+                "GET", "/table.html", headers={"Accept-Encoding": "gzip", "Range": "bytes=0-9"}
+            )
+            self.assertEqual(status, 206)
+            self.assertEqual(headers["Content-Encoding"], "gzip")
+            self.assertEqual(body[:2], b"\x1f\x8b")
+
+            (system.web_root / "table.html").write_bytes(b"<p>short</p>\n" * 30)
+            _, headers, body = system.request("GET", "/table.html", headers=accept)
+            self.assertEqual(gzip.decompress(body), b"<p>short</p>\n" * 30)
+
+            _, headers, body = system.request("GET", "/large.bin", headers=accept)
+            self.assertNotIn("Content-Encoding", headers)
+
+            plain = system.list_snapshot()
+            self.assertIn(b"<table", plain)
+            status, headers, body = system.request("GET", "/mdb-list", headers=accept)
+            self.assertEqual(status, 200)
+            self.assertEqual(headers["Content-Encoding"], "gzip")
+            self.assertEqual(headers["Vary"], "Accept-Encoding")
+            self.assertEqual(gzip.decompress(body), plain)
+
+            status, headers, body = system.request(
+                "GET", "/mdb-lookup?key=User", headers=accept
+            )
+            self.assertEqual(status, 200)
+            self.assertEqual(headers["Content-Encoding"], "gzip")
+            self.assertIn(b"</table>", gzip.decompress(body))
+
+            status, headers, body = system.request(
+                "GET", "/mdb-list", headers={"Accept-Encoding": "gzip;q=0, *"}
+            )
+            self.assertNotIn("Content-Encoding", headers)
+            self.assertEqual(body, plain)
+
+
+class FakeBackend:
+    """Speaks the mdb-lookup-server protocol; "SEARCH2 slow" answers late."""
+
+    def __init__(self, delay=1.5):
+        self.delay = delay
+        self.generation = 1
+        self.rows = b"1\tRouteAlpha\tKnownMessage\n"
+        self.commands = []
+        self.listener = None
+        self.port = None
+        self.connections = []
+        self.accepted = 0
+        self.stop_event = threading.Event()
+
+    def __enter__(self):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(16)
+        self.listener.settimeout(0.1)
+        self.port = self.listener.getsockname()[1]
+        threading.Thread(target=self._accept, daemon=True).start()
+        return self
+
+    def _accept(self):
+        while not self.stop_event.is_set():
+            try:
+                connection, _ = self.listener.accept()
+            except socket.timeout:
+                continue
+            except OSError:
+                return
+            self.accepted += 1
+            self.connections.append(connection)
+            threading.Thread(target=self._serve, args=(connection,), daemon=True).start()
+
+    def _serve(self, connection):
+        reader = connection.makefile("rb")
+        try:
+            for line in reader:
+                command = line.rstrip(b"\n")
+                self.commands.append(command)
+                if command == b"GENERATION":
+                    connection.sendall(b"GENERATION %d\n" % self.generation)
+                elif command == b"SEARCH2 slow":
+                    time.sleep(self.delay)
+                    connection.sendall(b"7\tslow\tanswered late\n\n")
+                elif command.startswith(b"SEARCH2 ") or command == b"LIST2":
+                    connection.sendall(self.rows + b"\n")
+                else:
+                    connection.sendall(b"ERROR: unsupported\n")
+        except OSError:
+            pass
+
+    def drop_connections(self):
+        for connection in self.connections:
+            try:
+                connection.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            connection.close()
+        self.connections = []
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.stop_event.set()
+        self.listener.close()
+        self.drop_connections()
+
+
+class BackendPoolTests(unittest.TestCase):
+    def start_http(self, backend, web_root, *args):
+        port = unused_port()
+        process = subprocess.Popen(
+            [str(HTTP_SERVER), *args, str(port), str(web_root), "127.0.0.1", str(backend.port)],
+            cwd=PROJECT_ROOT,
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+        )
+        self.addCleanup(stop_process, process)
+        wait_for_port(port, process)
+        return port
+
+    def get(self, port, target):
+        connection = http.client.HTTPConnection("127.0.0.1", port, timeout=5)
+        try:
+            connection.request("GET", target)
+            response = connection.getresponse()
+            return response.status, response.read()
+        finally:
+            connection.close()
+
+    def test_slow_backend_request_does_not_delay_other_pages(self):
+        with FakeBackend() as backend, tempfile.TemporaryDirectory() as web_root:
+            Path(web_root, "index.html").write_bytes(b"static\n")
+            port = self.start_http(backend, web_root)
+            slow_result = []
+            slow = threading.Thread(
+                target=lambda: slow_result.append(self.get(port, "/mdb-lookup?key=slow"))
+            )
+            started = time.monotonic()
+            slow.start()
+            time.sleep(0.2)
+
+            status, body = self.get(port, "/mdb-lookup?key=Route")
+            self.assertEqual(status, 200)
+            self.assertIn(b"RouteAlpha", body)
+            self.assertEqual(self.get(port, "/mdb-list")[0], 200)
+            self.assertEqual(self.get(port, "/index.html"), (200, b"static\n"))
+            self.assertLess(time.monotonic() - started, backend.delay)
+
+            slow.join(timeout=5)
+            self.assertEqual(slow_result[0][0], 200)
+            self.assertIn(b"answered late", slow_result[0][1])
+            self.assertLessEqual(backend.accepted, 4)
+
+    def test_backend_queue_sheds_database_requests_with_retry_after(self):
+        for limits in (
+            ("--max-backend-queue", "1", "--queue-budget-ms", "0"),
+            ("--max-backend-queue", "100", "--queue-budget-ms", "200"),
+        ):
+            with self.subTest(limits=limits), FakeBackend() as backend, \
+                    tempfile.TemporaryDirectory() as web_root:
+                Path(web_root, "index.html").write_bytes(b"static\n")
+                port = self.start_http(
+                    backend, web_root, "--backend-connections", "1", *limits
+                )
+                results = []
+                threads = [
+                    threading.Thread(
+                        target=lambda key=key: results.append(
+                            self.get(port, f"/mdb-lookup?key={key}")[0]
+                        )
+                    )
+                    for key in ("slow", "queued")
+                ]
+                for thread in threads:
+                    thread.start()
+                    time.sleep(0.4)
+
+                started = time.monotonic()
+                connection = http.client.HTTPConnection("127.0.0.1", port, timeout=5)
+                connection.request("GET", "/api/records")
+                response = connection.getresponse()
+                response.read()
+                connection.close()
+                self.assertEqual(response.status, 503)
+                self.assertEqual(response.getheader("Retry-After"), "1")
+                self.assertLess(time.monotonic() - started, 0.5)
+                self.assertEqual(self.get(port, "/index.html"), (200, b"static\n"))
+
+                for thread in threads:
+                    thread.join(timeout=5)
+                self.assertEqual(results, [200, 200])
+                self.assertEqual(self.get(port, "/mdb-lookup?key=Route")[0], 200)
+
+    def test_connections_past_the_limit_get_503(self):
+        with FakeBackend() as backend, tempfile.TemporaryDirectory() as web_root:
+            Path(web_root, "index.html").write_bytes(b"static\n")
+            port = self.start_http(
+                backend, web_root, "--max-connections", "2", "--listen-backlog", "16"
+            )
+            idle = [socket.create_connection(("127.0.0.1", port)) for _ in range(2)]
+            time.sleep(0.2)
+            with socket.create_connection(("127.0.0.1", port), timeout=3) as sock:
+                sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                response = bytearray()
+                while True:
+                    chunk = sock.recv(4096)
+                    if not chunk:
+                        break
+                    response.extend(chunk)
+            status, headers, _ = parse_http_response(bytes(response))
+            self.assertEqual(status, 503)
+            self.assertEqual(headers.get("retry-after"), "1")
+
+            for sock in idle:
+                sock.close()
+            time.sleep(0.2)
+            self.assertEqual(self.get(port, "/index.html"), (200, b"static\n"))
+
+    def test_requests_queue_for_a_full_pool_and_survive_backend_resets(self):
+        with FakeBackend(delay=0.5) as backend, tempfile.TemporaryDirectory() as web_root:
+            port = self.start_http(backend, web_root, "--backend-connections", "1")
+            results = []
+            threads = [
+                threading.Thread(
+                    target=lambda key=key: results.append(
+                        self.get(port, f"/mdb-lookup?key={key}")
+                    )
+                )
+                for key in ("slow", "Route", "slow")
+            ]
+            for thread in threads:
+                thread.start()
+                time.sleep(0.05)
+            for thread in threads:
+                thread.join(timeout=5)
+            self.assertEqual(sorted(status for status, _ in results), [200, 200, 200])
+            self.assertEqual(backend.accepted, 1)
+
+            backend.drop_connections()
+            status, body = self.get(port, "/mdb-list")
+            self.assertEqual(status, 200)
+            self.assertIn(b"RouteAlpha", body)
+            self.assertEqual(backend.accepted, 2)
+
+    def test_repeated_searches_are_served_from_cache_until_generation_changes(self):
+        with FakeBackend() as backend, tempfile.TemporaryDirectory() as web_root:
+            port = self.start_http(backend, web_root)
+            searches = lambda: [c for c in backend.commands if c.startswith(b"SEARCH2 ")]
+
+            first = self.get(port, "/mdb-lookup?key=Route")
+            self.assertEqual(first[0], 200)
+            self.assertIn(b"RouteAlpha", first[1])
+            for target in ("/mdb-lookup?key=Route", "/mdb-lookup?key=+rOUTE+"):
+                status, body = self.get(port, target)
+                self.assertEqual(status, 200)
+                self.assertIn(b"RouteAlpha", body)
+            self.assertIn(b'value="rOUTE"', body)
+            self.assertEqual(searches(), [b"SEARCH2 Route"])
+
+            backend.generation += 1
+            self.assertEqual(self.get(port, "/mdb-lookup?key=Route"), first)
+            self.assertEqual(searches(), [b"SEARCH2 Route", b"SEARCH2 Route"])
+
+    def test_list_page_is_cached_and_rebuilt_when_generation_changes(self):
+        with FakeBackend() as backend, tempfile.TemporaryDirectory() as web_root:
+            port = self.start_http(backend, web_root, "--gzip", "6")
+            lists = lambda: backend.commands.count(b"LIST2")
+
+            def get_list(accept_encoding):
+                connection = http.client.HTTPConnection("127.0.0.1", port, timeout=5)
+                try:
+                    connection.request("GET", "/mdb-list", headers={"Accept-Encoding": accept_encoding})
+                    response = connection.getresponse()
+                    body = response.read()
+                    self.assertEqual(response.status, 200)
+                    if response.getheader("Content-Encoding") == "gzip":
+                        return gzip.decompress(body)
+                    return body
+                finally:
+                    connection.close()
+
+            plain = get_list("identity")
+            self.assertIn(b"RouteAlpha", plain)
+            self.assertEqual(get_list("gzip"), plain)
+            self.assertEqual(get_list("identity"), plain)
+            self.assertEqual(lists(), 1)
+
+            backend.rows = (
+                b"1\tRouteAlpha\tKnownMessage\n"
+                b"2\tSecond<Row>\tadded\n"
+            )
+            backend.generation += 1
+            rebuilt = get_list("gzip")
+            self.assertEqual(lists(), 2)
+            self.assertIn(b"Second&lt;Row&gt;", rebuilt)
+            self.assertEqual(rebuilt.count(b"RouteAlpha"), 1)
+            self.assertEqual(rebuilt, get_list("identity"))
+
+            backend.rows = b"2\tSecond<Row>\tchanged\n"
+            backend.generation += 1
+            final = get_list("identity")
+            self.assertNotIn(b"RouteAlpha", final)
+            self.assertIn(b"changed", final)
+            self.assertNotIn(b"added", final)
+            self.assertEqual(lists(), 3)
+
+
+class ConcurrentConnectionTests(unittest.TestCase):
+    def test_stalled_clients_do_not_delay_other_requests(self):
+        with RunningSystem() as system:
+            stalled = []
+            try:
+                for _ in range(20):
+                    sock = socket.create_connection(
+                        ("127.0.0.1", system.http_port), timeout=3
+                    )
+                    sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: loc")
+                    stalled.append(sock)
+
+                started = time.monotonic()
+                status, _, index = system.request("GET", "/index.html")
+                self.assertEqual(status, 200)
+                self.assertEqual(index, system.index_body)
+                status, _, search = system.request(
+                    "GET", "/mdb-lookup?key=RouteAlpha"
+                )
+                self.assertEqual(status, 200)
+                self.assertIn(b"RouteAlpha", search)
+                self.assertLess(time.monotonic() - started, 2)
+
+                stalled[0].sendall(b"alhost\r\nConnection: close\r\n\r\n")
+                stalled[0].settimeout(3)
+                response = bytearray()
+                while True:
+                    chunk = stalled[0].recv(4096)
+                    if not chunk:
+                        break
+                    response.extend(chunk)
+                status, _, body = parse_http_response(bytes(response))
+                self.assertEqual(status, 200)
+                self.assertEqual(body, system.index_body)
+            finally:
+                for sock in stalled:
+                    sock.close()
+
+    def test_list_page_in_flight_survives_a_rebuild(self):
+        with RunningSystem(record_count=20000) as system:
+            system.list_snapshot()
+            with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+                sock.settimeout(5)
+                sock.connect(("127.0.0.1", system.http_port))
+                sock.sendall(b"GET /mdb-list HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+                response = bytearray(sock.recv(4096))
+
+                status, _, _ = system.post_form("/mdb-update", {"id": "1", "name": "Rebuilt", "msg": "row"})
+                self.assertEqual(status, 302)
+                self.assertIn(b"Rebuilt", system.list_snapshot())
+
+                while True:
+                    chunk = sock.recv(65536)
+                    if not chunk:
+                        break
+                    response.extend(chunk)
+            status, headers, body = parse_http_response(bytes(response))
+            self.assertEqual(status, 200)
+            self.assertEqual(len(body), int(headers["content-length"]))
+            self.assertIn(b"RouteAlpha", body)
+            self.assertNotIn(b"Rebuilt", body)
+            self.assertTrue(body.endswith(b"</table></body></html>\n"))
+
+
+def decode_chunked(data):
+    """Decodes a complete chunked body; returns it and the bytes after it."""
+    body = bytearray()
+    while True:
+        size_end = data.index(b"\r\n")
+        size = int(data[:size_end], 16)
+        chunk_start = size_end + 2
+        if size == 0:
+            if data[chunk_start : chunk_start + 2] != b"\r\n":
+                raise AssertionError("missing chunked body terminator")
+            return bytes(body), data[chunk_start + 2 :]
+        body.extend(data[chunk_start : chunk_start + size])
+        if data[chunk_start + size : chunk_start + size + 2] != b"\r\n":
+            raise AssertionError("chunk is not followed by CRLF")
+        data = data[chunk_start + size + 2 :]
+
+
+class StreamedResponseTests(unittest.TestCase):
+    def read_until_closed(self, sock):
+        response = bytearray()
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                return bytes(response)
+            response.extend(chunk)
+
+    def test_large_results_stream_chunked_and_keep_the_connection(self):
+        with RunningSystem(record_count=20000) as system:
+            for target in ("/mdb-lookup?key=User", "/mdb-list"):
+                with socket.create_connection(("127.0.0.1", system.http_port), timeout=5) as sock:
+                    sock.sendall(
+                        f"GET {target} HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                        "GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n".encode()
+                    )
+                    raw = self.read_until_closed(sock)
+                header_block, _, rest = raw.partition(b"\r\n\r\n")
+                status, headers, _ = parse_http_response(header_block + b"\r\n\r\n")
+                self.assertEqual(status, 200)
+                self.assertEqual(headers.get("transfer-encoding"), "chunked")
+                self.assertNotIn("content-length", headers)
+                body, rest = decode_chunked(rest)
+                self.assertIn(b"User0000000002", body)
+                self.assertIn(b"User0000019999", body)
+                self.assertTrue(body.endswith(b"</table></body></html>\n") or body.endswith(b"</table>\n</body></html>\n"))
+                status, _, index = parse_http_response(rest)
+                self.assertEqual((status, index), (200, system.index_body))
+
+            with socket.create_connection(("127.0.0.1", system.http_port), timeout=5) as sock:
+                sock.sendall(
+                    b"GET /api/search?key=User HTTP/1.1\r\nHost: localhost\r\n"
+                    b"Connection: close\r\n\r\n"
+                )
+                raw = self.read_until_closed(sock)
+            header_block, _, rest = raw.partition(b"\r\n\r\n")
+            status, headers, _ = parse_http_response(header_block + b"\r\n\r\n")
+            self.assertEqual((status, headers.get("transfer-encoding")), (200, "chunked"))
+            body, _ = decode_chunked(rest)
+            rows = [json.loads(line) for line in body.splitlines()]
+            self.assertEqual(len(rows), 19998)
+            self.assertEqual(rows[-1]["name"], "User0000019999")
+
+            status, headers, body = system.request("GET", "/mdb-list")
+            self.assertEqual(status, 200)
+            self.assertIn("Content-Length", headers)
+            self.assertIn(b"User0000019999", body)
+
+            with socket.create_connection(("127.0.0.1", system.http_port), timeout=5) as sock:
+                sock.sendall(b"GET /mdb-lookup?key=User0000 HTTP/1.0\r\n\r\n")
+                status, headers, body = parse_http_response(self.read_until_closed(sock))
+            self.assertEqual(status, 200)
+            self.assertEqual(int(headers["content-length"]), len(body))
+            self.assertIn(b"User0000019999", body)
+
+
+def read_framed_responses(sock, count):
+    """Reads count Content-Length framed responses from one connection."""
+    data = bytearray()
+    responses = []
+    while len(responses) < count:
+        header_end = data.find(b"\r\n\r\n")
+        if header_end >= 0:
+            status, headers, _ = parse_http_response(bytes(data[: header_end + 4]))
+            end = header_end + 4 + int(headers["content-length"])
+            if len(data) >= end:
+                responses.append((status, headers, bytes(data[header_end + 4 : end])))
+                del data[:end]
+                continue
+        chunk = sock.recv(4096)
+        if not chunk:
+            raise AssertionError(f"connection closed after {len(responses)} responses")
+        data.extend(chunk)
+    return responses, bytes(data)
+
+
+class PersistentConnectionTests(unittest.TestCase):
+    def test_http11_connection_is_reused_across_requests(self):
+        with RunningSystem() as system:
+            connection = http.client.HTTPConnection(
+                "127.0.0.1", system.http_port, timeout=5
+            )
+            try:
+                connection.request("GET", "/index.html")
+                response = connection.getresponse()
+                self.assertEqual(response.read(), system.index_body)
+                self.assertIsNone(response.getheader("Connection"))
+                first_socket = connection.sock
+
+                connection.request("GET", "/mdb-lookup?key=RouteAlpha")
+                response = connection.getresponse()
+                self.assertEqual(response.status, 200)
+                self.assertIn(b"RouteAlpha", response.read())
+
+                body = urlencode({"name": "KeepAlive", "msg": "reused"})
+                connection.request(
+                    "POST",
+                    "/mdb-add",
+                    body,
+                    {"Content-Type": FORM_CONTENT_TYPE},
+                )
+                response = connection.getresponse()
+                self.assertEqual(response.status, 302)
+                self.assertEqual(response.getheader("Location"), "/mdb-list")
+                self.assertEqual(response.read(), b"")
+
+                connection.request("GET", "/missing.html")
+                response = connection.getresponse()
+                self.assertEqual(response.status, 404)
+                response.read()
+                self.assertIs(connection.sock, first_socket)
+            finally:
+                connection.close()
+            self.assertIn("KeepAlive", system.list_records())
+
+    def test_pipelined_requests_are_answered_in_order(self):
+        with RunningSystem() as system:
+            with socket.create_connection(
+                ("127.0.0.1", system.http_port), timeout=5
+            ) as sock:
+                sock.sendall(
+                    b"GET /mdb-lookup?key=RouteAlpha HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                    b"GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                    b"GET /missing.html HTTP/1.1\r\nHost: localhost\r\n"
+                    b"Connection: close\r\n\r\n"
+                    b"GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                )
+                responses, rest = read_framed_responses(sock, 3)
+                while True:
+                    chunk = sock.recv(4096)
+                    if not chunk:
+                        break
+                    rest += chunk
+
+            self.assertEqual([status for status, _, _ in responses], [200, 200, 404])
+            self.assertIn(b"RouteAlpha", responses[0][2])
+            self.assertEqual(responses[1][2], system.index_body)
+            self.assertEqual(responses[2][1].get("connection"), "close")
+            self.assertEqual(rest, b"")
+
+    def test_http10_and_request_limit_close_the_connection(self):
+        with RunningSystem(http_args=("--keepalive-requests", "2")) as system:
+            status, headers, body = system.raw_request(
+                b"GET /index.html HTTP/1.0\r\nHost: localhost\r\n\r\n"
+            )
+            self.assertEqual(status, 200)
+            self.assertEqual(headers.get("connection"), "close")
+            self.assertEqual(body, system.index_body)
+
+            with socket.create_connection(
+                ("127.0.0.1", system.http_port), timeout=5
+            ) as sock:
+                sock.sendall(
+                    b"GET /index.html HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+                )
+                (first,), _ = read_framed_responses(sock, 1)
+                self.assertEqual(first[1].get("connection"), "keep-alive")
+
+                sock.sendall(
+                    b"GET /index.html HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+                )
+                (second,), rest = read_framed_responses(sock, 1)
+                self.assertEqual(second[1].get("connection"), "close")
+                self.assertEqual(rest + sock.recv(4096), b"")
+
+    def test_idle_connection_closes_after_keepalive_timeout(self):
+        with RunningSystem(http_args=("--keepalive-timeout", "1")) as system:
+            with socket.create_connection(
+                ("127.0.0.1", system.http_port), timeout=5
+            ) as sock:
+                sock.sendall(b"GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                (response,), _ = read_framed_responses(sock, 1)
+                self.assertEqual(response[0], 200)
+
+                started = time.monotonic()
+                self.assertEqual(sock.recv(4096), b"")
+                self.assertLess(time.monotonic() - started, 4)
+
+
+def child_pids(pid):
+    completed = subprocess.run(
+        ["pgrep", "-P", str(pid)], capture_output=True, text=True
+    )
+    return {int(line) for line in completed.stdout.split()}
+
+
+@unittest.skipUnless(shutil.which("pgrep"), "requires pgrep")
+class WorkerProcessTests(unittest.TestCase):
+    def test_workers_serve_requests_and_crashed_workers_are_replaced(self):
+        with RunningSystem(http_args=["--workers", "3"]) as system:
+            # The first worker can accept before the last one is forked.
+            deadline = time.monotonic() + 5
+            workers = child_pids(system.http_process.pid)
+            while len(workers) < 3 and time.monotonic() < deadline:
+                time.sleep(0.05)
+                workers = child_pids(system.http_process.pid)
+            self.assertEqual(len(workers), 3)
+
+            for _ in range(12):
+                status, _, index = system.request("GET", "/index.html")
+                self.assertEqual(status, 200)
+                self.assertEqual(index, system.index_body)
+                status, _, search = system.request(
+                    "GET", "/mdb-lookup?key=RouteAlpha"
+                )
+                self.assertEqual(status, 200)
+                self.assertIn(b"RouteAlpha", search)
+
+            victim = min(workers)
+            os.kill(victim, signal.SIGKILL)
+            deadline = time.monotonic() + 5
+            replaced = set()
+            while time.monotonic() < deadline:
+                replaced = child_pids(system.http_process.pid)
+                if len(replaced) == 3 and victim not in replaced:
+                    break
+                time.sleep(0.05)
+            self.assertEqual(len(replaced), 3)
+            self.assertNotIn(victim, replaced)
+
+            for _ in range(6):
+                status, _, _ = system.request("GET", "/mdb-list")
+                self.assertEqual(status, 200)
+
+            supervisor = system.http_process.pid
+            stop_process(system.http_process)
+            self.assertEqual(child_pids(supervisor), set())
+
+    def test_worker_startup_failure_stops_the_supervisor(self):
+        with RunningSystem() as system:
+            process = subprocess.run(
+                [
+                    str(HTTP_SERVER),
+                    "--workers",
+                    "2",
+                    str(system.http_port),
+                    str(system.root / "missing"),
+                    "127.0.0.1",
+                    str(system.db_port),
+                ],
+                capture_output=True,
+                timeout=10,
+            )
+            self.assertNotEqual(process.returncode, 0)
+
+    def test_metrics_add_up_counters_from_every_worker(self):
+        def scrape():
+            status, headers, body = system.request("GET", "/metrics")
+            self.assertEqual(status, 200)
+            self.assertTrue(headers["Content-Type"].startswith("text/plain"))
+            samples = {}
+            for line in body.decode().splitlines():
+                if line and not line.startswith("#"):
+                    name, _, value = line.rpartition(" ")
+                    samples[name] = float(value)
+            return samples
+
+        with RunningSystem(http_args=["--workers", "2"]) as system:
+            for _ in range(10):
+                self.assertEqual(system.request("GET", "/index.html")[0], 200)
+            self.assertEqual(system.request("GET", "/missing.html")[0], 404)
+            self.assertEqual(system.request("GET", "/mdb-list")[0], 200)
+            self.assertEqual(
+                system.request("GET", "/mdb-lookup?key=RouteAlpha")[0], 200
+            )
+
+            samples = scrape()
+            requests = 'http_requests_total{route="%s",code="%s"}'
+            self.assertEqual(samples[requests % ("static", 200)], 10)
+            self.assertEqual(samples[requests % ("static", 404)], 1)
+            self.assertEqual(samples[requests % ("list", 200)], 1)
+            self.assertEqual(samples[requests % ("lookup", 200)], 1)
+            self.assertEqual(
+                samples["http_static_cache_hits_total"]
+                + samples["http_static_cache_misses_total"],
+                11,
+            )
+            self.assertGreaterEqual(samples["http_static_cache_hits_total"], 8)
+            self.assertGreaterEqual(samples["http_backend_connects_total"], 2)
+            self.assertGreater(samples['http_response_bytes_total{route="static"}'], 0)
+
+            for phase in ("parse", "backend"):
+                labels = 'route="static",phase="%s"' % phase
+                buckets = [
+                    value
+                    for name, value in samples.items()
+                    if name.startswith("http_request_phase_seconds_bucket{" + labels)
+                ]
+                self.assertEqual(buckets, sorted(buckets))
+                self.assertEqual(buckets[-1], 11)
+                self.assertEqual(
+                    samples["http_request_phase_seconds_count{%s}" % labels], 11
+                )
+
+            self.assertEqual(
+                scrape()[requests % ("metrics", 200)], 1
+            )
+            status, headers, _ = system.post_form("/metrics", {"x": "1"})
+            self.assertEqual(status, 405)
+            self.assertEqual(headers.get("Allow"), "GET")
+
+
+class AccessLogTests(unittest.TestCase):
+    def wait_for_log_lines(self, system, pattern, count):
+        deadline = time.monotonic() + 5
+        while True:
+            lines = re.findall(pattern, (system.root / "http.log").read_bytes())
+            if len(lines) >= count or time.monotonic() > deadline:
+                return lines
+            time.sleep(0.05)
+
+    def test_requests_are_logged_with_bytes_and_latency(self):
+        with RunningSystem() as system:
+            status, _, body = system.request("GET", "/index.html")
+            self.assertEqual(status, 200)
+            lines = self.wait_for_log_lines(
+                system,
+                rb'"GET /index.html HTTP/1.1" 200 OK bytes=([0-9]+) us=([0-9]+)\n',
+                1,
+            )
+            self.assertEqual(len(lines), 1)
+            self.assertGreater(int(lines[0][0]), len(body))
+
+    def test_sampling_keeps_server_errors(self):
+        with RunningSystem(http_args=["--log-sample", "3"]) as system:
+            for _ in range(6):
+                self.assertEqual(system.request("GET", "/index.html")[0], 200)
+            stop_process(system.db_process)
+            self.assertEqual(system.request("GET", "/mdb-list")[0], 503)
+
+            errors = self.wait_for_log_lines(
+                system, rb'"GET /mdb-list HTTP/1.1" 503 ', 1
+            )
+            self.assertEqual(len(errors), 1)
+            self.assertEqual(
+                len(self.wait_for_log_lines(system, rb'"GET /index.html ', 2)), 2
+            )
+
+    def test_invalid_log_options_are_rejected(self):
+        for option in (["--log-overflow", "later"], ["--log-sample", "0"]):
+            with self.subTest(option=option):
+                process = subprocess.run(
+                    [str(HTTP_SERVER), *option, "0", "html", "127.0.0.1", "1"],
+                    capture_output=True,
+                    timeout=10,
+                )
+                self.assertNotEqual(process.returncode, 0)
+
+
 class DisconnectTests(unittest.TestCase):
     def test_static_and_dynamic_resets_do_not_kill_or_desynchronize_servers(self):
         with RunningSystem(record_count=2048) as system:
@@ -1252,6 +2644,39 @@ class DisconnectTests(unittest.TestCase):
             )
 
 
+    def test_files_over_one_hundred_megabytes_are_streamed(self):
+        with RunningSystem() as system:
+            size = 120 * 1024 * 1024
+            with open(system.web_root / "huge.bin", "wb") as huge:
+                huge.seek(size - 16)
+                huge.write(b"end-of-huge-file")
+
+            connection = http.client.HTTPConnection(
+                "127.0.0.1", system.http_port, timeout=10
+            )
+            try:
+                connection.request("GET", "/huge.bin")
+                response = connection.getresponse()
+                self.assertEqual(response.status, 200)
+                self.assertEqual(int(response.getheader("Content-Length")), size)
+                received = 0
+                tail = b""
+                while True:
+                    chunk = response.read(1 << 20)
+                    if not chunk:
+                        break
+                    received += len(chunk)
+                    tail = (tail + chunk)[-16:]
+                self.assertEqual(received, size)
+                self.assertEqual(tail, b"end-of-huge-file")
+
+                connection.request("GET", "/index.html")
+                response = connection.getresponse()
+                self.assertEqual(response.read(), system.index_body)
+            finally:
+                connection.close()
+
+
 class HttpClientAtomicDownloadTests(unittest.TestCase):
     def test_existing_destination_is_never_clobbered(self):
         response_body = b"replacement-content-must-not-win\n"
@@ -1489,6 +2914,22 @@ class DirectBackendTests(unittest.TestCase):
                     stream.write(b"SEARCH2 NeverPresent987\n")
                     self.assertEqual(read_framed_response(), b"\n")
 
+                    stream.write(b"GET 1\n")
+                    self.assertEqual(
+                        stream.readline(),
+                        b"1\tBrace}Name\tValue} <>&\"'\n",
+                    )
+                    stream.write(b"GET 3\n")
+                    self.assertEqual(stream.readline(), b"3\tNameOnly\t\n")
+                    stream.write(b"GET 99\n")
+                    self.assertEqual(
+                        stream.readline(), b"ERROR: Record not found\n"
+                    )
+                    stream.write(b"GET x1\n")
+                    self.assertEqual(
+                        stream.readline(), b"ERROR: Invalid record ID\n"
+                    )
+
                     stream.write(b"ADD Bad\tName|Message\n")
                     self.assertEqual(
                         stream.readline(),
@@ -1513,9 +2954,235 @@ class DirectBackendTests(unittest.TestCase):
                         b"   3. {NameOnly},said {}\n\n",
                     )
 
+    def test_deleted_slots_are_skipped_by_scans_and_ranges(self):
+        with RunningSystem(record_count=2) as system:
+            system.stop_servers()
+            system.database.write_bytes(
+                MDB2_HEADER.pack(MDB2_MAGIC, MDB2_VERSION, 10, 3)
+                + b"".join(
+                    MDB2_RECORD.pack(
+                        record_id,
+                        name.ljust(16, b"\0"),
+                        b"Slot".ljust(24, b"\0"),
+                    )
+                    for record_id, name in (
+                        (5, b"Five"),
+                        (2, b"Two"),
+                        (9, b"Nine"),
+                    )
+                )
+            )
+            system.start_database()
+
+            with socket.create_connection(
+                ("127.0.0.1", system.db_port), timeout=3
+            ) as sock:
+                with sock.makefile("rwb", buffering=0) as stream:
+                    def read_framed_response():
+                        response = bytearray()
+                        while True:
+                            line = stream.readline()
+                            self.assertNotEqual(line, b"")
+                            response.extend(line)
+                            if line == b"\n":
+                                return bytes(response)
+
+                    stream.write(b"LIST2\n")
+                    self.assertEqual(
+                        read_framed_response(),
+                        b"2\tTwo\tSlot\n5\tFive\tSlot\n9\tNine\tSlot\n\n",
+                    )
+
+                    stream.write(b"ADD Ten|Slot\n")
+                    self.assertEqual(stream.readline(), b"OK 10\n")
+                    stream.write(b"DELETE 5\n")
+                    self.assertEqual(stream.readline(), b"OK\n")
+                    stream.write(b"DELETE 5\n")
+                    self.assertEqual(
+                        stream.readline(), b"ERROR: Record not found\n"
+                    )
+                    stream.write(b"GET 5\n")
+                    self.assertEqual(
+                        stream.readline(), b"ERROR: Record not found\n"
+                    )
+
+                    stream.write(b"SEARCH2 Slot\n")
+                    self.assertEqual(
+                        read_framed_response(),
+                        b"2\tTwo\tSlot\n9\tNine\tSlot\n10\tTen\tSlot\n\n",
+                    )
+                    stream.write(b"RANGE2 BEFORE 10 2\n")
+                    self.assertEqual(
+                        read_framed_response(),
+                        b"2\tTwo\tSlot\n9\tNine\tSlot\n\n",
+                    )
+                    stream.write(b"RANGE2 AFTER 2 1\n")
+                    self.assertEqual(
+                        read_framed_response(), b"9\tNine\tSlot\n\n"
+                    )
+
+            _, records = read_stored_records(system.database)
+            self.assertEqual(
+                [record[0] for record in records], [2, 9, 10]
+            )
+
+    def test_id_lookups_survive_table_growth_and_compaction(self):
+        with RunningSystem(record_count=2) as system:
+            stop_process(system.http_process)
+
+            with socket.create_connection(
+                ("127.0.0.1", system.db_port), timeout=3
+            ) as sock:
+                with sock.makefile("rwb", buffering=0) as stream:
+                    for index in range(150):
+                        stream.write(f"ADD Grow{index}|Table\n".encode())
+                        self.assertEqual(
+                            stream.readline(), f"OK {index + 3}\n".encode()
+                        )
+
+                    # Deleting most ids leaves more tombstones than live
+                    # records, so a later clone compacts and rebuilds.
+                    deleted = set(range(1, 153)) - set(range(5, 153, 7))
+                    for record_id in sorted(deleted):
+                        stream.write(f"DELETE {record_id}\n".encode())
+                        self.assertEqual(stream.readline(), b"OK\n")
+                    stream.write(b"UPDATE 12|Moved|Compacted\n")
+                    self.assertEqual(stream.readline(), b"OK\n")
+
+                    for record_id in range(1, 154):
+                        stream.write(f"GET {record_id}\n".encode())
+                        response = stream.readline()
+                        if record_id == 12:
+                            self.assertEqual(
+                                response, b"12\tMoved\tCompacted\n"
+                            )
+                        elif record_id in deleted or record_id == 153:
+                            self.assertEqual(
+                                response, b"ERROR: Record not found\n"
+                            )
+                        else:
+                            self.assertTrue(
+                                response.startswith(f"{record_id}\t".encode()),
+                                response,
+                            )
+
+    @unittest.skipUnless(
+        hasattr(resource, "prlimit"), "requires prlimit on another process"
+    )
+    def test_failed_writes_leave_shared_chunks_untouched(self):
+        # More records than one storage chunk holds.
+        with RunningSystem(record_count=1100) as system:
+            stop_process(system.http_process)
+            stop_process(system.db_process)
+            # A write past the file size limit must fail, not kill the server.
+            system.start_database(
+                preexec_fn=lambda: signal.signal(
+                    signal.SIGXFSZ, signal.SIG_IGN
+                )
+            )
+
+            with socket.create_connection(
+                ("127.0.0.1", system.db_port), timeout=3
+            ) as sock:
+                with sock.makefile("rwb", buffering=0) as stream:
+                    def get(record_id):
+                        stream.write(f"GET {record_id}\n".encode())
+                        return stream.readline()
+
+                    before = {record_id: get(record_id) for record_id in (3, 1030)}
+                    stream.write(b"ADD Before|Limit\n")
+                    self.assertEqual(stream.readline(), b"OK 1101\n")
+
+                    limit = resource.prlimit(
+                        system.db_process.pid, resource.RLIMIT_FSIZE
+                    )
+                    resource.prlimit(
+                        system.db_process.pid,
+                        resource.RLIMIT_FSIZE,
+                        (1, limit[1]),
+                    )
+                    try:
+                        # Each of these writes into a chunk the published
+                        # database shares, then fails to persist.
+                        for command, reply in (
+                            (b"ADD Never|Seen\n", b"added"),
+                            (b"UPDATE 3|Never|Seen\n", b"updated"),
+                            (b"UPDATE 1030|Never|Seen\n", b"updated"),
+                            (b"DELETE 1101\n", b"deleted"),
+                        ):
+                            stream.write(command)
+                            self.assertEqual(
+                                stream.readline(),
+                                b"ERROR: Failed to persist " + reply
+                                + b" record\n",
+                            )
+                    finally:
+                        resource.prlimit(
+                            system.db_process.pid, resource.RLIMIT_FSIZE, limit
+                        )
+
+                    for record_id, response in before.items():
+                        self.assertEqual(get(record_id), response)
+                    self.assertEqual(get(1101), b"1101\tBefore\tLimit\n")
+                    self.assertEqual(get(1102), b"ERROR: Record not found\n")
+
+                    stream.write(b"ADD After|Limit\n")
+                    self.assertEqual(stream.readline(), b"OK 1102\n")
+                    self.assertEqual(get(1102), b"1102\tAfter\tLimit\n")
+
+    def test_concurrent_mutations_commit_together_and_replies_stay_ordered(
+        self,
+    ):
+        with RunningSystem(
+            record_count=2, db_args=("--commit-window-us", "300000")
+        ) as system:
+            stop_process(system.http_process)
+
+            address = ("127.0.0.1", system.db_port)
+            with socket.create_connection(address, timeout=3) as first, \
+                    socket.create_connection(address, timeout=3) as second, \
+                    socket.create_connection(address, timeout=3) as reader:
+                first_stream = first.makefile("rwb", buffering=0)
+                second_stream = second.makefile("rwb", buffering=0)
+                reader_stream = reader.makefile("rwb", buffering=0)
+
+                started = time.monotonic()
+                # The GET queued behind the ADD must wait for its commit.
+                first_stream.write(b"ADD First|Batch\nGET 3\n")
+                time.sleep(0.05)
+                second_stream.write(b"ADD Second|Batch\n")
+
+                # Staged mutations stay invisible until the batch is synced.
+                reader_stream.write(b"GET 3\n")
+                self.assertEqual(
+                    reader_stream.readline(), b"ERROR: Record not found\n"
+                )
+                self.assertLess(time.monotonic() - started, 0.2)
+
+                self.assertEqual(first_stream.readline(), b"OK 3\n")
+                self.assertGreaterEqual(time.monotonic() - started, 0.2)
+                self.assertEqual(
+                    first_stream.readline(), b"3\tFirst\tBatch\n"
+                )
+                self.assertEqual(second_stream.readline(), b"OK 4\n")
+
+                reader_stream.write(b"GET 4\n")
+                self.assertEqual(
+                    reader_stream.readline(), b"4\tSecond\tBatch\n"
+                )
+
+                for stream in (first_stream, second_stream, reader_stream):
+                    stream.close()
+
+            _, stored = read_stored_records(system.database)
+            self.assertEqual(
+                stored[-2:],
+                [(3, "First", "Batch"), (4, "Second", "Batch")],
+            )
+
     def test_backend_rejects_malformed_commands_and_survives_reset(self):
         with RunningSystem(record_count=1024) as system:
-            # The database server handles one persistent connection at a time.
+            # Talk to the database server without the HTTP server's session.
             stop_process(system.http_process)
 
             with socket.create_connection(